@@ -3,4 +3,9 @@
 #
 # (Uses default behaviour of compiling all source files in directory, adding 'include' to include path.)
 
-COMPONENT_EMBED_TXTFILES := index.html
\ No newline at end of file
+# The web page is served pre-compressed, -n keeps the output (and its ETag) independent of the file time
+COMPONENT_EMBED_FILES := $(COMPONENT_BUILD_DIR)/index.html.gz
+COMPONENT_EXTRA_CLEAN := index.html.gz
+
+$(COMPONENT_BUILD_DIR)/index.html.gz: $(COMPONENT_PATH)/index.html
+	gzip -9 -n -c $< > $@
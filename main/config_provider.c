@@ -4,7 +4,15 @@
 #include "nvs_flash.h"
 #include "nvs.h"
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
 #include "main.h"
+#include "modbus.h"
+#include "modbus_mqtt.h"
+#include "modbus_poller.h"
+#include "modbus_sniff.h"
+#include "modbus_vslave.h"
 
 typedef esp_err_t (*validater_str_t)(const char*);
 typedef esp_err_t (*validater_u8_t)(uint8_t);
@@ -23,6 +31,7 @@ typedef struct config_def {
         validater_u8_t u8;
         validater_u32_t u32;
     } validate;
+    uint32_t apply;     // CFG_APPLY_*
 } config_def_t;
 
 static config_def_t config_defs[CFG_IDT_MAX] = {
@@ -35,73 +44,94 @@ static config_def_t config_defs[CFG_IDT_MAX] = {
     [CFG_WIFI_MAX_CONN_AP] =    {.name = "wifi_ap_conn",    .type = CFG_DATA_U8,    .default_val.u8 = WIFI_AP_MAX_CONN_DEFAULT, .validate.u8 = NULL},
     [CFG_WIFI_MODE] =           {.name = "wifi_mode",       .type = CFG_DATA_U8,    .default_val.u8 = 1,        .validate.u8 = NULL},
 
-    [CFG_UART_BAUD] =           {.name = "uart_baud_rate",  .type = CFG_DATA_U32,   .default_val.u32 = UART_BAUD_DEFAULT,    .validate.u32 = cpcb_check_set_baudrate},
-    [CFG_UART_PARITY] =         {.name = "uart_parity",     .type = CFG_DATA_U8,    .default_val.u8 = 0,        .validate.u8 = cpcb_check_set_parity},
-    [CFG_UART_TX_DELAY] =       {.name = "uart_tx_delay",   .type = CFG_DATA_U32,   .default_val.u32 = 1,       .validate.u32 = cpcb_check_set_tx_delay},
+    [CFG_UART_BAUD] =           {.name = "uart_baud_rate",  .type = CFG_DATA_U32,   .default_val.u32 = UART_BAUD_DEFAULT,    .validate.u32 = cpcb_check_baudrate,   .apply = CFG_APPLY_UART_FORMAT},
+    [CFG_UART_PARITY] =         {.name = "uart_parity",     .type = CFG_DATA_U8,    .default_val.u8 = 0,        .validate.u8 = cpcb_check_parity,       .apply = CFG_APPLY_UART_FORMAT},
+    [CFG_UART_TX_DELAY] =       {.name = "uart_tx_delay",   .type = CFG_DATA_U32,   .default_val.u32 = 1,       .validate.u32 = cpcb_check_tx_delay,    .apply = CFG_APPLY_UART_FORMAT},
+    [CFG_RTU_BCAST_DELAY] =     {.name = "rtu_bcast_delay", .type = CFG_DATA_U32,   .default_val.u32 = MODBUS_RTU_BCAST_DELAY_MS_DEFAULT, .validate.u32 = cpcb_check_bcast_delay, .apply = CFG_APPLY_RTU_BCAST},
+    [CFG_RTU_BCAST_ACK] =       {.name = "rtu_bcast_ack",   .type = CFG_DATA_U8,    .default_val.u8 = 0,        .validate.u8 = cpcb_check_bcast_ack,    .apply = CFG_APPLY_RTU_BCAST},
+    [CFG_RTU_RETRY_MAX] =       {.name = "rtu_retry_max",   .type = CFG_DATA_U8,    .default_val.u8 = MODBUS_RTU_RETRY_MAX_DEFAULT,     .validate.u8 = cpcb_check_retry_max,    .apply = CFG_APPLY_RTU_RETRY},
+    [CFG_RTU_RETRY_FCS] =       {.name = "rtu_retry_fcs",   .type = CFG_DATA_U32,   .default_val.u32 = MODBUS_RTU_RETRY_FCS_DEFAULT,    .validate.u32 = NULL,   .apply = CFG_APPLY_RTU_RETRY},
+    [CFG_POLL_LIST] =           {.name = "poll_list",       .type = CFG_DATA_STR,   .default_val.str = NULL,    .validate.str = cpcb_check_poll_list,   .apply = CFG_APPLY_POLL_LIST},
+    [CFG_RTU_RX_TIMEOUT] =      {.name = "rtu_rx_timeout",  .type = CFG_DATA_U32,   .default_val.u32 = MODBUS_RTU_RX_TIMEOUT_MS_DEFAULT,    .validate.u32 = cpcb_check_rx_timeout,  .apply = CFG_APPLY_RTU_TIMEOUT},
+    [CFG_POLL_STALE_PERIODS] =  {.name = "poll_stale",      .type = CFG_DATA_U8,    .default_val.u8 = MODBUS_POLL_STALE_PERIODS_DEFAULT,    .validate.u8 = cpcb_check_stale_periods,    .apply = CFG_APPLY_POLL_STALE},
+    [CFG_RTU_SNIFF] =           {.name = "rtu_sniff",       .type = CFG_DATA_U8,    .default_val.u8 = MODBUS_SNIFF_OFF,     .validate.u8 = cpcb_check_sniff_mode,   .apply = CFG_APPLY_RTU_SNIFF},
+    [CFG_VSLAVE_UID] =          {.name = "vslave_uid",      .type = CFG_DATA_U8,    .default_val.u8 = MODBUS_VSLAVE_UID_DEFAULT,    .validate.u8 = cpcb_check_vslave_uid,   .apply = CFG_APPLY_VSLAVE},
+    [CFG_MQTT_URI] =            {.name = "mqtt_uri",        .type = CFG_DATA_STR,   .default_val.str = NULL,    .validate.str = cpcb_check_mqtt_uri,    .apply = CFG_APPLY_MQTT},
+    [CFG_MQTT_TOPIC] =          {.name = "mqtt_topic",      .type = CFG_DATA_STR,   .default_val.str = MODBUS_MQTT_TOPIC_DEFAULT,   .validate.str = cpcb_check_mqtt_topic,  .apply = CFG_APPLY_MQTT},
+    [CFG_MQTT_INTEGRITY] =      {.name = "mqtt_integrity",  .type = CFG_DATA_U32,   .default_val.u32 = MODBUS_MQTT_INTEGRITY_S_DEFAULT, .validate.u32 = cpcb_check_mqtt_integrity,  .apply = CFG_APPLY_MQTT},
+    [CFG_TAG_LIST] =            {.name = "tag_list",        .type = CFG_DATA_STR,   .default_val.str = NULL,    .validate.str = cpcb_check_tag_list,    .apply = CFG_APPLY_TAGS},
 };
 
-enum cfg_data_idt cp_id_from_name(const char* name) {
-    for (enum cfg_data_idt i = 0; i<CFG_IDT_MAX; i++) {
-        if (strcmp(name, config_defs[i].name) == 0) {
-            return i;
-        }
-    }
+// Open addressing table from the FNV-1a hash of a name to its id + 1 (0 for an empty slot).
+// Built by cp_init() from config_defs, the size must be a power of 2 and at least twice CFG_IDT_MAX.
+#define CFG_NAME_HASH_SIZE  64
+_Static_assert(CFG_NAME_HASH_SIZE >= 2 * CFG_IDT_MAX, "CFG_NAME_HASH_SIZE is too small");
+_Static_assert(CFG_IDT_MAX < 256, "Config ids must fit in the hash table slots");
+static uint8_t config_name_hash[CFG_NAME_HASH_SIZE];
 
-    return CFG_IDT_MAX;
+static uint32_t cp_name_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    while (*name != '\0') {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-char* cp_name_from_id(enum cfg_data_idt id) {
-    return cp_is_valid_id(id) ? config_defs[id].name : NULL;
+static void cp_name_hash_build() {
+    memset(config_name_hash, 0, sizeof(config_name_hash));
+    for (enum cfg_data_idt i = 0; i<CFG_IDT_MAX; i++) {
+        uint32_t slot = cp_name_hash(config_defs[i].name) & (CFG_NAME_HASH_SIZE - 1);
+        while (config_name_hash[slot] != 0)
+            slot = (slot + 1) & (CFG_NAME_HASH_SIZE - 1);
+        config_name_hash[slot] = i + 1;
+    }
 }
 
-esp_err_t cp_get_by_id(enum cfg_data_idt id, void* buf, size_t* maxlen) {
-    if (!cp_is_valid_id(id))
-        return ESP_ERR_NOT_SUPPORTED;
+// Write-through RAM copy of all config values, loaded once by cp_init().
+// Strings are allocated on the heap and never NULL once loaded.
+typedef union config_val {
+    char* str;
+    uint8_t u8;
+    uint32_t u32;
+} config_val_t;
 
+static config_val_t config_cache[CFG_IDT_MAX];
+static SemaphoreHandle_t config_cache_mux = NULL;
+
+static esp_err_t cp_load_by_id(nvs_handle cfg_nvss_handle, enum cfg_data_idt id) {
     config_def_t* cfg = &(config_defs[id]);
+    config_val_t* val = &(config_cache[id]);
     esp_err_t err = ESP_OK;
-    nvs_handle cfg_nvss_handle;
-    size_t param_len;
-
-    // Open
-    err = nvs_open(CFG_STORAGE_NAMESPACE, NVS_READWRITE, &cfg_nvss_handle);
-    if (err != ESP_OK)
-        goto err_ret;
+    size_t param_len = 0;
 
     switch (cfg->type) {
     case CFG_DATA_STR:
-        param_len = *maxlen;
-        err = nvs_get_str(cfg_nvss_handle, cfg->name, (char*)buf, &param_len);
-        if (err == ESP_ERR_NVS_NOT_FOUND) {
-            if (cfg->default_val.str != NULL) {
-                strncpy(buf, cfg->default_val.str, *maxlen);
-            } else {
-                *((char*)buf) = '\0';
-            }
-            err = ESP_OK;
-        } else if (err != ESP_OK) {
-            goto err_ret;
+        err = nvs_get_str(cfg_nvss_handle, cfg->name, NULL, &param_len);
+        if (err == ESP_OK) {
+            val->str = malloc(param_len);
+            if (val->str == NULL)
+                return ESP_ERR_NO_MEM;
+            err = nvs_get_str(cfg_nvss_handle, cfg->name, val->str, &param_len);
+        } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+            val->str = strdup(cfg->default_val.str != NULL ? cfg->default_val.str : "");
+            err = val->str == NULL ? ESP_ERR_NO_MEM : ESP_OK;
         }
-        *maxlen = param_len;
         break;
 
     case CFG_DATA_U8:
-        err = nvs_get_u8(cfg_nvss_handle, cfg->name, (uint8_t*) buf);
+        err = nvs_get_u8(cfg_nvss_handle, cfg->name, &val->u8);
         if (err == ESP_ERR_NVS_NOT_FOUND) {
-            *((uint8_t*)buf) = cfg->default_val.u8;
+            val->u8 = cfg->default_val.u8;
             err = ESP_OK;
-        } else if (err != ESP_OK) {
-            goto err_ret;
         }
         break;
 
     case CFG_DATA_U32:
-        err = nvs_get_u32(cfg_nvss_handle, cfg->name, (uint32_t*) buf);
+        err = nvs_get_u32(cfg_nvss_handle, cfg->name, &val->u32);
         if (err == ESP_ERR_NVS_NOT_FOUND) {
-            *((uint32_t*)buf) = cfg->default_val.u32;
+            val->u32 = cfg->default_val.u32;
             err = ESP_OK;
-        } else if (err != ESP_OK) {
-            goto err_ret;
         }
         break;
 
@@ -110,51 +140,172 @@ esp_err_t cp_get_by_id(enum cfg_data_idt id, void* buf, size_t* maxlen) {
         break;
     }
 
-err_ret:
-    // Close
+    return err;
+}
+
+esp_err_t cp_init() {
+    nvs_handle cfg_nvss_handle;
+    esp_err_t err;
+
+    if (config_cache_mux != NULL)
+        return ESP_OK;
+
+    cp_name_hash_build();
+
+    err = nvs_open(CFG_STORAGE_NAMESPACE, NVS_READWRITE, &cfg_nvss_handle);
+    if (err != ESP_OK)
+        return err;
+
+    for (enum cfg_data_idt i = 0; i<CFG_IDT_MAX; i++) {
+        err = cp_load_by_id(cfg_nvss_handle, i);
+        if (err != ESP_OK)
+            break;
+    }
+
     nvs_close(cfg_nvss_handle);
+
+    if (err == ESP_OK)
+        config_cache_mux = xSemaphoreCreateMutex();
     return err;
 }
 
-esp_err_t cp_set_by_id(enum cfg_data_idt id, const void* buf) {
+enum cfg_data_idt cp_id_from_name(const char* name) {
+    if (name == NULL)
+        return CFG_IDT_MAX;
+
+    // The table is at most half full, so the probe always ends at an empty slot
+    uint32_t slot = cp_name_hash(name) & (CFG_NAME_HASH_SIZE - 1);
+    while (config_name_hash[slot] != 0) {
+        enum cfg_data_idt id = config_name_hash[slot] - 1;
+        if (strcmp(name, config_defs[id].name) == 0)
+            return id;
+        slot = (slot + 1) & (CFG_NAME_HASH_SIZE - 1);
+    }
+
+    return CFG_IDT_MAX;
+}
+
+char* cp_name_from_id(enum cfg_data_idt id) {
+    return cp_is_valid_id(id) ? config_defs[id].name : NULL;
+}
+
+esp_err_t cp_get_by_id(enum cfg_data_idt id, void* buf, size_t* maxlen) {
     if (!cp_is_valid_id(id))
         return ESP_ERR_NOT_SUPPORTED;
 
+    if (config_cache_mux == NULL)
+        return ESP_ERR_INVALID_STATE;
+
     config_def_t* cfg = &(config_defs[id]);
-    nvs_handle cfg_nvss_handle;
+    config_val_t* val = &(config_cache[id]);
     esp_err_t err = ESP_OK;
+    size_t param_len;
 
-    // Open
-    err = nvs_open(CFG_STORAGE_NAMESPACE, NVS_READWRITE, &cfg_nvss_handle);
-    if (err != ESP_OK)
-        goto err_ret;
-
+    xSemaphoreTake(config_cache_mux, portMAX_DELAY);
     switch (cfg->type) {
     case CFG_DATA_STR:
-        if (cfg->validate.str != NULL)
-            err = cfg->validate.str((const char*)buf);
-        if (err == ESP_OK)
-            err = nvs_set_str(cfg_nvss_handle, cfg->name, (const char*)buf);
+        // Same as nvs_get_str(), fails if the buffer is too small and outputs the length including the null terminator
+        param_len = strlen(val->str) + 1;
+        if (param_len > *maxlen) {
+            err = ESP_ERR_NVS_INVALID_LENGTH;
+        } else {
+            memcpy(buf, val->str, param_len);
+            *maxlen = param_len;
+        }
         break;
+
     case CFG_DATA_U8:
-        if (cfg->validate.u8 != NULL)
-            err = cfg->validate.u8((uint8_t) ((uint32_t)buf));
-        if (err == ESP_OK)
-            err = nvs_set_u8(cfg_nvss_handle, cfg->name, (uint8_t) ((uint32_t)buf));
+        *((uint8_t*)buf) = val->u8;
         break;
+
     case CFG_DATA_U32:
-        if (cfg->validate.u32 != NULL)
-            err = cfg->validate.u32((uint32_t)buf);
-        if (err == ESP_OK)
-            err = nvs_set_u32(cfg_nvss_handle, cfg->name, (uint32_t)buf);
+        *((uint32_t*)buf) = val->u32;
         break;
+
     default:
         err = ESP_ERR_NOT_SUPPORTED;
         break;
     }
+    xSemaphoreGive(config_cache_mux);
+
+    return err;
+}
+
+static esp_err_t cp_validate_item(const cp_batch_item_t* item) {
+    if (!cp_is_valid_id(item->id))
+        return ESP_ERR_NOT_SUPPORTED;
+
+    config_def_t* cfg = &(config_defs[item->id]);
+
+    switch (cfg->type) {
+    case CFG_DATA_STR:
+        if (item->buf == NULL)
+            return ESP_ERR_INVALID_ARG;
+        return cfg->validate.str == NULL ? ESP_OK : cfg->validate.str((const char*)item->buf);
+    case CFG_DATA_U8:
+        return cfg->validate.u8 == NULL ? ESP_OK : cfg->validate.u8((uint8_t) ((uint32_t)item->buf));
+    case CFG_DATA_U32:
+        return cfg->validate.u32 == NULL ? ESP_OK : cfg->validate.u32((uint32_t)item->buf);
+    default:
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+}
+
+static esp_err_t cp_write_item(nvs_handle cfg_nvss_handle, const cp_batch_item_t* item) {
+    config_def_t* cfg = &(config_defs[item->id]);
+
+    switch (cfg->type) {
+    case CFG_DATA_STR:
+        return nvs_set_str(cfg_nvss_handle, cfg->name, (const char*)item->buf);
+    case CFG_DATA_U8:
+        return nvs_set_u8(cfg_nvss_handle, cfg->name, (uint8_t) ((uint32_t)item->buf));
+    case CFG_DATA_U32:
+        return nvs_set_u32(cfg_nvss_handle, cfg->name, (uint32_t)item->buf);
+    default:
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+}
+
+esp_err_t cp_set_batch(const cp_batch_item_t* items, size_t count) {
+    nvs_handle cfg_nvss_handle;
+    esp_err_t err = ESP_OK;
+    char* strs[CFG_IDT_MAX] = {NULL};
+    uint32_t apply = CFG_APPLY_NONE;
+
+    if (config_cache_mux == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    if (count > CFG_IDT_MAX)
+        return ESP_ERR_INVALID_ARG;
+
+    // Validate everything before touching the flash
+    for (size_t i = 0; i < count; i++) {
+        err = cp_validate_item(&items[i]);
+        if (err != ESP_OK)
+            return err;
+    }
+
+    // Prepare the cached copies, so that nothing can fail after the commit
+    for (size_t i = 0; i < count; i++) {
+        if (config_defs[items[i].id].type == CFG_DATA_STR) {
+            strs[i] = strdup((const char*)items[i].buf);
+            if (strs[i] == NULL) {
+                err = ESP_ERR_NO_MEM;
+                goto func_ret;
+            }
+        }
+    }
 
+    // Open
+    err = nvs_open(CFG_STORAGE_NAMESPACE, NVS_READWRITE, &cfg_nvss_handle);
     if (err != ESP_OK)
-        goto err_ret;
+        goto func_ret;
+
+    for (size_t i = 0; i < count; i++) {
+        err = cp_write_item(cfg_nvss_handle, &items[i]);
+        if (err != ESP_OK)
+            goto err_ret;
+    }
 
     // Commit written value.
     // After setting any values, nvs_commit() must be called to ensure changes are written
@@ -164,13 +315,52 @@ esp_err_t cp_set_by_id(enum cfg_data_idt id, const void* buf) {
     if (err != ESP_OK)
         goto err_ret;
 
+    // Update the cache only after the values are safely in the flash
+    xSemaphoreTake(config_cache_mux, portMAX_DELAY);
+    for (size_t i = 0; i < count; i++) {
+        config_def_t* cfg = &(config_defs[items[i].id]);
+        config_val_t* val = &(config_cache[items[i].id]);
+        switch (cfg->type) {
+        case CFG_DATA_STR:
+            free(val->str);
+            val->str = strs[i];
+            strs[i] = NULL;
+            break;
+        case CFG_DATA_U8:
+            val->u8 = (uint8_t) ((uint32_t)items[i].buf);
+            break;
+        case CFG_DATA_U32:
+            val->u32 = (uint32_t)items[i].buf;
+            break;
+        default:
+            break;
+        }
+        apply |= cfg->apply;
+    }
+    xSemaphoreGive(config_cache_mux);
+
 err_ret:
     // Close
     nvs_close(cfg_nvss_handle);
+func_ret:
+    for (size_t i = 0; i < count; i++) {
+        if (strs[i] != NULL)
+            free(strs[i]);
+    }
+
+    // The side effects read back the cached values, the mutex must not be held here
+    if (apply != CFG_APPLY_NONE)
+        cpcb_apply(apply);
+
     return err;
 }
 
-esp_err_t cp_set_by_id_from_raw(enum cfg_data_idt id, const char* param) {
+esp_err_t cp_set_by_id(enum cfg_data_idt id, const void* buf) {
+    cp_batch_item_t item = {.id = id, .buf = buf};
+    return cp_set_batch(&item, 1);
+}
+
+esp_err_t cp_batch_item_from_raw(enum cfg_data_idt id, const char* param, cp_batch_item_t* item) {
     if (!cp_is_valid_id(id))
         return ESP_ERR_NOT_SUPPORTED;
 
@@ -178,14 +368,15 @@ esp_err_t cp_set_by_id_from_raw(enum cfg_data_idt id, const char* param) {
     esp_err_t err = ESP_OK;
     uint32_t u32_var;
 
+    item->id = id;
     switch (cfg->type) {
     case CFG_DATA_STR:
-        err = cp_set_by_id(id, param);
+        item->buf = param;
         break;
     case CFG_DATA_U8:
     case CFG_DATA_U32:
-        u32_var = atoi(param);
-        err = cp_set_by_id(id, (void*) u32_var);
+        u32_var = param == NULL ? 0 : atoi(param);
+        item->buf = (void*) u32_var;
         break;
     default:
         err = ESP_ERR_NOT_SUPPORTED;
@@ -195,6 +386,14 @@ esp_err_t cp_set_by_id_from_raw(enum cfg_data_idt id, const char* param) {
     return err;
 }
 
+esp_err_t cp_set_by_id_from_raw(enum cfg_data_idt id, const char* param) {
+    cp_batch_item_t item;
+    esp_err_t err = cp_batch_item_from_raw(id, param, &item);
+    if (err != ESP_OK)
+        return err;
+    return cp_set_by_id(id, item.buf);
+}
+
 esp_err_t cp_get_by_id_to_readable(enum cfg_data_idt id, char* buf, size_t maxlen) {
     if (!cp_is_valid_id(id))
         return ESP_ERR_NOT_SUPPORTED;
@@ -12,27 +12,97 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
+#include "lwip/sockets.h"
+
 #include <esp_http_server.h>
 #include "esp_http_server_ext.h"
 
+#include "json_writer.h"
 #include "main.h"
+#include "modbus.h"
+#include "modbus_http.h"
+#include "modbus_metrics.h"
+#include "modbus_poller.h"
+#include "modbus_tags.h"
+#include "modbus_tcp_server.h"
+#include "modbus_trace.h"
 #include "ota.h"
 
 #define HTTP_GET_ARG_MAXLEN 512
-#define HTTP_PARAM_MAXLEN 128
+#define HTTP_PARAM_MAXLEN 256
+// The default of HTTPD_DEFAULT_CONFIG() is 8
+#define HTTP_URI_HANDLERS_MAX 15
 
-extern const char index_html_start[] asm("_binary_index_html_start");
-extern const char index_html_end[]   asm("_binary_index_html_end");
+extern const uint8_t index_html_gz_start[] asm("_binary_index_html_gz_start");
+extern const uint8_t index_html_gz_end[]   asm("_binary_index_html_gz_end");
 
 static const char *TAG="APP";
 
+static uint32_t fnv1a_hash(const void* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (const uint8_t* p = data; len > 0; len--, p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 static httpd_handle_t server = NULL;
 
 static const char* json_post_set_fields(cJSON* req_array);
 
+// Quoted FNV-1a hash of the compressed page, computed once by start_webserver()
+static char index_html_etag[sizeof("\"01234567\"")];
+
+static void index_html_etag_init() {
+    uint32_t hash = fnv1a_hash(index_html_gz_start, index_html_gz_end - index_html_gz_start);
+    snprintf(index_html_etag, sizeof(index_html_etag), "\"%08x\"", hash);
+}
+
+// Whether the Accept-Encoding of the request allows gzip (or "*"), and not with q=0
+static int http_accepts_gzip(httpd_req_t *req) {
+    char buf[128];
+    char* save = NULL;
+
+    // A long header is cut short, only the codings that fit are looked at
+    esp_err_t err = httpd_req_get_hdr_value_str(req, "Accept-Encoding", buf, sizeof(buf));
+    if (err != ESP_OK && err != ESP_ERR_HTTPD_RESULT_TRUNC)
+        return 0;
+
+    for (char* coding = strtok_r(buf, ",", &save); coding != NULL; coding = strtok_r(NULL, ",", &save)) {
+        coding += strspn(coding, " \t");
+        size_t len = strcspn(coding, " \t;");
+        if ((len == 4 && strncasecmp(coding, "gzip", 4) == 0) || (len == 1 && coding[0] == '*')) {
+            const char* q = strstr(coding + len, "q=");
+            return q == NULL || strtod(q + 2, NULL) > 0;
+        }
+    }
+    return 0;
+}
+
 esp_err_t index_get_handler(httpd_req_t *req) {
-    httpd_resp_send(req, index_html_start, strlen(index_html_start));
-    return ESP_OK;
+    char if_none_match[sizeof(index_html_etag)];
+
+    httpd_resp_set_hdr(req, "ETag", index_html_etag);
+    // Allow caching, but revalidate on every load so that a firmware update shows up immediately
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+        strcmp(if_none_match, index_html_etag) == 0) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    // The page is only stored compressed, all browsers accept it
+    if (!http_accepts_gzip(req)) {
+        const char* msg = "The page is served gzip-compressed only, send Accept-Encoding: gzip";
+        httpd_resp_set_status(req, "406 Not Acceptable");
+        httpd_resp_set_type(req, HTTPD_TYPE_TEXT);
+        return httpd_resp_send(req, msg, strlen(msg));
+    }
+
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    return httpd_resp_send(req, (const char*)index_html_gz_start, index_html_gz_end - index_html_gz_start);
 }
 
 httpd_uri_t index_get = {
@@ -75,7 +145,7 @@ httpd_uri_t restart = {
 
 static esp_err_t config_get_handler(httpd_req_t *req) {
     char* resp = NULL;
-    char param[128];
+    char param[HTTP_PARAM_MAXLEN];
     char* buf = NULL;
 
     size_t buf_len = httpd_req_get_url_query_len(req) + 1;
@@ -125,7 +195,7 @@ httpd_uri_t config_get = {
     .user_ctx  = "Ok~~~"
 };
 
-static void json_get_get_fields(cJSON* resp_root, cJSON* req_array) {
+static void json_get_get_fields(json_writer_t* jw, cJSON* req_array) {
     char param[HTTP_PARAM_MAXLEN];
 
     if (req_array == NULL)
@@ -136,38 +206,40 @@ static void json_get_get_fields(cJSON* resp_root, cJSON* req_array) {
         char* field_name = cJSON_GetStringValue(req_iterator);
         enum cfg_data_idt cfg_id = cp_id_from_name(field_name);
         if (cp_get_by_id_to_readable(cfg_id, param, sizeof(param)) == ESP_OK) {
-            cJSON_AddStringToObject(resp_root, field_name, param);
+            jw_string(jw, field_name, param);
         }
     }
 }
 
 static const char* const wifi_sta_status_str[] = {"disconnected", "connecting", "connected"};
 
-static void json_get_wifi_sta_status(cJSON* resp_root) {
+static void json_get_ip6_address(json_writer_t* jw, const char* key, const ip_info_t* ip_info) {
+    jw_array_begin(jw, key);
+    for (size_t i=0; i<ip_info->ip6_count; i++) {
+        jw_string(jw, NULL, ip_info->ip6_addr[i]);
+    }
+    jw_array_end(jw);
+}
+
+static void json_get_wifi_sta_status(json_writer_t* jw) {
     char ssid[WIFI_SSID_MAXLEN];
     ip_info_t ip_info;
 
-    cJSON_AddStringToObjectCS(resp_root, "wifi_sta_status", wifi_sta_status_str[wifi_sta_query_status()]);
+    jw_string(jw, "wifi_sta_status", wifi_sta_status_str[wifi_sta_query_status()]);
 
     if (wifi_sta_query_ap(ssid, sizeof(ssid)) == ESP_OK) {
-        cJSON_AddStringToObjectCS(resp_root, "wifi_sta_ap_ssid", ssid);
+        jw_string(jw, "wifi_sta_ap_ssid", ssid);
 
         if (wifi_query_ip_info(0, &ip_info) == ESP_OK) {
-            cJSON_AddStringToObjectCS(resp_root, "wifi_sta_ip4_address", ip_info.ip4_addr);
-            cJSON_AddStringToObjectCS(resp_root, "wifi_sta_ip4_netmask", ip_info.ip4_netmask);
-            cJSON_AddStringToObjectCS(resp_root, "wifi_sta_ip4_gateway", ip_info.ip4_gateway);
-
-            char* ipv6_addr[IPV6_ADDR_COUNT];
-            for (size_t i=0; i<ip_info.ip6_count; i++) {
-                ipv6_addr[i] = (char*)&ip_info.ip6_addr[i];
-            }
-            cJSON_AddItemToObjectCS(resp_root, "wifi_sta_ip6_address",
-                                    cJSON_CreateStringArray((const char**)ipv6_addr, ip_info.ip6_count));
+            jw_string(jw, "wifi_sta_ip4_address", ip_info.ip4_addr);
+            jw_string(jw, "wifi_sta_ip4_netmask", ip_info.ip4_netmask);
+            jw_string(jw, "wifi_sta_ip4_gateway", ip_info.ip4_gateway);
+            json_get_ip6_address(jw, "wifi_sta_ip6_address", &ip_info);
         }
     }
 }
 
-static void json_get_wifi_connect(cJSON* resp_root, cJSON* req) {
+static void json_get_wifi_connect(json_writer_t* jw, cJSON* req) {
     cJSON* req_item_node;
     char sta_ssid_req[WIFI_SSID_MAXLEN];
     char sta_pass_req[WIFI_PASS_MAXLEN];
@@ -183,85 +255,118 @@ static void json_get_wifi_connect(cJSON* resp_root, cJSON* req) {
         strncpy(sta_ssid_req, cJSON_GetStringValue(req_item_node), WIFI_SSID_MAXLEN);
         // Trucate the string if it is greater than WIFI_SSID_MAXLEN-1
         sta_ssid_req[WIFI_SSID_MAXLEN-1] = '\0';
-        cJSON_AddStringToObjectCS(resp_root, "wifi_sta_ssid", sta_ssid_req);
+        jw_string(jw, "wifi_sta_ssid", sta_ssid_req);
 
         req_item_node = cJSON_GetObjectItem(req, "wifi_sta_pass");
         if (req_item_node != NULL) {
             strncpy(sta_pass_req, cJSON_GetStringValue(req_item_node), WIFI_PASS_MAXLEN);
             // Trucate the string if it is greater than WIFI_PASS_MAXLEN-1
             sta_pass_req[WIFI_PASS_MAXLEN-1] = '\0';
-            cJSON_AddStringToObjectCS(resp_root, "wifi_sta_pass", sta_pass_req);
+            jw_string(jw, "wifi_sta_pass", sta_pass_req);
         }
     }
 
-    cJSON_AddBoolToObject(resp_root, "wifi_sta_use_prev_cfg", use_prev_cfg);
-    cJSON_AddBoolToObject(resp_root, "return_value",
-                          wifi_sta_connect(sta_ssid_req, sta_pass_req));
+    jw_bool(jw, "wifi_sta_use_prev_cfg", use_prev_cfg);
+    jw_bool(jw, "return_value", wifi_sta_connect(sta_ssid_req, sta_pass_req));
 }
 
-static void json_get_wifi_ap_status(cJSON* resp_root) {
+static void json_get_wifi_ap_status(json_writer_t* jw) {
     char ssid[WIFI_SSID_MAXLEN];
     ip_info_t ip_info;
     esp_err_t ret = wifi_ap_query(ssid, WIFI_SSID_MAXLEN);
 
-    cJSON_AddBoolToObject(resp_root, "wifi_ap_turned_on", ret == ESP_OK);
+    jw_bool(jw, "wifi_ap_turned_on", ret == ESP_OK);
 
     if (ret == ESP_OK) {
-        cJSON_AddStringToObjectCS(resp_root, "wifi_ap_ssid", ssid);
+        jw_string(jw, "wifi_ap_ssid", ssid);
 
         if (wifi_query_ip_info(1, &ip_info) == ESP_OK) {
-            cJSON_AddStringToObjectCS(resp_root, "wifi_ap_ip4_address", ip_info.ip4_addr);
-            cJSON_AddStringToObjectCS(resp_root, "wifi_ap_ip4_netmask", ip_info.ip4_netmask);
-            cJSON_AddStringToObjectCS(resp_root, "wifi_ap_ip4_gateway", ip_info.ip4_gateway);
-
-            char* ipv6_addr[IPV6_ADDR_COUNT];
-            for (size_t i=0; i<ip_info.ip6_count; i++) {
-                ipv6_addr[i] = (char*)&ip_info.ip6_addr[i];
-            }
-            cJSON_AddItemToObjectCS(resp_root, "wifi_ap_ip6_address",
-                                    cJSON_CreateStringArray((const char**)ipv6_addr, ip_info.ip6_count));
+            jw_string(jw, "wifi_ap_ip4_address", ip_info.ip4_addr);
+            jw_string(jw, "wifi_ap_ip4_netmask", ip_info.ip4_netmask);
+            jw_string(jw, "wifi_ap_ip4_gateway", ip_info.ip4_gateway);
+            json_get_ip6_address(jw, "wifi_ap_ip6_address", &ip_info);
         }
     }
 }
 
-static cJSON* json_get_parser(cJSON* req) {
-    // Duplicate "method" field to the response
-    cJSON* req_item_node = cJSON_GetObjectItem(req, "method");
-    if (req_item_node == NULL) {
-        return NULL;
+static void json_get_poll_status(json_writer_t* jw) {
+    modbus_poller_stats_t stats;
+    modbus_poller_get_stats(&stats);
+
+    jw_uint(jw, "poll_block_count", stats.block_count);
+    jw_uint(jw, "poll_bus_load_permille", stats.bus_load_permille);
+    jw_uint(jw, "poll_deadline_miss", stats.deadline_miss);
+}
+
+// Echo a scalar from the request, e.g. trans_id
+static void json_get_copy_item(json_writer_t* jw, const char* key, const cJSON* item) {
+    if (cJSON_IsString(item)) {
+        jw_string(jw, key, cJSON_GetStringValue(item));
+    } else if (cJSON_IsNumber(item)) {
+        jw_number(jw, key, item->valuedouble);
+    } else if (cJSON_IsBool(item)) {
+        jw_bool(jw, key, cJSON_IsTrue(item));
+    } else {
+        jw_null(jw, key);
     }
-    cJSON* resp_root = cJSON_CreateObject();
-    cJSON_DetachItemViaPointer(req, req_item_node);
-    cJSON_AddItemToObject(resp_root, "method", req_item_node);
+}
+
+// Output sink of the streaming writers, sends each buffer as a chunk
+static esp_err_t httpd_chunk_sink(void* ctx, const char* buf, size_t len) {
+    return httpd_resp_send_chunk((httpd_req_t*)ctx, buf, len);
+}
+
+// The response is streamed as chunks, nothing is sent if the request has no method.
+static esp_err_t json_get_parser(httpd_req_t *http_req, cJSON* req) {
+    json_writer_t jw;
+    esp_err_t ret;
+
+    cJSON* req_item_node = cJSON_GetObjectItem(req, "method");
     char* req_method = cJSON_GetStringValue(req_item_node);
+    if (req_method == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    jw_init(&jw, httpd_chunk_sink, http_req);
+    jw_object_begin(&jw, NULL);
+
+    // Duplicate "method" field to the response
+    jw_string(&jw, "method", req_method);
 
     // Copy trans_id
     req_item_node = cJSON_GetObjectItem(req, "trans_id");
     if (req_item_node != NULL) {
-        cJSON_DetachItemViaPointer(req, req_item_node);
-        cJSON_AddItemToObject(resp_root, "trans_id", req_item_node);
+        json_get_copy_item(&jw, "trans_id", req_item_node);
     }
 
     if (strcmp(req_method, "get") == 0) {
-        json_get_get_fields(resp_root, cJSON_GetObjectItem(req, "fields"));
+        json_get_get_fields(&jw, cJSON_GetObjectItem(req, "fields"));
     } else if (strcmp(req_method, "set") == 0) {
-        cJSON_AddStringToObjectCS(resp_root, "return_value",
-                                json_post_set_fields(cJSON_GetObjectItem(req, "fields")));
+        jw_string(&jw, "return_value", json_post_set_fields(cJSON_GetObjectItem(req, "fields")));
     } else if (strcmp(req_method, "wifi_sta_status") == 0) {
-        json_get_wifi_sta_status(resp_root);
+        json_get_wifi_sta_status(&jw);
     } else if (strcmp(req_method, "wifi_sta_connect") == 0) {
-        json_get_wifi_connect(resp_root, req);
+        json_get_wifi_connect(&jw, req);
     } else if (strcmp(req_method, "wifi_sta_disconnect") == 0) {
         wifi_sta_disconnect();
     } else if (strcmp(req_method, "wifi_ap_on") == 0) {
-        cJSON_AddBoolToObject(resp_root, "return_value", wifi_ap_turn_on());
+        jw_bool(&jw, "return_value", wifi_ap_turn_on());
     } else if (strcmp(req_method, "wifi_ap_off") == 0) {
-        cJSON_AddBoolToObject(resp_root, "return_value", wifi_ap_turn_off());
+        jw_bool(&jw, "return_value", wifi_ap_turn_off());
     } else if (strcmp(req_method, "wifi_ap_status") == 0) {
-        json_get_wifi_ap_status(resp_root);
+        json_get_wifi_ap_status(&jw);
+    } else if (strcmp(req_method, "poll_status") == 0) {
+        json_get_poll_status(&jw);
+    }
+
+    jw_object_end(&jw);
+    ret = jw_finish(&jw);
+    if (ret == ESP_OK) {
+        // Terminate the chunked response
+        ret = httpd_resp_send_chunk(http_req, NULL, 0);
     }
 
-    return resp_root;
+    return ret;
 }
 
 static esp_err_t json_get_handler(httpd_req_t *req) {
@@ -301,14 +406,8 @@ static esp_err_t json_get_handler(httpd_req_t *req) {
     }
 
     // Generate and send the response
-    cJSON* json_resp = json_get_parser(json_req);
-    if (json_resp) {
-        buf = cJSON_PrintUnformatted(json_resp);
-        cJSON_Delete(json_resp);
-        ret = httpd_resp_send(req, buf, strlen(buf));
-        free(buf);
-        buf = NULL;
-    } else {
+    ret = json_get_parser(req, json_req);
+    if (ret == ESP_ERR_INVALID_ARG) {
         ret = httpd_resp_send(req, HTTPD_400, strlen(HTTPD_400));
     }
 
@@ -326,22 +425,454 @@ httpd_uri_t json_get = {
     .handler   = json_get_handler
 };
 
+// "/metrics", traffic counters and latency histograms in the Prometheus text format
+static esp_err_t metrics_get_handler(httpd_req_t *req) {
+    esp_err_t ret;
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    ret = metrics_write_prometheus(httpd_chunk_sink, req);
+    if (ret == ESP_OK)
+        ret = httpd_resp_send_chunk(req, NULL, 0);
+    return ret;
+}
+
+httpd_uri_t metrics_get = {
+    .uri       = "/metrics",
+    .method    = HTTP_GET,
+    .handler   = metrics_get_handler
+};
+
+// "/tags", the decoded tags of the register image, {"name":value,...}. null if the block is stale or has never
+// been read, tags outside of the poll blocks are left out.
+static esp_err_t tags_get_handler(httpd_req_t *req) {
+    // Only used by the httpd task
+    static uint8_t data[MODBUS_POLL_DATA_MAXLEN];
+    static modbus_tag_value_t values[MODBUS_TAG_MAX];
+    modbus_poll_block_info_t info;
+    json_writer_t jw;
+    esp_err_t ret;
+
+    httpd_resp_set_type(req, HTTPD_TYPE_JSON);
+    jw_init(&jw, httpd_chunk_sink, req);
+    jw_object_begin(&jw, NULL);
+    for (size_t i = 0; modbus_poller_get_block(i, &info, data) == ESP_OK; i++) {
+        size_t count = modbus_tags_decode_block(&info, data, values, MODBUS_TAG_MAX);
+        for (size_t j = 0; j < count; j++) {
+            if (info.valid && !info.stale) {
+                jw_number_prec(&jw, values[j].name, values[j].value, values[j].digits);
+            } else {
+                jw_null(&jw, values[j].name);
+            }
+        }
+    }
+    jw_object_end(&jw);
+    ret = jw_finish(&jw);
+    if (ret == ESP_OK)
+        ret = httpd_resp_send_chunk(req, NULL, 0);
+    return ret;
+}
+
+httpd_uri_t tags_get = {
+    .uri       = "/tags",
+    .method    = HTTP_GET,
+    .handler   = tags_get_handler
+};
+
+// "/trace", time stamps of the stages of the recent RTU transactions
+static esp_err_t trace_get_handler(httpd_req_t *req) {
+    esp_err_t ret;
+    json_writer_t jw;
+
+    httpd_resp_set_type(req, HTTPD_TYPE_JSON);
+    jw_init(&jw, httpd_chunk_sink, req);
+    modbus_trace_write_json(&jw);
+    ret = jw_finish(&jw);
+    if (ret == ESP_OK)
+        ret = httpd_resp_send_chunk(req, NULL, 0);
+    return ret;
+}
+
+httpd_uri_t trace_get = {
+    .uri       = "/trace",
+    .method    = HTTP_GET,
+    .handler   = trace_get_handler
+};
+
+// "/modbus", POST a JSON array of operations, they are executed in order and the array of results is returned.
+// See modbus_http.h for the format.
+static esp_err_t modbus_post_handler(httpd_req_t *req) {
+    cJSON* json_req = NULL;
+    json_writer_t jw;
+    esp_err_t ret = ESP_OK;
+    char* buf = NULL;
+    size_t received = 0;
+
+    if (req->content_len <= 1 || req->content_len > MODBUS_HTTP_BODY_MAXLEN) {
+        httpd_resp_set_status(req, HTTPD_400);
+        ret = httpd_resp_send(req, HTTPD_400, strlen(HTTPD_400));
+        goto func_ret;
+    }
+
+    buf = malloc(req->content_len + 1);
+    if (buf == NULL) {
+        ret = ESP_ERR_NO_MEM;
+        goto func_ret;
+    }
+    while (received < req->content_len) {
+        int len = httpd_req_recv(req, buf + received, req->content_len - received);
+        if (len > 0) {
+            received += len;
+        } else if (len != HTTPD_SOCK_ERR_TIMEOUT) {
+            ret = ESP_FAIL;
+            goto func_ret;
+        }
+    }
+    buf[received] = '\0';
+
+    json_req = cJSON_Parse(buf);
+    if (!cJSON_IsArray(json_req) || cJSON_GetArraySize(json_req) > MODBUS_HTTP_OPS_MAX) {
+        httpd_resp_set_status(req, HTTPD_400);
+        ret = httpd_resp_send(req, HTTPD_400, strlen(HTTPD_400));
+        goto func_ret;
+    }
+
+    httpd_resp_set_type(req, HTTPD_TYPE_JSON);
+    jw_init(&jw, httpd_chunk_sink, req);
+    jw_array_begin(&jw, NULL);
+    TickType_t deadline = xTaskGetTickCount() + MODBUS_HTTP_BATCH_MS / portTICK_RATE_MS;
+    cJSON* op = NULL;
+    cJSON_ArrayForEach(op, json_req) {
+        modbus_http_run_op(&jw, op, deadline);
+    }
+    jw_array_end(&jw);
+    ret = jw_finish(&jw);
+    if (ret == ESP_OK)
+        ret = httpd_resp_send_chunk(req, NULL, 0);
+
+func_ret:
+    if (json_req)
+        cJSON_Delete(json_req);
+    if (buf)
+        free(buf);
+    return ret;
+}
+
+httpd_uri_t modbus_post = {
+    .uri       = "/modbus",
+    .method    = HTTP_POST,
+    .handler   = modbus_post_handler
+};
+
+#if CONFIG_HTTPD_WS_SUPPORT
+// "/ws", pushes status messages (same as the /json_get responses) to the browsers, only when they change.
+// The page falls back to polling /json_get if the WebSocket is not available.
+#define STATUS_PUSH_CLIENT_MAX  4
+#define STATUS_PUSH_MSG_MAXLEN  384
+#define STATUS_PUSH_PERIOD_MS   1000
+
+typedef struct status_push_msg {
+    size_t len;
+    char data[STATUS_PUSH_MSG_MAXLEN];
+} status_push_msg_t;
+
+typedef struct status_push_item {
+    const char* method;
+    void (*gen)(json_writer_t* jw);
+} status_push_item_t;
+
+static const status_push_item_t status_push_items[] = {
+    {"wifi_sta_status", json_get_wifi_sta_status},
+    {"wifi_ap_status", json_get_wifi_ap_status},
+    {"poll_status", json_get_poll_status},
+};
+
+// Only accessed from the httpd task
+static int status_push_fds[STATUS_PUSH_CLIENT_MAX] = {-1, -1, -1, -1};
+// Number of connected clients, read by the status task to skip the work if nobody is listening
+static volatile int status_push_client_count = 0;
+static TaskHandle_t status_push_task_handle = NULL;
+
+static esp_err_t status_push_msg_sink(void* ctx, const char* buf, size_t len) {
+    status_push_msg_t* msg = (status_push_msg_t*)ctx;
+    if (msg->len + len > sizeof(msg->data))
+        return ESP_ERR_NO_MEM;
+    memcpy(msg->data + msg->len, buf, len);
+    msg->len += len;
+    return ESP_OK;
+}
+
+// Runs in the httpd task, sends the message to all WebSocket clients and frees it
+static void status_push_work(void* arg) {
+    status_push_msg_t* msg = (status_push_msg_t*)arg;
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .fragmented = false,
+        .type = HTTPD_WS_TYPE_TEXT,
+        .payload = (uint8_t*)msg->data,
+        .len = msg->len
+    };
+
+    for (size_t i = 0; i < STATUS_PUSH_CLIENT_MAX; i++) {
+        int fd = status_push_fds[i];
+        if (fd < 0)
+            continue;
+
+        if (httpd_ws_get_fd_info(server, fd) != HTTPD_WS_CLIENT_WEBSOCKET ||
+            httpd_ws_send_frame_async(server, fd, &frame) != ESP_OK) {
+            status_push_fds[i] = -1;
+            status_push_client_count--;
+        }
+    }
+
+    free(msg);
+}
+
+// Runs in the httpd task when a socket is closed, frees its slot right away
+static void status_push_close(int fd) {
+    for (size_t i = 0; i < STATUS_PUSH_CLIENT_MAX; i++) {
+        if (status_push_fds[i] == fd) {
+            status_push_fds[i] = -1;
+            status_push_client_count--;
+        }
+    }
+}
+
+static void status_push_task(void* param) {
+    uint32_t last_hash[sizeof(status_push_items) / sizeof(status_push_items[0])] = {0};
+    json_writer_t jw;
+
+    for (;;) {
+        // Woken up early when a client connects, it needs a full update
+        if (ulTaskNotifyTake(pdTRUE, STATUS_PUSH_PERIOD_MS / portTICK_RATE_MS) > 0)
+            memset(last_hash, 0, sizeof(last_hash));
+
+        if (status_push_client_count <= 0)
+            continue;
+
+        for (size_t i = 0; i < sizeof(status_push_items) / sizeof(status_push_items[0]); i++) {
+            status_push_msg_t* msg = malloc(sizeof(status_push_msg_t));
+            if (msg == NULL)
+                break;
+
+            msg->len = 0;
+            jw_init(&jw, status_push_msg_sink, msg);
+            jw_object_begin(&jw, NULL);
+            jw_string(&jw, "method", status_push_items[i].method);
+            status_push_items[i].gen(&jw);
+            jw_object_end(&jw);
+
+            // The writer only flushes its buffer into msg on jw_finish(), hash the complete message
+            if (jw_finish(&jw) != ESP_OK) {
+                free(msg);
+                continue;
+            }
+            uint32_t hash = fnv1a_hash(msg->data, msg->len);
+            if (hash == last_hash[i] || httpd_queue_work(server, status_push_work, msg) != ESP_OK) {
+                free(msg);
+                continue;
+            }
+            last_hash[i] = hash;
+        }
+    }
+}
+
+static esp_err_t ws_status_handler(httpd_req_t *req) {
+    uint8_t buf[32];
+    httpd_ws_frame_t frame;
+
+    if (req->method == HTTP_GET) {
+        // Handshake done, register the client after dropping the ones that have gone
+        int fd = httpd_req_to_sockfd(req);
+        for (size_t i = 0; i < STATUS_PUSH_CLIENT_MAX; i++) {
+            if (status_push_fds[i] >= 0 && status_push_fds[i] != fd &&
+                httpd_ws_get_fd_info(server, status_push_fds[i]) != HTTPD_WS_CLIENT_WEBSOCKET) {
+                status_push_fds[i] = -1;
+                status_push_client_count--;
+            }
+        }
+        for (size_t i = 0; i < STATUS_PUSH_CLIENT_MAX; i++) {
+            if (status_push_fds[i] < 0 || status_push_fds[i] == fd) {
+                if (status_push_fds[i] < 0)
+                    status_push_client_count++;
+                status_push_fds[i] = fd;
+                xTaskNotifyGive(status_push_task_handle);
+                return ESP_OK;
+            }
+        }
+
+        ESP_LOGW(TAG, "Too many status push clients");
+        return ESP_FAIL;
+    }
+
+    // Nothing is expected from the client, drain whatever it sends
+    memset(&frame, 0, sizeof(frame));
+    frame.payload = buf;
+    return httpd_ws_recv_frame(req, &frame, sizeof(buf));
+}
+
+httpd_uri_t ws_status = {
+    .uri        = "/ws",
+    .method     = HTTP_GET,
+    .handler    = ws_status_handler,
+    .is_websocket = true
+};
+
+// "/ws_modbus", a Modbus TCP tunnel: each binary message carries one or more MBAP frames, which are
+// handled like the frames of a TCP client on port 502. Each response comes back as a binary message.
+#define WS_TUNNEL_CLIENT_MAX    2
+#define WS_TUNNEL_MSG_MAXLEN    TCP_SERVER_RXBUF_MAXLEN
+
+typedef struct ws_tunnel_msg {
+    int fd;
+    size_t len;
+    uint8_t data[];
+} ws_tunnel_msg_t;
+
+// Written by the httpd task only, read by the RTU task to drop the responses to a closed tunnel early
+static volatile int ws_tunnel_fds[WS_TUNNEL_CLIENT_MAX] = {-1, -1};
+
+static int ws_tunnel_find(int fd) {
+    for (size_t i = 0; i < WS_TUNNEL_CLIENT_MAX; i++) {
+        if (ws_tunnel_fds[i] == fd)
+            return i;
+    }
+    return -1;
+}
+
+// Runs in the httpd task
+static void ws_tunnel_send_work(void* arg) {
+    ws_tunnel_msg_t* msg = (ws_tunnel_msg_t*)arg;
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .fragmented = false,
+        .type = HTTPD_WS_TYPE_BINARY,
+        .payload = msg->data,
+        .len = msg->len
+    };
+
+    // The tunnel may have been closed while the request was on the bus
+    if (ws_tunnel_find(msg->fd) >= 0)
+        httpd_ws_send_frame_async(server, msg->fd, &frame);
+    free(msg);
+}
+
+// Called when httpd closes a session, the metrics slot of a tunnel client is released
+static void ws_tunnel_close(int fd) {
+    int i = ws_tunnel_find(fd);
+    if (i >= 0) {
+        ws_tunnel_fds[i] = -1;
+        metrics_tcp_client_close(fd);
+    }
+}
+
+static void ws_tunnel_open(int fd) {
+    struct sockaddr_in6 peer;
+    socklen_t peer_len = sizeof(peer);
+    char addr_str[40] = "ws";
+
+    if (getpeername(fd, (struct sockaddr*)&peer, &peer_len) == 0) {
+        if (peer.sin6_family == AF_INET) {
+            inet_ntoa_r(((struct sockaddr_in*)&peer)->sin_addr, addr_str, sizeof(addr_str) - 1);
+        } else {
+            inet6_ntoa_r(peer.sin6_addr, addr_str, sizeof(addr_str) - 1);
+        }
+    }
+    ESP_LOGI(TAG, "Modbus WebSocket tunnel from %s on socket %d", addr_str, fd);
+    metrics_tcp_client_open(fd, addr_str);
+}
+
+static esp_err_t ws_modbus_handler(httpd_req_t *req) {
+    static uint8_t buf[WS_TUNNEL_MSG_MAXLEN];   // Only used by the httpd task
+    httpd_ws_frame_t frame;
+    int fd = httpd_req_to_sockfd(req);
+
+    if (req->method == HTTP_GET) {
+        // Handshake done
+        if (ws_tunnel_find(fd) >= 0)
+            return ESP_OK;
+        int i = ws_tunnel_find(-1);
+        if (i < 0) {
+            ESP_LOGW(TAG, "Too many Modbus WebSocket tunnels");
+            return ESP_FAIL;
+        }
+        ws_tunnel_fds[i] = fd;
+        ws_tunnel_open(fd);
+        return ESP_OK;
+    }
+
+    memset(&frame, 0, sizeof(frame));
+    frame.payload = buf;
+    if (httpd_ws_recv_frame(req, &frame, sizeof(buf)) != ESP_OK)
+        return ESP_FAIL;
+    if (frame.type != HTTPD_WS_TYPE_BINARY)
+        return ESP_OK;
+
+    const uint8_t* ptr = buf;
+    size_t remaining = frame.len;
+    while (remaining > 0) {
+        size_t frame_len = remaining >= TCP_SERVER_FRAME_HEADER_MIN_LEN() ?
+                           tcp_server_frame_length_from_header(ptr, TCP_SERVER_FRAME_HEADER_MIN_LEN()) : 0;
+        if (frame_len == 0 || frame_len > remaining) {
+            // A frame never spans messages, the stream is out of sync
+            ESP_LOGW(TAG, "Malformed frame on Modbus WebSocket tunnel %d", fd);
+            return ESP_FAIL;
+        }
+        modbus_client_frame_ready(fd, RTU_ORIGIN_WS, ptr, frame_len);
+        ptr += frame_len;
+        remaining -= frame_len;
+    }
+    return ESP_OK;
+}
+
+httpd_uri_t ws_modbus = {
+    .uri        = "/ws_modbus",
+    .method     = HTTP_GET,
+    .handler    = ws_modbus_handler,
+    .is_websocket = true
+};
+
+static void http_close_fn(httpd_handle_t hd, int sockfd) {
+    status_push_close(sockfd);
+    ws_tunnel_close(sockfd);
+    close(sockfd);
+}
+#endif
+
+void http_ws_tunnel_send(int fd, const void* frame, size_t len) {
+#if CONFIG_HTTPD_WS_SUPPORT
+    if (server == NULL || ws_tunnel_find(fd) < 0)
+        return;
+
+    ws_tunnel_msg_t* msg = malloc(sizeof(ws_tunnel_msg_t) + len);
+    if (msg == NULL)
+        return;
+    msg->fd = fd;
+    msg->len = len;
+    memcpy(msg->data, frame, len);
+    if (httpd_queue_work(server, ws_tunnel_send_work, msg) != ESP_OK)
+        free(msg);
+#endif
+}
+
 static const char* json_post_set_fields(cJSON* req_array) {
-    const char* ret = HTTPD_200;
+    cp_batch_item_t items[CFG_IDT_MAX];
+    size_t count = 0;
 
     if (req_array == NULL)
         return NULL;
 
+    // All fields are committed together, or none of them
     cJSON* req_iterator = NULL;
     cJSON_ArrayForEach(req_iterator, req_array) {
         char* field_name = req_iterator->string;
         char* field_value = cJSON_GetStringValue(req_iterator);
         enum cfg_data_idt cfg_id = cp_id_from_name(field_name);
-        if (cp_set_by_id_from_raw(cfg_id, field_value) != ESP_OK) {
-            ret = HTTPD_404;
-        }
+        if (count >= CFG_IDT_MAX || cp_batch_item_from_raw(cfg_id, field_value, &items[count]) != ESP_OK)
+            return HTTPD_404;
+        count++;
     }
-    return ret;
+
+    return cp_set_batch(items, count) == ESP_OK ? HTTPD_200 : HTTPD_404;
 }
 
 static const char* json_post_parser(const cJSON* req) {
@@ -410,7 +941,8 @@ httpd_uri_t json_post = {
 static esp_err_t ota_post_handler(httpd_req_t *req) {
     esp_err_t ret = ESP_OK;
     char* status_code = HTTPD_200;
-    char buf[255];
+    char* buf;
+    size_t buf_len;
 
     size_t remaining = req->content_len;
 
@@ -422,20 +954,30 @@ static esp_err_t ota_post_handler(httpd_req_t *req) {
     }
 
     while (remaining > 0) {
-        ret = httpd_req_recv(req, buf, sizeof(buf));
-
-        if (ret > 0) {
-            remaining -= ret;
+        // Straight into the sector buffer for a plain image, the writer task flashes the previous one meanwhile
+        ret = ota_esp_buf_get(&buf, &buf_len);
+        if (ret != ESP_OK) {
+            ota_esp_abort();
+            status_code = HTTPD_500;
+            goto func_ret;
+        }
 
-            ota_esp_buf_write(buf, ret);
+        int recv_len = httpd_req_recv(req, buf, MIN(buf_len, remaining));
 
-            ret = ESP_OK;
-        } else if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+        if (recv_len > 0) {
+            remaining -= recv_len;
+            ret = ota_esp_buf_commit(recv_len);
+            if (ret != ESP_OK) {
+                ota_esp_abort();
+                status_code = HTTPD_500;
+                goto func_ret;
+            }
+        } else if (recv_len == HTTPD_SOCK_ERR_TIMEOUT) {
             /* Retry receiving if timeout occurred */
             continue;
         } else {
-            ret = ESP_FAIL;
-            goto func_ret;
+            ota_esp_abort();
+            return ESP_FAIL;
         }
     }
 
@@ -447,8 +989,9 @@ static esp_err_t ota_post_handler(httpd_req_t *req) {
 
 func_ret:
     httpd_resp_set_status(req, status_code);
+    httpd_resp_send(req, status_code, strlen(status_code));
 
-    return ret;
+    return ESP_OK;
 }
 
 httpd_uri_t ota_post = {
@@ -463,6 +1006,13 @@ esp_err_t start_webserver(void) {
         return ESP_OK;
 
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.max_uri_handlers = HTTP_URI_HANDLERS_MAX;
+#if CONFIG_HTTPD_WS_SUPPORT
+    config.close_fn = http_close_fn;
+#endif
+
+    if (index_html_etag[0] == '\0')
+        index_html_etag_init();
 
     // Start the httpd server
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
@@ -474,6 +1024,16 @@ esp_err_t start_webserver(void) {
         httpd_register_uri_handler(server, &restart);
         httpd_register_uri_handler(server, &json_get);
         httpd_register_uri_handler(server, &json_post);
+        httpd_register_uri_handler(server, &metrics_get);
+        httpd_register_uri_handler(server, &trace_get);
+        httpd_register_uri_handler(server, &tags_get);
+        httpd_register_uri_handler(server, &modbus_post);
+#if CONFIG_HTTPD_WS_SUPPORT
+        httpd_register_uri_handler(server, &ws_status);
+        httpd_register_uri_handler(server, &ws_modbus);
+        if (status_push_task_handle == NULL)
+            xTaskCreate(status_push_task, "status_push", 2048, NULL, 3, &status_push_task_handle);
+#endif
 #if OTA_ESP_ENABLED
         httpd_register_uri_handler(server, &ota_post);
 #endif
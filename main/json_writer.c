@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "json_writer.h"
+
+static void jw_flush(json_writer_t* jw) {
+    if (jw->err == ESP_OK && jw->len > 0)
+        jw->err = jw->sink(jw->ctx, jw->buf, jw->len);
+    jw->len = 0;
+}
+
+static void jw_write(json_writer_t* jw, const char* str, size_t len) {
+    while (len > 0 && jw->err == ESP_OK) {
+        size_t chunk = sizeof(jw->buf) - jw->len;
+        if (chunk > len)
+            chunk = len;
+        memcpy(jw->buf + jw->len, str, chunk);
+        jw->len += chunk;
+        str += chunk;
+        len -= chunk;
+
+        if (jw->len == sizeof(jw->buf))
+            jw_flush(jw);
+    }
+}
+
+static inline void jw_putc(json_writer_t* jw, char c) {
+    jw_write(jw, &c, 1);
+}
+
+static void jw_write_escaped(json_writer_t* jw, const char* str) {
+    char esc[7];
+
+    jw_putc(jw, '"');
+    for (const char* run = str; ; str++) {
+        unsigned char c = *str;
+        if (c != '\0' && c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        // Copy the run of plain chars in one go
+        jw_write(jw, run, str - run);
+        if (c == '\0')
+            break;
+        run = str + 1;
+
+        switch (c) {
+        case '"':   jw_write(jw, "\\\"", 2); break;
+        case '\\':  jw_write(jw, "\\\\", 2); break;
+        case '\b':  jw_write(jw, "\\b", 2); break;
+        case '\f':  jw_write(jw, "\\f", 2); break;
+        case '\n':  jw_write(jw, "\\n", 2); break;
+        case '\r':  jw_write(jw, "\\r", 2); break;
+        case '\t':  jw_write(jw, "\\t", 2); break;
+        default:
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            jw_write(jw, esc, 6);
+            break;
+        }
+    }
+    jw_putc(jw, '"');
+}
+
+// Emit the separator and the member name before a value
+static void jw_begin_value(json_writer_t* jw, const char* key) {
+    uint16_t mask = 1 << jw->depth;
+
+    if (jw->has_item & mask)
+        jw_putc(jw, ',');
+    jw->has_item |= mask;
+
+    if (key != NULL) {
+        jw_write_escaped(jw, key);
+        jw_putc(jw, ':');
+    }
+}
+
+static void jw_open(json_writer_t* jw, const char* key, char c) {
+    jw_begin_value(jw, key);
+    if (jw->depth >= JSON_WRITER_DEPTH_MAX) {
+        jw->err = ESP_ERR_INVALID_STATE;
+        return;
+    }
+    jw_putc(jw, c);
+    jw->depth++;
+    jw->has_item &= ~(1 << jw->depth);
+}
+
+static void jw_close(json_writer_t* jw, char c) {
+    if (jw->depth == 0) {
+        jw->err = ESP_ERR_INVALID_STATE;
+        return;
+    }
+    jw->depth--;
+    jw_putc(jw, c);
+}
+
+void jw_init(json_writer_t* jw, json_writer_sink_t sink, void* ctx) {
+    jw->sink = sink;
+    jw->ctx = ctx;
+    jw->err = ESP_OK;
+    jw->depth = 0;
+    jw->has_item = 0;
+    jw->len = 0;
+}
+
+esp_err_t jw_finish(json_writer_t* jw) {
+    if (jw->depth != 0 && jw->err == ESP_OK)
+        jw->err = ESP_ERR_INVALID_STATE;
+    jw_flush(jw);
+    return jw->err;
+}
+
+void jw_object_begin(json_writer_t* jw, const char* key) {
+    jw_open(jw, key, '{');
+}
+
+void jw_object_end(json_writer_t* jw) {
+    jw_close(jw, '}');
+}
+
+void jw_array_begin(json_writer_t* jw, const char* key) {
+    jw_open(jw, key, '[');
+}
+
+void jw_array_end(json_writer_t* jw) {
+    jw_close(jw, ']');
+}
+
+void jw_string(json_writer_t* jw, const char* key, const char* value) {
+    if (value == NULL) {
+        jw_null(jw, key);
+        return;
+    }
+    jw_begin_value(jw, key);
+    jw_write_escaped(jw, value);
+}
+
+void jw_int(json_writer_t* jw, const char* key, int32_t value) {
+    char num[12];
+    jw_begin_value(jw, key);
+    jw_write(jw, num, snprintf(num, sizeof(num), "%d", value));
+}
+
+void jw_uint(json_writer_t* jw, const char* key, uint32_t value) {
+    char num[11];
+    jw_begin_value(jw, key);
+    jw_write(jw, num, snprintf(num, sizeof(num), "%u", value));
+}
+
+void jw_number(json_writer_t* jw, const char* key, double value) {
+    jw_number_prec(jw, key, value, 15);
+}
+
+void jw_number_prec(json_writer_t* jw, const char* key, double value, int digits) {
+    char num[26];
+
+    if (value != value || value - value != value - value) {
+        // JSON has no NaN or infinity
+        jw_null(jw, key);
+        return;
+    }
+
+    // Same as cJSON, integers are printed without the fraction. Converting a double
+    // outside the int32 range is undefined, those are left to the %g below.
+    if (value >= INT32_MIN && value <= INT32_MAX && value == (double)(int32_t)value) {
+        jw_int(jw, key, (int32_t)value);
+        return;
+    }
+
+    jw_begin_value(jw, key);
+    jw_write(jw, num, snprintf(num, sizeof(num), "%1.*g", digits, value));
+}
+
+void jw_bool(json_writer_t* jw, const char* key, int value) {
+    jw_begin_value(jw, key);
+    if (value)
+        jw_write(jw, "true", 4);
+    else
+        jw_write(jw, "false", 5);
+}
+
+void jw_null(json_writer_t* jw, const char* key) {
+    jw_begin_value(jw, key);
+    jw_write(jw, "null", 4);
+}
@@ -0,0 +1,51 @@
+/*
+ * json_writer.h
+ *
+ * A streaming JSON emitter. Output is collected in a small fixed buffer inside
+ * json_writer_t and handed to a sink (e.g. httpd_resp_send_chunk) whenever it
+ * fills up, so no tree or heap buffer is needed to build a response.
+ */
+
+#ifndef MAIN_JSON_WRITER_H_
+#define MAIN_JSON_WRITER_H_
+
+#include <stdint.h>
+#include <strings.h>
+#include "esp_err.h"
+
+#define JSON_WRITER_BUF_SIZE    128
+// Max. nesting level of objects and arrays
+#define JSON_WRITER_DEPTH_MAX   8
+
+// Called with each filled buffer, a non-ESP_OK return aborts the output
+typedef esp_err_t (*json_writer_sink_t)(void* ctx, const char* buf, size_t len);
+
+typedef struct json_writer {
+    json_writer_sink_t sink;
+    void* ctx;
+    esp_err_t err;          // First error, all later output is dropped
+    uint8_t depth;
+    uint16_t has_item;      // Bit n set: the container at level n already has an item, a comma is needed
+    size_t len;
+    char buf[JSON_WRITER_BUF_SIZE];
+} json_writer_t;
+
+void jw_init(json_writer_t* jw, json_writer_sink_t sink, void* ctx);
+// Flush the remaining output, returns the first error during the output
+esp_err_t jw_finish(json_writer_t* jw);
+
+// key is the member name inside an object, NULL for array elements and the root value
+void jw_object_begin(json_writer_t* jw, const char* key);
+void jw_object_end(json_writer_t* jw);
+void jw_array_begin(json_writer_t* jw, const char* key);
+void jw_array_end(json_writer_t* jw);
+void jw_string(json_writer_t* jw, const char* key, const char* value);
+void jw_int(json_writer_t* jw, const char* key, int32_t value);
+void jw_uint(json_writer_t* jw, const char* key, uint32_t value);
+void jw_number(json_writer_t* jw, const char* key, double value);
+// With at most digits significant digits, e.g. 7 for a value that came from a float
+void jw_number_prec(json_writer_t* jw, const char* key, double value, int digits);
+void jw_bool(json_writer_t* jw, const char* key, int value);
+void jw_null(json_writer_t* jw, const char* key);
+
+#endif /* MAIN_JSON_WRITER_H_ */
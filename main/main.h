@@ -37,10 +37,41 @@ enum cfg_data_idt {
     CFG_UART_BAUD,
     CFG_UART_PARITY,
     CFG_UART_TX_DELAY,
+    CFG_RTU_BCAST_DELAY,
+    CFG_RTU_BCAST_ACK,
+    CFG_RTU_RETRY_MAX,
+    CFG_RTU_RETRY_FCS,
+    CFG_POLL_LIST,
+    CFG_RTU_RX_TIMEOUT,
+    CFG_POLL_STALE_PERIODS,
+    CFG_RTU_SNIFF,
+    CFG_VSLAVE_UID,
+    CFG_MQTT_URI,
+    CFG_MQTT_TOPIC,
+    CFG_MQTT_INTEGRITY,
+    CFG_TAG_LIST,
 
     CFG_IDT_MAX
 };
 
+// Runtime side effects of config changes, each group is applied at most once per batch
+#define CFG_APPLY_NONE          0
+#define CFG_APPLY_UART_FORMAT   (1 << 0)
+#define CFG_APPLY_RTU_BCAST     (1 << 1)
+#define CFG_APPLY_RTU_RETRY     (1 << 2)
+#define CFG_APPLY_POLL_LIST     (1 << 3)
+#define CFG_APPLY_RTU_TIMEOUT   (1 << 4)
+#define CFG_APPLY_POLL_STALE    (1 << 5)
+#define CFG_APPLY_RTU_SNIFF     (1 << 6)
+#define CFG_APPLY_VSLAVE        (1 << 7)
+#define CFG_APPLY_MQTT          (1 << 8)
+#define CFG_APPLY_TAGS          (1 << 9)
+
+typedef struct cp_batch_item {
+    enum cfg_data_idt id;
+    const void* buf;    // Same as the buf of cp_set_by_id()
+} cp_batch_item_t;
+
 typedef struct ip_info {
     char ip4_addr[IPV4_ADDR_MAXLEN];
     char ip4_netmask[IPV4_ADDR_MAXLEN];
@@ -57,11 +88,18 @@ typedef struct ip_info {
  * If not set, ssid or pass will be a string with 0 length.
  */
 #define cp_is_valid_id(id) (id >= 0 && id < CFG_IDT_MAX)
+// Load all config values into RAM, must be called after nvs_flash_init() and before any other cp_ functions.
+esp_err_t cp_init();
 enum cfg_data_idt cp_id_from_name(const char* name);
 char* cp_name_from_id(enum cfg_data_idt id);
 esp_err_t cp_get_by_id(enum cfg_data_idt id, void* buf, size_t* maxlen);
 esp_err_t cp_set_by_id(enum cfg_data_idt id, const void* buf);
 esp_err_t cp_set_by_id_from_raw(enum cfg_data_idt id, const char* param);
+// Validate all items first, then write them with a single NVS commit and apply the side effects once.
+// Nothing is written if any item fails the validation.
+esp_err_t cp_set_batch(const cp_batch_item_t* items, size_t count);
+// Strings are referenced by the item, not copied.
+esp_err_t cp_batch_item_from_raw(enum cfg_data_idt id, const char* param, cp_batch_item_t* item);
 esp_err_t cp_get_by_id_to_readable(enum cfg_data_idt id, char* buf, size_t maxlen);
 #define cp_get_u8_by_id(id, out_addr) (cp_get_by_id(id, (void*)(out_addr), NULL))
 #define cp_set_u8_by_id(id, out_addr) (cp_set_by_id(id, (void*)((uint8_t)out_addr)))
@@ -80,9 +118,23 @@ uint8_t  wifi_ap_turn_off();
 esp_err_t wifi_ap_query(char* ssid, size_t ssid_len);
 
 // Config provider callbacks
-esp_err_t cpcb_check_set_baudrate(uint32_t baudrate);
-esp_err_t cpcb_check_set_parity(uint8_t parity);
-esp_err_t cpcb_check_set_tx_delay(uint32_t tx_delay);
+// cpcb_check_* must not have side effects, cpcb_apply() reconfigures the runtime from the stored values.
+esp_err_t cpcb_check_baudrate(uint32_t baudrate);
+esp_err_t cpcb_check_parity(uint8_t parity);
+esp_err_t cpcb_check_tx_delay(uint32_t tx_delay);
+esp_err_t cpcb_check_bcast_delay(uint32_t delay_ms);
+esp_err_t cpcb_check_bcast_ack(uint8_t ack);
+esp_err_t cpcb_check_retry_max(uint8_t retry_max);
+esp_err_t cpcb_check_poll_list(const char* list);
+esp_err_t cpcb_check_rx_timeout(uint32_t timeout_ms);
+esp_err_t cpcb_check_stale_periods(uint8_t periods);
+esp_err_t cpcb_check_sniff_mode(uint8_t mode);
+esp_err_t cpcb_check_vslave_uid(uint8_t uid);
+esp_err_t cpcb_check_mqtt_uri(const char* uri);
+esp_err_t cpcb_check_mqtt_topic(const char* topic);
+esp_err_t cpcb_check_mqtt_integrity(uint32_t integrity_s);
+esp_err_t cpcb_check_tag_list(const char* list);
 esp_err_t cpcb_check_ap_auth(uint8_t auth);
+void cpcb_apply(uint32_t groups);
 
 #endif /* MAIN_MAIN_H_ */
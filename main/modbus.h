@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <strings.h>
+#include "esp_err.h"
 
 // GPIO ID of the DE pin
 #define MODBUS_GPIO_DE_ID 0
@@ -14,6 +15,26 @@
 #define MODBUS_RTU_FRAME_MAXLEN     256
 #define MODBUS_RTU_TX_FIFO_LEN      (MODBUS_RTU_FRAME_MAXLEN*2)
 #define MODBUS_RTU_TX_DELAY_US_MAX  1024
+#define MODBUS_UID_BROADCAST        0
+// The Modbus serial line spec recommends a 100~200ms turnaround delay after a broadcast
+#define MODBUS_RTU_BCAST_DELAY_MS_DEFAULT   100
+#define MODBUS_RTU_BCAST_DELAY_MS_MAX       1000
+// Retry policy for timeouts and corrupted responses, bit n of the mask allows FCn to be retried.
+// Only the idempotent reads (FC01~FC04) are retried by default.
+#define MODBUS_RTU_RETRY_MAX_DEFAULT        2
+#define MODBUS_RTU_RETRY_MAX_LIMIT          5
+#define MODBUS_RTU_RETRY_FCS_DEFAULT        ((1<<1) | (1<<2) | (1<<3) | (1<<4))
+// How long to wait for the response after the request is sent
+#define MODBUS_RTU_RX_TIMEOUT_MS_DEFAULT    300
+#define MODBUS_RTU_RX_TIMEOUT_MS_MIN        10
+#define MODBUS_RTU_RX_TIMEOUT_MS_MAX        5000
+// Allowance for the processing time of a slave, used for bus time estimation
+#define MODBUS_RTU_SLAVE_THINK_US           5000
+// Exception codes
+#define MODBUS_EXC_ILLEGAL_FUNCTION     1
+#define MODBUS_EXC_ILLEGAL_ADDRESS      2
+#define MODBUS_EXC_ILLEGAL_VALUE        3
+#define MODBUS_EXC_SLAVE_BUSY           6
 
 //__attribute__ ((packed))
 typedef struct mbap_header {
@@ -23,11 +44,24 @@ typedef struct mbap_header {
     uint8_t uid;
 } mbap_header_t;
 
+// Where a request comes from, and hence where its response goes to
+enum rtu_origin {
+    RTU_ORIGIN_TCP = 0,         // A Modbus TCP client
+    RTU_ORIGIN_POLLER,          // The gateway-side poller, transaction_id is the index of the poll block
+    RTU_ORIGIN_HTTP,            // The /modbus HTTP API, transaction_id is a sequence number
+    RTU_ORIGIN_WS,              // A client of the /ws_modbus WebSocket tunnel, socket is its httpd fd
+    RTU_ORIGIN_COUNT
+};
+
 typedef struct rtu_session {
     int socket;
     uint16_t transaction_id;
     uint16_t protocol_id;
     uint8_t uid;
+    uint8_t retry;              // Number of times this request has been retried
+    uint8_t origin;             // enum rtu_origin
+    uint32_t start_us;          // When the request arrived, see metrics_now_us()
+    uint32_t enqueue_us;        // When the request was queued into tx_fifo, set by modbus_uart_queue_send()
 } rtu_session_t;
 
 uint16_t modbus_rtu_crc16(const uint8_t *data, size_t dat_len);
@@ -35,14 +69,34 @@ void mbap_header_ntoh(mbap_header_t* header);
 void mbap_header_hton(mbap_header_t* header);
 
 void modbus_uart_init(uint32_t baudrate, uint8_t parity, uint32_t tx_delay);
-// Attempt to queue a new request, block the caller task if the queue is full
-void modbus_uart_queue_send(const void* buf, size_t len);
-// Queue the response to the Tx FIFO of TCP, non-blocking
+// Attempt to queue a new request, block the caller task if the queue is full.
+// buf starts with a rtu_session_t, its enqueue_us is stamped here.
+void modbus_uart_queue_send(void* buf, size_t len);
+// Same as modbus_uart_queue_send(), but gives up with ESP_ERR_TIMEOUT if the queue is still full after timeout_ms,
+// for the callers that must not be held up by a busy bus (e.g. the httpd task)
+esp_err_t modbus_uart_queue_send_timeout(void* buf, size_t len, uint32_t timeout_ms);
+// Queue the response to the Tx FIFO of TCP, or to the WebSocket of a tunnel client, non-blocking
 void tcp_server_send_response(const rtu_session_t* session_header, void* payload, size_t len);
+// A complete MBAP frame from a TCP (RTU_ORIGIN_TCP) or WebSocket tunnel (RTU_ORIGIN_WS) client
+void modbus_client_frame_ready(int client_socket, uint8_t origin, const void* buf, size_t len);
+// Send a response frame (MBAP header included) to a WebSocket tunnel client, non-blocking, see http_server.c
+void http_ws_tunnel_send(int fd, const void* frame, size_t len);
+// Deliver the response to where the request came from, non-blocking
+void modbus_session_response(const rtu_session_t* session_header, void* payload, size_t len);
+// Called when no response will be delivered for the request (timeout or bad response, after all retries)
+void modbus_session_failed(const rtu_session_t* session_header);
 
-void modbus_uart_set_baudrate(uint32_t baudrate);
-void modbus_uart_set_parity(uint8_t parity);
-void modbus_uart_set_tx_delay(uint32_t baudrate);
+// Reconfigure the serial line in one go, the bus is held idle only once
+void modbus_uart_set_format(uint32_t baudrate, uint8_t parity, uint32_t tx_delay);
+void modbus_uart_set_bcast(uint32_t delay_ms, uint8_t ack);
+void modbus_uart_set_retry(uint8_t retry_max, uint32_t retry_fcs);
+void modbus_uart_set_rx_timeout(uint32_t timeout_ms);
+// enum modbus_sniff_mode, see modbus_sniff.h
+void modbus_uart_set_sniff(uint8_t mode);
+// Estimate the bus time of a transaction from the frame lengths (including CRC), in us
+uint32_t modbus_uart_transaction_us(size_t req_len, size_t resp_len);
+// Upper bound of the time from queuing a request to its result, with tx_fifo full and every request retried
+uint32_t modbus_uart_result_timeout_ms();
 
 #ifdef MODBUS_DEBUG
 void modbus_send_dummy(const rtu_session_t* session_header, uint8_t* rtu_request_payload);
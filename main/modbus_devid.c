@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "modbus.h"
+#include "modbus_devid.h"
+
+#define DEVID_FUNC_CODE     0x2B
+#define DEVID_MEI_TYPE      0x0E
+// uid, fc, MEI type, read code, conformity level, more follows, next object id, number of objects
+#define DEVID_RESP_HDR_LEN  8
+
+#define DEVID_TTL_TICK      (MODBUS_DEVID_CACHE_TTL_MS / portTICK_RATE_MS)
+
+typedef struct devid_entry {
+    uint8_t uid;                // 0 if the slot is free
+    uint8_t read_code;          // 1 basic, 2 regular, 3 extended stream, 4 individual object
+    uint8_t object_id;          // First object of the response
+    uint8_t len;
+    TickType_t stored_tick;
+    uint8_t* pdu;               // The response, uid to the last object, without CRC
+} devid_entry_t;
+
+static struct modbus_devid {
+    SemaphoreHandle_t mux;
+    devid_entry_t entries[MODBUS_DEVID_CACHE_SLOTS];
+} devid = {0};
+
+void modbus_devid_init() {
+    devid.mux = xSemaphoreCreateMutex();
+}
+
+// Must be protected by devid.mux
+static devid_entry_t* devid_find(uint8_t uid, uint8_t read_code, uint8_t object_id) {
+    for (size_t i = 0; i < MODBUS_DEVID_CACHE_SLOTS; i++) {
+        devid_entry_t* entry = &devid.entries[i];
+        if (entry->uid == uid && entry->read_code == read_code && entry->object_id == object_id)
+            return entry;
+    }
+    return NULL;
+}
+
+size_t modbus_devid_lookup(const uint8_t* pdu, size_t pdu_len, uint8_t* resp, size_t resp_maxlen) {
+    size_t resp_len = 0;
+
+    if (devid.mux == NULL || pdu_len != 5 || pdu[0] == 0 || pdu[1] != DEVID_FUNC_CODE || pdu[2] != DEVID_MEI_TYPE)
+        return 0;
+
+    xSemaphoreTake(devid.mux, portMAX_DELAY);
+    devid_entry_t* entry = devid_find(pdu[0], pdu[3], pdu[4]);
+    if (entry != NULL && xTaskGetTickCount() - entry->stored_tick < DEVID_TTL_TICK &&
+        MODBUS_TCP_PAYLOAD_OFFSET + entry->len <= resp_maxlen) {
+        memcpy(resp + MODBUS_TCP_PAYLOAD_OFFSET, entry->pdu, entry->len);
+        resp_len = MODBUS_TCP_PAYLOAD_OFFSET + entry->len;
+    }
+    xSemaphoreGive(devid.mux);
+
+    return resp_len;
+}
+
+void modbus_devid_store(const uint8_t* pdu, size_t pdu_len) {
+    // Exception responses are not cached, the slave is asked again next time
+    if (devid.mux == NULL || pdu_len <= DEVID_RESP_HDR_LEN || pdu_len > 0xFF || pdu[0] == 0 ||
+        pdu[1] != DEVID_FUNC_CODE || pdu[2] != DEVID_MEI_TYPE || pdu[7] == 0)
+        return;
+
+    uint8_t* copy = malloc(pdu_len);
+    if (copy == NULL)
+        return;
+    memcpy(copy, pdu, pdu_len);
+
+    xSemaphoreTake(devid.mux, portMAX_DELAY);
+    TickType_t now = xTaskGetTickCount();
+    // The same request again (an expired entry), a free slot, or else the oldest entry
+    devid_entry_t* entry = devid_find(pdu[0], pdu[3], pdu[DEVID_RESP_HDR_LEN]);
+    for (size_t i = 0; entry == NULL && i < MODBUS_DEVID_CACHE_SLOTS; i++) {
+        if (devid.entries[i].uid == 0)
+            entry = &devid.entries[i];
+    }
+    if (entry == NULL) {
+        entry = &devid.entries[0];
+        for (size_t i = 1; i < MODBUS_DEVID_CACHE_SLOTS; i++) {
+            if (now - devid.entries[i].stored_tick > now - entry->stored_tick)
+                entry = &devid.entries[i];
+        }
+    }
+
+    free(entry->pdu);
+    entry->uid = pdu[0];
+    entry->read_code = pdu[3];
+    entry->object_id = pdu[DEVID_RESP_HDR_LEN];
+    entry->len = pdu_len;
+    entry->stored_tick = now;
+    entry->pdu = copy;
+    xSemaphoreGive(devid.mux);
+}
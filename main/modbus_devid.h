@@ -0,0 +1,30 @@
+/*
+ * modbus_devid.h
+ *
+ * Cache of FC43/14 (read device identification) responses. The identification of a slave
+ * does not change at run time, so once a slave has answered, the TCP server task answers
+ * repeats of the same request from RAM without touching the RS485 bus.
+ */
+
+#ifndef MAIN_MODBUS_DEVID_H_
+#define MAIN_MODBUS_DEVID_H_
+
+#include <stdint.h>
+#include <strings.h>
+
+#define MODBUS_DEVID_CACHE_SLOTS    16
+// Entries are refreshed from the slave after this long, in case it has been replaced
+#define MODBUS_DEVID_CACHE_TTL_MS   3600000
+
+void modbus_devid_init();
+
+// Answer a request (uid, 0x2B, 0x0E, read code, object id) from the cache, same convention as
+// modbus_poller_read_image(): the response is placed at resp+MODBUS_TCP_PAYLOAD_OFFSET and the total
+// length is returned. Returns 0 if the request is not a device identification request or is not cached.
+size_t modbus_devid_lookup(const uint8_t* pdu, size_t pdu_len, uint8_t* resp, size_t resp_maxlen);
+
+// RTU task, remember a response (uid, fc, ...) from the bus, anything other than a device
+// identification response is ignored.
+void modbus_devid_store(const uint8_t* pdu, size_t pdu_len);
+
+#endif /* MAIN_MODBUS_DEVID_H_ */
@@ -0,0 +1,254 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "modbus_devid.h"
+#include "modbus_http.h"
+#include "modbus_metrics.h"
+#include "modbus_poller.h"
+#include "modbus_vslave.h"
+
+// uid + PDU, the RTU frame without its CRC
+#define HTTP_REQ_MAXLEN     (MODBUS_RTU_FRAME_MAXLEN - 2)
+
+static struct modbus_http {
+    SemaphoreHandle_t mux;
+    SemaphoreHandle_t done;     // Given when the outstanding request has completed
+    // Protected by mux
+    uint16_t seq;               // transaction_id of the outstanding request, late responses to older ones are dropped
+    uint8_t* resp;              // Where its response goes, NULL if none is expected
+    size_t resp_maxlen;
+    size_t resp_len;            // 0 if it has failed
+} mbh = {0};
+
+void modbus_http_init() {
+    mbh.mux = xSemaphoreCreateMutex();
+    mbh.done = xSemaphoreCreateBinary();
+}
+
+void modbus_http_on_response(const rtu_session_t* session_header, const uint8_t* payload, size_t len) {
+    xSemaphoreTake(mbh.mux, portMAX_DELAY);
+    if (session_header->transaction_id == mbh.seq && mbh.resp != NULL) {
+        if (len <= mbh.resp_maxlen) {
+            memcpy(mbh.resp, payload, len);
+            mbh.resp_len = len;
+        }
+        xSemaphoreGive(mbh.done);
+    }
+    xSemaphoreGive(mbh.mux);
+}
+
+void modbus_http_on_failure(const rtu_session_t* session_header) {
+    xSemaphoreTake(mbh.mux, portMAX_DELAY);
+    if (session_header->transaction_id == mbh.seq && mbh.resp != NULL)
+        xSemaphoreGive(mbh.done);
+    xSemaphoreGive(mbh.mux);
+}
+
+esp_err_t modbus_http_transact(const uint8_t* pdu, size_t pdu_len, uint8_t* resp, size_t resp_maxlen, size_t* resp_len,
+                               TickType_t deadline) {
+    uint8_t payload[sizeof(rtu_session_t) + HTTP_REQ_MAXLEN];
+    rtu_session_t* session_header = (rtu_session_t*)payload;
+
+    if (mbh.mux == NULL || pdu_len < 2 || pdu_len > HTTP_REQ_MAXLEN)
+        return ESP_ERR_INVALID_ARG;
+
+    // Same shortcuts as for a Modbus TCP client
+    *resp_len = modbus_vslave_handle(pdu, pdu_len, resp, resp_maxlen);
+    if (*resp_len == 0)
+        *resp_len = modbus_poller_read_image(pdu, pdu_len, resp, resp_maxlen);
+    if (*resp_len == 0)
+        *resp_len = modbus_devid_lookup(pdu, pdu_len, resp, resp_maxlen);
+    if (*resp_len > 0)
+        return ESP_OK;
+
+    // Do not even queue it once the batch is out of time
+    TickType_t now = xTaskGetTickCount();
+    if ((int32_t)(deadline - now) <= 0)
+        return ESP_ERR_TIMEOUT;
+
+    xSemaphoreTake(mbh.mux, portMAX_DELAY);
+    mbh.seq++;
+    // Nothing to wait for after a broadcast, an acknowledgement is dropped
+    mbh.resp = pdu[0] == MODBUS_UID_BROADCAST ? NULL : resp;
+    mbh.resp_maxlen = resp_maxlen;
+    mbh.resp_len = 0;
+    xSemaphoreTake(mbh.done, 0);
+    session_header->transaction_id = mbh.seq;
+    xSemaphoreGive(mbh.mux);
+
+    session_header->socket = -1;
+    session_header->protocol_id = 0;
+    session_header->uid = pdu[0];
+    session_header->retry = 0;
+    session_header->origin = RTU_ORIGIN_HTTP;
+    session_header->start_us = metrics_now_us();
+    memcpy(payload + sizeof(rtu_session_t), pdu, pdu_len);
+    // tx_fifo may be full of TCP traffic, waiting for room counts against the deadline as well
+    if (modbus_uart_queue_send_timeout(payload, sizeof(rtu_session_t) + pdu_len,
+                                       (deadline - now) * portTICK_RATE_MS) != ESP_OK) {
+        xSemaphoreTake(mbh.mux, portMAX_DELAY);
+        mbh.resp = NULL;
+        xSemaphoreGive(mbh.mux);
+        *resp_len = 0;
+        return ESP_ERR_TIMEOUT;
+    }
+
+    if (pdu[0] == MODBUS_UID_BROADCAST)
+        return ESP_OK;
+
+    // A late response is dropped, it no longer matches seq
+    now = xTaskGetTickCount();
+    if ((int32_t)(deadline - now) > 0)
+        xSemaphoreTake(mbh.done, deadline - now);
+
+    xSemaphoreTake(mbh.mux, portMAX_DELAY);
+    *resp_len = mbh.resp_len;
+    mbh.resp = NULL;
+    xSemaphoreGive(mbh.mux);
+
+    return *resp_len > 0 ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+static inline size_t http_data_len(uint8_t func_code, uint16_t count) {
+    return func_code <= 2 ? (count + 7) / 8 : count * 2;
+}
+
+static int http_get_u16(const cJSON* op, const char* name, uint16_t* out) {
+    const cJSON* item = cJSON_GetObjectItem(op, name);
+    if (!cJSON_IsNumber(item) || item->valuedouble < 0 || item->valuedouble > 0xFFFF)
+        return 0;
+    *out = item->valuedouble;
+    return 1;
+}
+
+// Encode an operation as a request (uid, fc, ...), returns its length or 0 if the operation is malformed
+static size_t http_build_request(const cJSON* op, uint8_t* pdu, uint16_t* count) {
+    uint16_t uid, func_code, addr, value;
+    size_t len = 6;
+
+    if (!http_get_u16(op, "uid", &uid) || uid > 247 || !http_get_u16(op, "fc", &func_code) ||
+        !http_get_u16(op, "addr", &addr))
+        return 0;
+
+    pdu[0] = uid;
+    pdu[1] = func_code;
+    pdu[2] = addr >> 8;
+    pdu[3] = addr & 0xFF;
+
+    switch (func_code) {
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+        if (uid == MODBUS_UID_BROADCAST || !http_get_u16(op, "count", count) || *count == 0 ||
+            *count > (func_code <= 2 ? 2000 : 125))
+            return 0;
+        value = *count;
+        break;
+    case 5:
+        if (!http_get_u16(op, "value", &value) || value > 1)
+            return 0;
+        value = value ? 0xFF00 : 0;
+        break;
+    case 6:
+        if (!http_get_u16(op, "value", &value))
+            return 0;
+        break;
+    case 15:
+    case 16: {
+        const cJSON* values = cJSON_GetObjectItem(op, "values");
+        int n = cJSON_GetArraySize(values);
+        size_t data_len = func_code == 15 ? (n + 7) / 8 : n * 2;
+        if (!cJSON_IsArray(values) || n == 0 || n > (func_code == 15 ? 1968 : 123))
+            return 0;
+
+        memset(pdu + 7, 0, data_len);
+        for (int i = 0; i < n; i++) {
+            const cJSON* item = cJSON_GetArrayItem(values, i);
+            if (!cJSON_IsNumber(item) || item->valuedouble < 0 || item->valuedouble > (func_code == 15 ? 1 : 0xFFFF))
+                return 0;
+            uint16_t v = item->valuedouble;
+            if (func_code == 15) {
+                pdu[7 + i / 8] |= v << (i % 8);
+            } else {
+                pdu[7 + i * 2] = v >> 8;
+                pdu[8 + i * 2] = v & 0xFF;
+            }
+        }
+        pdu[6] = data_len;
+        value = n;
+        len = 7 + data_len;
+        break;
+    }
+    default:
+        return 0;
+    }
+
+    pdu[4] = value >> 8;
+    pdu[5] = value & 0xFF;
+    return len;
+}
+
+// The values of a read response (uid, fc, byte count, data), its length has been checked
+static void http_write_values(json_writer_t* jw, const uint8_t* resp_pdu, uint16_t count) {
+    uint8_t func_code = resp_pdu[1];
+
+    jw_array_begin(jw, "values");
+    for (uint16_t i = 0; i < count; i++) {
+        if (func_code <= 2) {
+            jw_uint(jw, NULL, (resp_pdu[3 + i / 8] >> (i % 8)) & 1);
+        } else {
+            jw_uint(jw, NULL, (resp_pdu[3 + i * 2] << 8) | resp_pdu[4 + i * 2]);
+        }
+    }
+    jw_array_end(jw);
+}
+
+void modbus_http_run_op(json_writer_t* jw, const cJSON* op, TickType_t deadline) {
+    uint8_t pdu[HTTP_REQ_MAXLEN];
+    uint8_t resp[MODBUS_TCP_PAYLOAD_OFFSET + MODBUS_RTU_FRAME_MAXLEN];
+    uint16_t count = 0;
+    size_t resp_len;
+
+    jw_object_begin(jw, NULL);
+
+    size_t pdu_len = http_build_request(op, pdu, &count);
+    if (pdu_len == 0) {
+        jw_bool(jw, "ok", 0);
+        jw_string(jw, "error", "invalid");
+        goto func_ret;
+    }
+
+    if (modbus_http_transact(pdu, pdu_len, resp, sizeof(resp), &resp_len, deadline) != ESP_OK) {
+        jw_bool(jw, "ok", 0);
+        jw_string(jw, "error", "no_response");
+        goto func_ret;
+    }
+
+    if (resp_len == 0) {
+        // Broadcast
+        jw_bool(jw, "ok", 1);
+        goto func_ret;
+    }
+
+    const uint8_t* resp_pdu = resp + MODBUS_TCP_PAYLOAD_OFFSET;
+    size_t resp_pdu_len = resp_len - MODBUS_TCP_PAYLOAD_OFFSET;
+    size_t data_len = pdu[1] <= 4 ? http_data_len(pdu[1], count) : 0;
+    if (resp_pdu_len >= 3 && resp_pdu[1] == (pdu[1] | 0x80)) {
+        jw_bool(jw, "ok", 0);
+        jw_uint(jw, "exception", resp_pdu[2]);
+    } else if (resp_pdu[1] != pdu[1] || (pdu[1] <= 4 && (resp_pdu_len != 3 + data_len || resp_pdu[2] != data_len))) {
+        jw_bool(jw, "ok", 0);
+        jw_string(jw, "error", "invalid_response");
+    } else {
+        jw_bool(jw, "ok", 1);
+        if (pdu[1] <= 4)
+            http_write_values(jw, resp_pdu, count);
+    }
+
+func_ret:
+    jw_object_end(jw);
+}
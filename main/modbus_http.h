@@ -0,0 +1,48 @@
+/*
+ * modbus_http.h
+ *
+ * Batch register access over HTTP ("/modbus"): a JSON array of operations is executed one
+ * after another through tx_fifo, like the requests of a Modbus TCP client, and all the results
+ * are returned in one response. A web HMI needs one round trip per screen refresh.
+ *
+ * An operation is an object {"uid":1, "fc":3, "addr":0, "count":10}, the writes take "value"
+ * (FC05, FC06) or "values" (FC15, FC16) instead of "count". Coils are 0 or 1.
+ * Its result is {"ok":true, "values":[...]} for the reads, {"ok":true} for the writes and the
+ * broadcasts, {"ok":false, "exception":n} or {"ok":false, "error":"invalid"/"no_response"} otherwise.
+ */
+
+#ifndef MAIN_MODBUS_HTTP_H_
+#define MAIN_MODBUS_HTTP_H_
+
+#include <stdint.h>
+#include <strings.h>
+#include <cJSON.h>
+#include "esp_err.h"
+
+#include "freertos/FreeRTOS.h"
+
+#include "json_writer.h"
+#include "modbus.h"
+
+#define MODBUS_HTTP_OPS_MAX         32
+#define MODBUS_HTTP_BODY_MAXLEN     2048
+// Wall time limit of a whole batch, the httpd task (web page, /ws pushes, OTA) is blocked meanwhile.
+// Once it is reached, the remaining operations fail with "no_response" unless they are answered locally.
+#define MODBUS_HTTP_BATCH_MS        3000
+
+void modbus_http_init();
+
+// Blocking, only one caller (the httpd task) at a time. Executes a request (uid, fc, ...) and places
+// the response at resp+MODBUS_TCP_PAYLOAD_OFFSET. resp_len is 0 for a broadcast.
+// Returns ESP_ERR_TIMEOUT if the slave gave no valid response before the deadline (a tick count).
+esp_err_t modbus_http_transact(const uint8_t* pdu, size_t pdu_len, uint8_t* resp, size_t resp_maxlen, size_t* resp_len,
+                               TickType_t deadline);
+
+// Execute one operation of a batch and write its result object, deadline is when the batch gives up
+void modbus_http_run_op(json_writer_t* jw, const cJSON* op, TickType_t deadline);
+
+// RTU task, see modbus_session_response() and modbus_session_failed()
+void modbus_http_on_response(const rtu_session_t* session_header, const uint8_t* payload, size_t len);
+void modbus_http_on_failure(const rtu_session_t* session_header);
+
+#endif /* MAIN_MODBUS_HTTP_H_ */
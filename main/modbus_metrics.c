@@ -0,0 +1,371 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "modbus_metrics.h"
+#include "modbus_poller.h"
+
+typedef struct metrics_histogram {
+    uint32_t buckets[METRICS_LATENCY_BUCKETS];  // Not cumulative, summed up on output
+    uint32_t sum_ms;
+} metrics_histogram_t;
+
+typedef struct metrics_uid {
+    uint32_t requests;          // Including retries
+    uint32_t retries;
+    uint32_t responses;
+    uint32_t timeouts;
+    uint32_t crc_errors;
+    uint32_t exceptions;
+    metrics_histogram_t latency;    // Bus round trip, end of request to end of response
+} metrics_uid_t;
+
+typedef struct metrics_client {
+    int socket;                 // -1 if the slot is free
+    char addr[METRICS_CLIENT_ADDR_MAXLEN];
+
+    // Written by the TCP server task owning the socket
+    uint32_t requests;
+    uint32_t image_hits;        // Answered from the register image
+    uint32_t vslave_hits;       // Answered by the virtual slave
+    uint32_t devid_hits;        // Answered from the device identification cache
+
+    // Written by the RTU task
+    uint32_t responses;
+    uint32_t failures;
+    metrics_histogram_t latency;    // Arrival of the request to sending the response
+} metrics_client_t;
+
+static const uint32_t latency_bounds_ms[METRICS_LATENCY_BUCKETS - 1] = METRICS_LATENCY_BOUNDS_MS;
+
+static struct modbus_metrics {
+    // RTU task only
+    uint8_t uid_slot[256];          // UID to slot index + 1, 0 if not assigned yet
+    uint8_t uid_of_slot[METRICS_UID_SLOTS];
+    uint8_t uid_slots_used;
+    metrics_uid_t uids[METRICS_UID_SLOTS + 1]; // The last one is for all other UIDs
+    uint32_t broadcasts;
+    uint32_t rx_overflow_buf;
+    uint32_t rx_overflow_fifo;
+
+    metrics_client_t clients[METRICS_CLIENT_SLOTS];
+} metrics = {
+    .clients = {[0 ... METRICS_CLIENT_SLOTS-1] = {.socket = -1}}
+};
+
+uint32_t metrics_now_us() {
+    return (uint32_t)esp_timer_get_time();
+}
+
+static void metrics_histogram_add(metrics_histogram_t* hist, uint32_t start_us) {
+    uint32_t ms = (metrics_now_us() - start_us) / 1000;
+    size_t i = 0;
+    while (i < METRICS_LATENCY_BUCKETS - 1 && ms > latency_bounds_ms[i])
+        i++;
+    hist->buckets[i]++;
+    hist->sum_ms += ms;
+}
+
+static metrics_uid_t* metrics_uid_get(uint8_t uid) {
+    uint8_t slot = metrics.uid_slot[uid];
+    if (slot == 0) {
+        if (metrics.uid_slots_used >= METRICS_UID_SLOTS)
+            return &metrics.uids[METRICS_UID_SLOTS];
+        // Publish the UID before the slot becomes visible to the readers
+        metrics.uid_of_slot[metrics.uid_slots_used] = uid;
+        slot = ++metrics.uid_slots_used;
+        metrics.uid_slot[uid] = slot;
+    }
+    return &metrics.uids[slot - 1];
+}
+
+static metrics_client_t* metrics_client_get(int socket) {
+    for (size_t i = 0; i < METRICS_CLIENT_SLOTS; i++) {
+        if (metrics.clients[i].socket == socket)
+            return &metrics.clients[i];
+    }
+    return NULL;
+}
+
+void metrics_rtu_request(uint8_t uid, uint8_t retry) {
+    metrics_uid_t* m = metrics_uid_get(uid);
+    m->requests++;
+    if (retry)
+        m->retries++;
+}
+
+void metrics_rtu_broadcast() {
+    metrics.broadcasts++;
+}
+
+void metrics_rtu_response(uint8_t uid, uint32_t start_us) {
+    metrics_uid_t* m = metrics_uid_get(uid);
+    m->responses++;
+    metrics_histogram_add(&m->latency, start_us);
+}
+
+void metrics_rtu_timeout(uint8_t uid) {
+    metrics_uid_get(uid)->timeouts++;
+}
+
+void metrics_rtu_exception(uint8_t uid) {
+    metrics_uid_get(uid)->exceptions++;
+}
+
+void metrics_rtu_crc_error(uint8_t uid) {
+    metrics_uid_get(uid)->crc_errors++;
+}
+
+void metrics_rtu_rx_overflow(uint8_t buf, uint8_t fifo) {
+    if (buf)
+        metrics.rx_overflow_buf++;
+    if (fifo)
+        metrics.rx_overflow_fifo++;
+}
+
+// Slots are only claimed and released by the TCP server tasks, the scheduler is suspended
+// so that the IPv4 and IPv6 servers do not pick the same free slot.
+void metrics_tcp_client_open(int socket, const char* addr) {
+    vTaskSuspendAll();
+    metrics_client_t* m = metrics_client_get(-1);
+    if (m != NULL) {
+        memset(m, 0, sizeof(metrics_client_t));
+        strncpy(m->addr, addr, sizeof(m->addr) - 1);
+        m->socket = socket;
+    }
+    xTaskResumeAll();
+}
+
+void metrics_tcp_client_close(int socket) {
+    metrics_client_t* m = metrics_client_get(socket);
+    if (m != NULL)
+        m->socket = -1;
+}
+
+void metrics_tcp_request(int socket) {
+    metrics_client_t* m = metrics_client_get(socket);
+    if (m != NULL)
+        m->requests++;
+}
+
+void metrics_tcp_image_hit(int socket) {
+    metrics_client_t* m = metrics_client_get(socket);
+    if (m != NULL)
+        m->image_hits++;
+}
+
+void metrics_tcp_vslave_hit(int socket) {
+    metrics_client_t* m = metrics_client_get(socket);
+    if (m != NULL)
+        m->vslave_hits++;
+}
+
+void metrics_tcp_devid_hit(int socket) {
+    metrics_client_t* m = metrics_client_get(socket);
+    if (m != NULL)
+        m->devid_hits++;
+}
+
+void metrics_tcp_response(const rtu_session_t* session_header) {
+    metrics_client_t* m = metrics_client_get(session_header->socket);
+    if (m != NULL) {
+        m->responses++;
+        metrics_histogram_add(&m->latency, session_header->start_us);
+    }
+}
+
+void metrics_tcp_failed(const rtu_session_t* session_header) {
+    metrics_client_t* m = metrics_client_get(session_header->socket);
+    if (m != NULL)
+        m->failures++;
+}
+
+void metrics_get_totals(metrics_totals_t* totals) {
+    memset(totals, 0, sizeof(metrics_totals_t));
+    for (size_t i = 0; i <= METRICS_UID_SLOTS; i++) {
+        const metrics_uid_t* m = &metrics.uids[i];
+        totals->rtu_requests += m->requests;
+        totals->rtu_retries += m->retries;
+        totals->rtu_responses += m->responses;
+        totals->rtu_timeouts += m->timeouts;
+        totals->rtu_crc_errors += m->crc_errors;
+        totals->rtu_exceptions += m->exceptions;
+    }
+    totals->rtu_broadcasts = metrics.broadcasts;
+    totals->rtu_rx_overflows = metrics.rx_overflow_buf + metrics.rx_overflow_fifo;
+    for (size_t i = 0; i < METRICS_CLIENT_SLOTS; i++) {
+        if (metrics.clients[i].socket >= 0)
+            totals->tcp_clients++;
+    }
+}
+
+//////////////////////
+/// Output
+//////////////////////
+typedef struct metrics_out {
+    metrics_sink_t sink;
+    void* ctx;
+    esp_err_t err;
+    size_t len;
+    char buf[256];
+} metrics_out_t;
+
+static void mo_flush(metrics_out_t* mo) {
+    if (mo->err == ESP_OK && mo->len > 0)
+        mo->err = mo->sink(mo->ctx, mo->buf, mo->len);
+    mo->len = 0;
+}
+
+static void mo_printf(metrics_out_t* mo, const char* fmt, ...) {
+    va_list args;
+    int len;
+
+    if (mo->err != ESP_OK)
+        return;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t room = sizeof(mo->buf) - mo->len;
+        va_start(args, fmt);
+        len = vsnprintf(mo->buf + mo->len, room, fmt, args);
+        va_end(args);
+
+        if (len < 0)
+            return;
+        if ((size_t)len < room) {
+            mo->len += len;
+            return;
+        }
+        // Does not fit, flush and try again with an empty buffer, a line longer than the buffer is dropped
+        mo_flush(mo);
+    }
+}
+
+// labels is one or more label pairs, e.g. uid="1"
+static void mo_histogram(metrics_out_t* mo, const char* name, const char* labels, const metrics_histogram_t* hist) {
+    uint32_t count = 0;
+    for (size_t i = 0; i < METRICS_LATENCY_BUCKETS - 1; i++) {
+        count += hist->buckets[i];
+        mo_printf(mo, "%s_bucket{%s,le=\"%u\"} %u\n", name, labels, latency_bounds_ms[i], count);
+    }
+    count += hist->buckets[METRICS_LATENCY_BUCKETS - 1];
+    mo_printf(mo, "%s_bucket{%s,le=\"+Inf\"} %u\n", name, labels, count);
+    mo_printf(mo, "%s_sum{%s} %u\n", name, labels, hist->sum_ms);
+    mo_printf(mo, "%s_count{%s} %u\n", name, labels, count);
+}
+
+// Number of UID slots to output, including the one for the other UIDs once all slots are taken
+static size_t mo_uid_slot_count() {
+    uint8_t used = metrics.uid_slots_used;
+    return used < METRICS_UID_SLOTS ? used : METRICS_UID_SLOTS + 1;
+}
+
+static const char* mo_uid_label(size_t slot, char uid_str[6]) {
+    if (slot >= METRICS_UID_SLOTS)
+        return "other";
+    snprintf(uid_str, 6, "%u", metrics.uid_of_slot[slot]);
+    return uid_str;
+}
+
+// One counter of all UID slots, offset is the position of the counter in metrics_uid_t
+static void mo_uid_counter(metrics_out_t* mo, const char* name, const char* help, size_t offset) {
+    char uid_str[6];
+    size_t count = mo_uid_slot_count();
+
+    mo_printf(mo, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (size_t i = 0; i < count; i++) {
+        mo_printf(mo, "%s{uid=\"%s\"} %u\n", name, mo_uid_label(i, uid_str),
+                  *(const uint32_t*)((const uint8_t*)&metrics.uids[i] + offset));
+    }
+}
+
+// Several connections may come from the same address (or a TCP and a tunnel client from the same host),
+// the socket keeps their series apart
+#define MO_CLIENT_LABELS_MAXLEN (METRICS_CLIENT_ADDR_MAXLEN + 32)
+
+static const char* mo_client_labels(const metrics_client_t* m, char labels[MO_CLIENT_LABELS_MAXLEN]) {
+    snprintf(labels, MO_CLIENT_LABELS_MAXLEN, "client=\"%s\",socket=\"%d\"", m->addr, m->socket);
+    return labels;
+}
+
+static void mo_client_counter(metrics_out_t* mo, const char* name, const char* help, size_t offset) {
+    char labels[MO_CLIENT_LABELS_MAXLEN];
+
+    mo_printf(mo, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (size_t i = 0; i < METRICS_CLIENT_SLOTS; i++) {
+        const metrics_client_t* m = &metrics.clients[i];
+        if (m->socket >= 0)
+            mo_printf(mo, "%s{%s} %u\n", name, mo_client_labels(m, labels), *(const uint32_t*)((const uint8_t*)m + offset));
+    }
+}
+
+esp_err_t metrics_write_prometheus(metrics_sink_t sink, void* ctx) {
+    metrics_out_t mo = {.sink = sink, .ctx = ctx, .err = ESP_OK, .len = 0};
+    char uid_str[6];
+    char labels[MO_CLIENT_LABELS_MAXLEN];
+    modbus_poller_stats_t poll_stats;
+
+    // RTU bus, per slave
+    mo_uid_counter(&mo, "modbus_rtu_requests_total", "Requests sent on the bus, including retries",
+                   offsetof(metrics_uid_t, requests));
+    mo_uid_counter(&mo, "modbus_rtu_retries_total", "Requests resent after a timeout or a bad response",
+                   offsetof(metrics_uid_t, retries));
+    mo_uid_counter(&mo, "modbus_rtu_responses_total", "Valid responses received",
+                   offsetof(metrics_uid_t, responses));
+    mo_uid_counter(&mo, "modbus_rtu_timeouts_total", "Requests without a response",
+                   offsetof(metrics_uid_t, timeouts));
+    mo_uid_counter(&mo, "modbus_rtu_crc_errors_total", "Responses with a bad CRC or length, or that do not match the request",
+                   offsetof(metrics_uid_t, crc_errors));
+    mo_uid_counter(&mo, "modbus_rtu_exceptions_total", "Responses with an exception code",
+                   offsetof(metrics_uid_t, exceptions));
+
+    mo_printf(&mo, "# HELP modbus_rtu_latency_ms Bus round trip time\n# TYPE modbus_rtu_latency_ms histogram\n");
+    size_t uid_count = mo_uid_slot_count();
+    for (size_t i = 0; i < uid_count; i++) {
+        snprintf(labels, sizeof(labels), "uid=\"%s\"", mo_uid_label(i, uid_str));
+        mo_histogram(&mo, "modbus_rtu_latency_ms", labels, &metrics.uids[i].latency);
+    }
+
+    // RTU bus, totals
+    mo_printf(&mo, "# HELP modbus_rtu_broadcasts_total Broadcast requests sent\n# TYPE modbus_rtu_broadcasts_total counter\n"
+                   "modbus_rtu_broadcasts_total %u\n", metrics.broadcasts);
+    mo_printf(&mo, "# HELP modbus_rtu_rx_overflows_total Responses lost to a receive overflow\n# TYPE modbus_rtu_rx_overflows_total counter\n"
+                   "modbus_rtu_rx_overflows_total{kind=\"buf\"} %u\n"
+                   "modbus_rtu_rx_overflows_total{kind=\"fifo\"} %u\n", metrics.rx_overflow_buf, metrics.rx_overflow_fifo);
+
+    // Poller
+    modbus_poller_get_stats(&poll_stats);
+    mo_printf(&mo, "# HELP modbus_poll_bus_load_ratio Estimated share of the bus time used by the poller\n# TYPE modbus_poll_bus_load_ratio gauge\n"
+                   "modbus_poll_bus_load_ratio %u.%03u\n", poll_stats.bus_load_permille / 1000, poll_stats.bus_load_permille % 1000);
+    mo_printf(&mo, "# HELP modbus_poll_deadline_miss_total Polls sent after their deadline\n# TYPE modbus_poll_deadline_miss_total counter\n"
+                   "modbus_poll_deadline_miss_total %u\n", poll_stats.deadline_miss);
+
+    // TCP clients
+    mo_client_counter(&mo, "modbus_tcp_requests_total", "Requests received from the client",
+                      offsetof(metrics_client_t, requests));
+    mo_client_counter(&mo, "modbus_tcp_image_hits_total", "Requests answered from the register image",
+                      offsetof(metrics_client_t, image_hits));
+    mo_client_counter(&mo, "modbus_tcp_vslave_hits_total", "Requests answered by the virtual slave",
+                      offsetof(metrics_client_t, vslave_hits));
+    mo_client_counter(&mo, "modbus_tcp_devid_hits_total", "Requests answered from the device identification cache",
+                      offsetof(metrics_client_t, devid_hits));
+    mo_client_counter(&mo, "modbus_tcp_responses_total", "Responses relayed from the bus",
+                      offsetof(metrics_client_t, responses));
+    mo_client_counter(&mo, "modbus_tcp_failures_total", "Requests given up without a response",
+                      offsetof(metrics_client_t, failures));
+
+    mo_printf(&mo, "# HELP modbus_tcp_latency_ms Time from receiving a request to relaying its response\n# TYPE modbus_tcp_latency_ms histogram\n");
+    for (size_t i = 0; i < METRICS_CLIENT_SLOTS; i++) {
+        const metrics_client_t* m = &metrics.clients[i];
+        if (m->socket >= 0)
+            mo_histogram(&mo, "modbus_tcp_latency_ms", mo_client_labels(m, labels), &m->latency);
+    }
+
+    mo_flush(&mo);
+    return mo.err;
+}
@@ -0,0 +1,75 @@
+/*
+ * modbus_metrics.h
+ *
+ * Traffic counters and latency histograms of the RTU bus (per slave UID) and
+ * the TCP side (per client connection), exported in the Prometheus text format.
+ *
+ * No locks are taken: every counter has a single writer task (the RTU task or
+ * the TCP server task owning the connection), readers may see a slightly
+ * inconsistent snapshot but never a torn 32-bit value.
+ */
+
+#ifndef MAIN_MODBUS_METRICS_H_
+#define MAIN_MODBUS_METRICS_H_
+
+#include <stdint.h>
+#include <strings.h>
+#include "esp_err.h"
+
+#include "modbus.h"
+
+// Slaves beyond this are accounted together under uid="other"
+#define METRICS_UID_SLOTS       16
+// IPv4 and IPv6 servers together
+#define METRICS_CLIENT_SLOTS    10
+#define METRICS_CLIENT_ADDR_MAXLEN  40
+// Upper bounds of the latency histogram buckets in ms, a +Inf bucket follows
+#define METRICS_LATENCY_BOUNDS_MS   {5, 10, 20, 50, 100, 200, 500, 1000, 2000}
+#define METRICS_LATENCY_BUCKETS     10
+
+// Current time for the latency measurements, wraps around every ~71 minutes
+uint32_t metrics_now_us();
+
+// RTU task
+void metrics_rtu_request(uint8_t uid, uint8_t retry);
+void metrics_rtu_broadcast();
+void metrics_rtu_response(uint8_t uid, uint32_t start_us);
+void metrics_rtu_timeout(uint8_t uid);
+// A valid response carrying an exception code, also counted as a response
+void metrics_rtu_exception(uint8_t uid);
+// Bad CRC, too short or from another UID
+void metrics_rtu_crc_error(uint8_t uid);
+void metrics_rtu_rx_overflow(uint8_t buf, uint8_t fifo);
+
+// TCP server tasks
+void metrics_tcp_client_open(int socket, const char* addr);
+void metrics_tcp_client_close(int socket);
+void metrics_tcp_request(int socket);
+void metrics_tcp_image_hit(int socket);
+void metrics_tcp_vslave_hit(int socket);
+void metrics_tcp_devid_hit(int socket);
+// RTU task, end-to-end latency from the arrival of the request (session_header->start_us)
+void metrics_tcp_response(const rtu_session_t* session_header);
+void metrics_tcp_failed(const rtu_session_t* session_header);
+
+// Sums over all slaves, for the gateway's own status registers
+typedef struct metrics_totals {
+    uint32_t rtu_requests;
+    uint32_t rtu_retries;
+    uint32_t rtu_responses;
+    uint32_t rtu_timeouts;
+    uint32_t rtu_crc_errors;
+    uint32_t rtu_exceptions;
+    uint32_t rtu_broadcasts;
+    uint32_t rtu_rx_overflows;
+    uint32_t tcp_clients;       // Currently connected
+} metrics_totals_t;
+
+void metrics_get_totals(metrics_totals_t* totals);
+
+// Same signature as json_writer_sink_t
+typedef esp_err_t (*metrics_sink_t)(void* ctx, const char* buf, size_t len);
+// Write all metrics in the Prometheus text exposition format
+esp_err_t metrics_write_prometheus(metrics_sink_t sink, void* ctx);
+
+#endif /* MAIN_MODBUS_METRICS_H_ */
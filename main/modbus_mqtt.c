@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "mqtt_client.h"
+
+#include "json_writer.h"
+#include "modbus_mqtt.h"
+#include "modbus_poller.h"
+#include "modbus_tags.h"
+
+// Task notification bits, the lower ones are the poll block indexes
+#define MQTT_NOTIFY_CONFIG      (1u << 31)
+#define MQTT_NOTIFY_CONNECTED   (1u << 30)
+#define MQTT_NOTIFY_BLOCKS      ((1u << MODBUS_POLL_BLOCK_MAX) - 1)
+_Static_assert(MODBUS_POLL_BLOCK_MAX <= 30, "Poll block indexes must fit in the notification bits");
+
+// "<topic>/<uid>/<fc>/<addr>"
+#define MQTT_FULL_TOPIC_MAXLEN  (MODBUS_MQTT_TOPIC_MAXLEN + sizeof("/255/4/65535"))
+
+// Back-off before a block that failed to publish is tried again
+#define MQTT_RETRY_MS           1000
+
+// The last published state of a block, owned by the MQTT task
+typedef struct mqtt_block {
+    uint8_t* data;              // NULL if never published
+    TickType_t publish_tick;
+    int retry;                  // The last publish has failed
+} mqtt_block_t;
+
+typedef struct mqtt_msg {
+    size_t len;
+    size_t maxlen;
+    char* data;
+} mqtt_msg_t;
+
+static struct modbus_mqtt {
+    TaskHandle_t task;
+    SemaphoreHandle_t mux;      // Protects the cfg_ fields
+    char cfg_uri[MODBUS_MQTT_URI_MAXLEN];
+    char cfg_topic[MODBUS_MQTT_TOPIC_MAXLEN];
+    uint32_t cfg_integrity_ms;
+
+    // MQTT task only, copied from the cfg_ fields when the client is restarted
+    esp_mqtt_client_handle_t client;
+    char topic[MODBUS_MQTT_TOPIC_MAXLEN];
+    char status_topic[MQTT_FULL_TOPIC_MAXLEN];
+    uint32_t integrity_ms;
+    uint16_t generation;
+    mqtt_block_t blocks[MODBUS_POLL_BLOCK_MAX];
+    volatile int connected;     // Set by the event handler
+} mqtt = {0};
+
+static const char *TAG = "Modbus_MQTT";
+
+esp_err_t modbus_mqtt_check_uri(const char* uri) {
+    if (uri == NULL || uri[0] == '\0')
+        return ESP_OK;
+    if (strlen(uri) >= MODBUS_MQTT_URI_MAXLEN || strncmp(uri, "mqtt://", 7) != 0 || uri[7] == '\0')
+        return ESP_ERR_INVALID_ARG;
+    return ESP_OK;
+}
+
+esp_err_t modbus_mqtt_check_topic(const char* topic) {
+    size_t len = topic == NULL ? 0 : strlen(topic);
+    if (len == 0 || len >= MODBUS_MQTT_TOPIC_MAXLEN || topic[len - 1] == '/' || strpbrk(topic, "+#") != NULL)
+        return ESP_ERR_INVALID_ARG;
+    return ESP_OK;
+}
+
+void modbus_mqtt_set_config(const char* uri, const char* topic, uint32_t integrity_s) {
+    xSemaphoreTake(mqtt.mux, portMAX_DELAY);
+    strncpy(mqtt.cfg_uri, uri, sizeof(mqtt.cfg_uri) - 1);
+    strncpy(mqtt.cfg_topic, topic, sizeof(mqtt.cfg_topic) - 1);
+    mqtt.cfg_integrity_ms = integrity_s * 1000;
+    xSemaphoreGive(mqtt.mux);
+
+    xTaskNotify(mqtt.task, MQTT_NOTIFY_CONFIG, eSetBits);
+}
+
+static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event) {
+    switch (event->event_id) {
+    case MQTT_EVENT_CONNECTED:
+        ESP_LOGI(TAG, "Connected");
+        mqtt.connected = 1;
+        esp_mqtt_client_publish(event->client, mqtt.status_topic, "online", 0, 0, 1);
+        // Publish everything, the broker may have lost the retained messages
+        xTaskNotify(mqtt.task, MQTT_NOTIFY_CONNECTED, eSetBits);
+        break;
+    case MQTT_EVENT_DISCONNECTED:
+        ESP_LOGI(TAG, "Disconnected");
+        mqtt.connected = 0;
+        break;
+    default:
+        break;
+    }
+    return ESP_OK;
+}
+
+static void mqtt_forget_blocks() {
+    for (size_t i = 0; i < MODBUS_POLL_BLOCK_MAX; i++) {
+        free(mqtt.blocks[i].data);
+        mqtt.blocks[i].data = NULL;
+        mqtt.blocks[i].retry = 0;
+    }
+}
+
+static void mqtt_restart_client() {
+    esp_mqtt_client_config_t cfg;
+
+    if (mqtt.client != NULL) {
+        esp_mqtt_client_destroy(mqtt.client);
+        mqtt.client = NULL;
+        mqtt.connected = 0;
+    }
+    mqtt_forget_blocks();
+
+    // The client keeps its own copies of the strings
+    xSemaphoreTake(mqtt.mux, portMAX_DELAY);
+    strcpy(mqtt.topic, mqtt.cfg_topic);
+    mqtt.integrity_ms = mqtt.cfg_integrity_ms;
+    if (mqtt.cfg_uri[0] != '\0') {
+        snprintf(mqtt.status_topic, sizeof(mqtt.status_topic), "%s/status", mqtt.topic);
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.uri = mqtt.cfg_uri;
+        cfg.event_handle = mqtt_event_handler;
+        cfg.lwt_topic = mqtt.status_topic;
+        cfg.lwt_msg = "offline";
+        cfg.lwt_retain = 1;
+        mqtt.client = esp_mqtt_client_init(&cfg);
+    }
+    xSemaphoreGive(mqtt.mux);
+
+    if (mqtt.client != NULL && esp_mqtt_client_start(mqtt.client) != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to start the client");
+        esp_mqtt_client_destroy(mqtt.client);
+        mqtt.client = NULL;
+    }
+}
+
+static esp_err_t mqtt_msg_sink(void* ctx, const char* buf, size_t len) {
+    mqtt_msg_t* msg = (mqtt_msg_t*)ctx;
+    if (msg->len + len > msg->maxlen)
+        return ESP_ERR_NO_MEM;
+    memcpy(msg->data + msg->len, buf, len);
+    msg->len += len;
+    return ESP_OK;
+}
+
+static esp_err_t mqtt_publish_block(const modbus_poll_block_info_t* info, const uint8_t* data) {
+    // Only used by the MQTT task
+    static modbus_tag_value_t tag_values[MODBUS_TAG_MAX];
+    char topic[MQTT_FULL_TOPIC_MAXLEN];
+    json_writer_t jw;
+    mqtt_msg_t msg;
+    esp_err_t err;
+
+    size_t tag_count = modbus_tags_decode_block(info, data, tag_values, MODBUS_TAG_MAX);
+
+    // "65535," for each register, "0," for each bit, the quoted name and up to 24 characters for each tag
+    msg.maxlen = 64 + info->count * (info->func_code <= 2 ? 2 : 6) + tag_count * (MODBUS_TAG_NAME_MAXLEN + 28);
+    msg.len = 0;
+    msg.data = malloc(msg.maxlen);
+    if (msg.data == NULL)
+        return ESP_ERR_NO_MEM;
+
+    jw_init(&jw, mqtt_msg_sink, &msg);
+    jw_object_begin(&jw, NULL);
+    jw_uint(&jw, "uid", info->uid);
+    jw_uint(&jw, "fc", info->func_code);
+    jw_uint(&jw, "addr", info->addr);
+    jw_bool(&jw, "stale", info->stale);
+    jw_array_begin(&jw, "values");
+    for (size_t i = 0; i < info->count; i++) {
+        if (info->func_code <= 2) {
+            jw_uint(&jw, NULL, (data[i / 8] >> (i % 8)) & 1);
+        } else {
+            jw_uint(&jw, NULL, (data[i * 2] << 8) | data[i * 2 + 1]);
+        }
+    }
+    jw_array_end(&jw);
+    if (tag_count > 0) {
+        jw_object_begin(&jw, "tags");
+        for (size_t i = 0; i < tag_count; i++)
+            jw_number_prec(&jw, tag_values[i].name, tag_values[i].value, tag_values[i].digits);
+        jw_object_end(&jw);
+    }
+    jw_object_end(&jw);
+    err = jw_finish(&jw);
+
+    if (err == ESP_OK) {
+        snprintf(topic, sizeof(topic), "%s/%d/%d/%d", mqtt.topic, info->uid, info->func_code, info->addr);
+        if (esp_mqtt_client_publish(mqtt.client, topic, msg.data, msg.len, 0, 1) < 0)
+            err = ESP_FAIL;
+    }
+    free(msg.data);
+    return err;
+}
+
+// Publish the blocks that have changed (bit n of updated set) or are due for an integrity publish,
+// returns the ticks until the next integrity publish or retry is due
+static TickType_t mqtt_scan(uint32_t updated) {
+    static uint8_t data[MODBUS_POLL_DATA_MAXLEN];
+    modbus_poll_block_info_t info;
+    TickType_t integrity = mqtt.integrity_ms / portTICK_RATE_MS;
+    TickType_t wait = portMAX_DELAY;
+
+    for (size_t i = 0; i < MODBUS_POLL_BLOCK_MAX; i++) {
+        if (modbus_poller_get_block(i, &info, data) != ESP_OK)
+            break;
+
+        if (info.generation != mqtt.generation) {
+            // The poll list has changed, start over
+            mqtt_forget_blocks();
+            mqtt.generation = info.generation;
+            updated = MQTT_NOTIFY_BLOCKS;
+        }
+
+        mqtt_block_t* block = &mqtt.blocks[i];
+        TickType_t now = xTaskGetTickCount();
+        int due = block->data != NULL && integrity > 0 && now - block->publish_tick >= integrity;
+        if (!info.valid || (!due && !block->retry && !(updated & (1 << i))))
+            goto next_block;
+        if (!due && !block->retry && block->data != NULL && !modbus_tags_block_changed(&info, block->data, data))
+            goto next_block;
+
+        // The last published state is only updated once the broker has it,
+        // the deadband keeps comparing against what the subscribers have seen
+        block->retry = 1;
+        if (mqtt_publish_block(&info, data) != ESP_OK)
+            goto next_block;
+        if (block->data == NULL)
+            block->data = malloc(info.data_len);
+        if (block->data == NULL)
+            goto next_block;
+        memcpy(block->data, data, info.data_len);
+        block->publish_tick = now;
+        block->retry = 0;
+
+next_block:
+        if (block->retry) {
+            if (MQTT_RETRY_MS / portTICK_RATE_MS < wait)
+                wait = MQTT_RETRY_MS / portTICK_RATE_MS;
+        } else if (block->data != NULL && integrity > 0) {
+            TickType_t left = integrity - (xTaskGetTickCount() - block->publish_tick);
+            if ((int32_t)left < 0)
+                left = 0;
+            if (left < wait)
+                wait = left;
+        }
+    }
+
+    return wait;
+}
+
+static void modbus_mqtt_task(void* param) {
+    uint32_t notified = 0;
+    TickType_t wait = portMAX_DELAY;
+
+    while (1) {
+        xTaskNotifyWait(0, UINT32_MAX, &notified, wait);
+        wait = portMAX_DELAY;
+
+        if (notified & MQTT_NOTIFY_CONFIG)
+            mqtt_restart_client();
+        if (notified & MQTT_NOTIFY_CONNECTED) {
+            mqtt_forget_blocks();
+            notified |= MQTT_NOTIFY_BLOCKS;
+        }
+
+        // The updates while disconnected are picked up by MQTT_NOTIFY_CONNECTED
+        if (mqtt.client != NULL && mqtt.connected)
+            wait = mqtt_scan(notified & MQTT_NOTIFY_BLOCKS);
+        notified = 0;
+    }
+}
+
+void modbus_mqtt_init() {
+    mqtt.mux = xSemaphoreCreateMutex();
+    xTaskCreate(modbus_mqtt_task, "modbus_mqtt", 3072, NULL, 4, &mqtt.task);
+    modbus_poller_set_update_task(mqtt.task);
+}
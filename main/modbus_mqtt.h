@@ -0,0 +1,35 @@
+/*
+ * modbus_mqtt.h
+ *
+ * Report-by-exception of the register image over MQTT. Each block of the poll list is published
+ * to "<topic>/<uid>/<fc>/<addr>" as {"uid":1,"fc":3,"addr":0,"stale":false,"values":[...]},
+ * retained, with QoS 0. The tags of the block (see modbus_tags.h) are added as "tags":{"name":value}.
+ * A block is published when a tag has moved by more than its deadband since the last publish, or
+ * on any change of a coil, an input or a register that is not part of a tag (see
+ * modbus_tags_block_changed()), and again every integrity period even if nothing has changed. "<topic>/status" is "online", or "offline" as the last will.
+ */
+
+#ifndef MAIN_MODBUS_MQTT_H_
+#define MAIN_MODBUS_MQTT_H_
+
+#include <stdint.h>
+#include <strings.h>
+#include "esp_err.h"
+
+// Including the null terminator
+#define MODBUS_MQTT_URI_MAXLEN          128
+#define MODBUS_MQTT_TOPIC_MAXLEN        64
+#define MODBUS_MQTT_TOPIC_DEFAULT       "modbus"
+// 0 disables the integrity publishes
+#define MODBUS_MQTT_INTEGRITY_S_DEFAULT 300
+#define MODBUS_MQTT_INTEGRITY_S_MAX     86400
+
+void modbus_mqtt_init();
+// An empty uri disables MQTT, otherwise it is "mqtt://[user:pass@]host[:port]"
+esp_err_t modbus_mqtt_check_uri(const char* uri);
+// No wildcards, no trailing '/'
+esp_err_t modbus_mqtt_check_topic(const char* topic);
+// Reconnect with the new settings
+void modbus_mqtt_set_config(const char* uri, const char* topic, uint32_t integrity_s);
+
+#endif /* MAIN_MODBUS_MQTT_H_ */
@@ -0,0 +1,470 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "modbus_metrics.h"
+#include "modbus_poller.h"
+
+typedef struct modbus_poll_block {
+    // Configuration
+    uint8_t uid;
+    uint8_t func_code;
+    uint16_t addr;
+    uint16_t count;
+    uint32_t period_ms;
+
+    // States, protected by poller.mux
+    uint8_t valid;              // data holds a response
+    TickType_t next_tick;       // Release time of the next poll, its deadline is one period later
+    TickType_t update_tick;     // When data was last updated
+    uint8_t data_len;           // Number of data bytes in a response
+    uint8_t* data;              // Data bytes of the last response, as they are on the wire
+} modbus_poll_block_t;
+
+static struct modbus_poller {
+    SemaphoreHandle_t mux;
+    TaskHandle_t task;
+    TaskHandle_t update_task;   // Notified with bit n set after block n is updated
+    // Incremented every time the list changes, responses to requests of an old list are dropped
+    uint16_t generation;
+    // Index of the block being polled, only one poll is outstanding so that tx_fifo does not reorder them
+    int inflight;
+    TickType_t inflight_tick;
+    uint32_t deadline_miss;     // Number of polls sent after their deadline
+    uint8_t stale_periods;
+    size_t count;
+    modbus_poll_block_t blocks[MODBUS_POLL_BLOCK_MAX];
+} poller = {0};
+
+static const char *TAG = "Modbus_Poller";
+
+static inline uint8_t poll_data_len(uint8_t func_code, uint16_t count) {
+    return (func_code <= 2) ? (count + 7) / 8 : count * 2;
+}
+
+// The data of a block is stale after this many ticks without a response, must be protected by poller.mux.
+// The period is converted to ticks first, stale_periods * period_ms overflows 32 bits.
+static inline TickType_t poll_stale_ticks(const modbus_poll_block_t* block) {
+    return poller.stale_periods * (block->period_ms / portTICK_RATE_MS);
+}
+
+// Estimated bus time of polling a block, the request is always 8 bytes,
+// the response has 5 bytes (uid, fc, byte count, CRC16) plus the data.
+static inline uint32_t poll_bus_time_us(const modbus_poll_block_t* block) {
+    return modbus_uart_transaction_us(8, 5 + block->data_len);
+}
+
+// Sum of bus time / period over all blocks, in permille, must be protected by poller.mux
+static uint32_t poll_bus_load_permille() {
+    uint32_t load = 0;
+    for (size_t i = 0; i < poller.count; i++) {
+        load += poll_bus_time_us(&poller.blocks[i]) / poller.blocks[i].period_ms;
+    }
+    return load;
+}
+
+// Parse the next unsigned number, followed by the given separator (or '\0' if sep is ';')
+static int poll_parse_num(const char** str, char sep, uint32_t* out) {
+    char* end;
+    *out = strtoul(*str, &end, 10);
+    if (end == *str)
+        return 0;
+
+    if (*end == sep) {
+        end++;
+    } else if (!(sep == ';' && *end == '\0')) {
+        return 0;
+    }
+
+    *str = end;
+    return 1;
+}
+
+static esp_err_t poll_parse_list(const char* list, modbus_poll_block_t* blocks, size_t* count) {
+    uint32_t uid, func_code, addr, num, period;
+
+    *count = 0;
+    if (list == NULL)
+        return ESP_OK;
+
+    if (strlen(list) >= MODBUS_POLL_LIST_MAXLEN)
+        return ESP_ERR_INVALID_ARG;
+
+    while (*list != '\0') {
+        if (*count >= MODBUS_POLL_BLOCK_MAX)
+            return ESP_ERR_INVALID_ARG;
+
+        if (!poll_parse_num(&list, ',', &uid) ||
+            !poll_parse_num(&list, ',', &func_code) ||
+            !poll_parse_num(&list, ',', &addr) ||
+            !poll_parse_num(&list, ',', &num) ||
+            !poll_parse_num(&list, ';', &period)) {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        if (uid == MODBUS_UID_BROADCAST || uid > 247 ||
+            func_code < 1 || func_code > 4 ||
+            num < 1 || num > (func_code <= 2 ? 2000 : 125) ||
+            addr + num > 0x10000 ||
+            period < MODBUS_POLL_PERIOD_MS_MIN || period > MODBUS_POLL_PERIOD_MS_MAX) {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        modbus_poll_block_t* block = &blocks[(*count)++];
+        memset(block, 0, sizeof(modbus_poll_block_t));
+        block->uid = uid;
+        block->func_code = func_code;
+        block->addr = addr;
+        block->count = num;
+        block->period_ms = period;
+        block->data_len = poll_data_len(func_code, num);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t modbus_poller_check_list(const char* list) {
+    modbus_poll_block_t* blocks = malloc(sizeof(modbus_poll_block_t) * MODBUS_POLL_BLOCK_MAX);
+    size_t count;
+    esp_err_t err;
+
+    if (blocks == NULL)
+        return ESP_ERR_NO_MEM;
+
+    err = poll_parse_list(list, blocks, &count);
+    free(blocks);
+    return err;
+}
+
+esp_err_t modbus_poller_set_list(const char* list) {
+    modbus_poll_block_t* blocks = malloc(sizeof(modbus_poll_block_t) * MODBUS_POLL_BLOCK_MAX);
+    size_t count;
+    esp_err_t err;
+
+    if (blocks == NULL)
+        return ESP_ERR_NO_MEM;
+
+    err = poll_parse_list(list, blocks, &count);
+    if (err != ESP_OK)
+        goto func_ret;
+
+    for (size_t i = 0; i < count; i++) {
+        blocks[i].data = malloc(blocks[i].data_len);
+        if (blocks[i].data == NULL) {
+            while (i-- > 0)
+                free(blocks[i].data);
+            err = ESP_ERR_NO_MEM;
+            goto func_ret;
+        }
+    }
+
+    xSemaphoreTake(poller.mux, portMAX_DELAY);
+    for (size_t i = 0; i < poller.count; i++) {
+        free(poller.blocks[i].data);
+    }
+    TickType_t now = xTaskGetTickCount();
+    for (size_t i = 0; i < count; i++) {
+        blocks[i].next_tick = now;
+    }
+    memcpy(poller.blocks, blocks, sizeof(modbus_poll_block_t) * count);
+    poller.count = count;
+    poller.generation++;
+    poller.inflight = -1;
+    uint32_t load = poll_bus_load_permille();
+    xSemaphoreGive(poller.mux);
+
+    ESP_LOGI(TAG, "%d block(s) to poll, estimated bus load %d.%d%%", count, load / 10, load % 10);
+    if (load > 1000) {
+        ESP_LOGW(TAG, "The poll list exceeds the bus capacity, polls will miss their deadlines");
+    }
+    xTaskNotifyGive(poller.task);
+
+func_ret:
+    free(blocks);
+    return err;
+}
+
+// Earliest deadline first: among the released blocks, poll the one whose deadline comes first.
+static void modbus_poller_task(void* param) {
+    // Session header + uid, fc, addr, count
+    uint8_t req[sizeof(rtu_session_t) + 6];
+
+    while (1) {
+        TickType_t wait = portMAX_DELAY;
+        modbus_poll_block_t* next = NULL;
+        int next_idx = -1;
+
+        // Give up waiting for the outstanding poll after the worst case of the RTU engine (it may be queued
+        // behind a full tx_fifo of retried requests), should never happen as the engine always reports back
+        TickType_t inflight_max = modbus_uart_result_timeout_ms() / portTICK_RATE_MS;
+
+        xSemaphoreTake(poller.mux, portMAX_DELAY);
+        TickType_t now = xTaskGetTickCount();
+
+        if (poller.inflight >= 0 && now - poller.inflight_tick > inflight_max) {
+            ESP_LOGW(TAG, "No result for block %d", poller.inflight);
+            poller.inflight = -1;
+        }
+
+        if (poller.inflight < 0) {
+            for (size_t i = 0; i < poller.count; i++) {
+                modbus_poll_block_t* block = &poller.blocks[i];
+
+                if ((int32_t)(now - block->next_tick) < 0) {
+                    // Not released yet
+                    if (block->next_tick - now < wait)
+                        wait = block->next_tick - now;
+                } else if (next == NULL ||
+                        (int32_t)((block->next_tick + block->period_ms / portTICK_RATE_MS) -
+                                  (next->next_tick + next->period_ms / portTICK_RATE_MS)) < 0) {
+                    next = block;
+                    next_idx = i;
+                }
+            }
+        } else {
+            // Woken up by the result of the outstanding poll
+            wait = inflight_max - (now - poller.inflight_tick) + 1;
+        }
+
+        if (next != NULL) {
+            TickType_t period = next->period_ms / portTICK_RATE_MS;
+            rtu_session_t* session_header = (rtu_session_t*) req;
+            uint8_t* pdu = req + sizeof(rtu_session_t);
+            session_header->socket = -1;
+            session_header->transaction_id = next_idx;
+            session_header->protocol_id = poller.generation;
+            session_header->uid = next->uid;
+            session_header->retry = 0;
+            session_header->origin = RTU_ORIGIN_POLLER;
+            session_header->start_us = metrics_now_us();
+            pdu[0] = next->uid;
+            pdu[1] = next->func_code;
+            pdu[2] = next->addr >> 8;
+            pdu[3] = next->addr & 0xFF;
+            pdu[4] = next->count >> 8;
+            pdu[5] = next->count & 0xFF;
+
+            poller.inflight = next_idx;
+            poller.inflight_tick = now;
+
+            next->next_tick += period;
+            if ((int32_t)(now - next->next_tick) >= 0) {
+                // Missed the deadline, skip the missed releases instead of trying to catch up
+                poller.deadline_miss++;
+                next->next_tick = now + period;
+            }
+        }
+        xSemaphoreGive(poller.mux);
+
+        if (next != NULL) {
+            // Might block if tx_fifo is full
+            modbus_uart_queue_send(req, sizeof(req));
+        }
+
+        // Woken up by a list change or the result of the outstanding poll
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+void modbus_poller_init(const char* list) {
+    poller.mux = xSemaphoreCreateMutex();
+    poller.inflight = -1;
+    poller.stale_periods = MODBUS_POLL_STALE_PERIODS_DEFAULT;
+    xTaskCreate(modbus_poller_task, "modbus_poller", 2048, NULL, 5, &poller.task);
+
+    if (modbus_poller_set_list(list) != ESP_OK) {
+        ESP_LOGW(TAG, "Invalid poll list: %s", list);
+    }
+}
+
+void modbus_poller_set_stale_periods(uint8_t periods) {
+    xSemaphoreTake(poller.mux, portMAX_DELAY);
+    poller.stale_periods = periods;
+    xSemaphoreGive(poller.mux);
+}
+
+static modbus_poll_block_t* poller_block_from_session(const rtu_session_t* session_header) {
+    if (session_header->protocol_id != poller.generation || session_header->transaction_id >= poller.count)
+        return NULL;
+
+    return &poller.blocks[session_header->transaction_id];
+}
+
+void modbus_poller_on_response(const rtu_session_t* session_header, const uint8_t* payload, size_t len) {
+    const uint8_t* pdu = payload + MODBUS_TCP_PAYLOAD_OFFSET;
+
+    xSemaphoreTake(poller.mux, portMAX_DELAY);
+    modbus_poll_block_t* block = poller_block_from_session(session_header);
+    if (block != NULL) {
+        // A late result of an abandoned poll must not release the outstanding one
+        if (session_header->transaction_id == poller.inflight)
+            poller.inflight = -1;
+
+        // uid, fc, byte count, data
+        if (pdu[1] == block->func_code && pdu[2] == block->data_len &&
+            len == MODBUS_TCP_PAYLOAD_OFFSET + 3 + block->data_len) {
+            memcpy(block->data, pdu + 3, block->data_len);
+            block->update_tick = xTaskGetTickCount();
+            block->valid = 1;
+        } else {
+            ESP_LOGW(TAG, "Unexpected response from %d, FC%02X", pdu[0], pdu[1]);
+        }
+    }
+    xSemaphoreGive(poller.mux);
+
+    xTaskNotifyGive(poller.task);
+    if (block != NULL && poller.update_task != NULL)
+        xTaskNotify(poller.update_task, 1 << session_header->transaction_id, eSetBits);
+}
+
+void modbus_poller_on_failure(const rtu_session_t* session_header) {
+    xSemaphoreTake(poller.mux, portMAX_DELAY);
+    modbus_poll_block_t* block = poller_block_from_session(session_header);
+    if (block != NULL && session_header->transaction_id == poller.inflight) {
+        poller.inflight = -1;
+    }
+    xSemaphoreGive(poller.mux);
+
+    xTaskNotifyGive(poller.task);
+}
+
+void modbus_poller_on_write(const uint8_t* req, size_t req_len) {
+    uint8_t func_code;
+    uint16_t count = 1;
+    int invalidated = 0;
+
+    // uid, fc, addr, value or count
+    if (req_len < 6)
+        return;
+
+    // Coils are read with FC01, holding registers with FC03
+    switch (req[1]) {
+    case 15:
+        count = (req[4] << 8) | req[5];
+        // fall through
+    case 5:
+        func_code = 1;
+        break;
+    case 16:
+        count = (req[4] << 8) | req[5];
+        // fall through
+    case 6:
+        func_code = 3;
+        break;
+    default:
+        return;
+    }
+
+    uint8_t uid = req[0];
+    uint16_t addr = (req[2] << 8) | req[3];
+    uint32_t end = addr + count;
+
+    xSemaphoreTake(poller.mux, portMAX_DELAY);
+    TickType_t now = xTaskGetTickCount();
+    for (size_t i = 0; i < poller.count; i++) {
+        modbus_poll_block_t* block = &poller.blocks[i];
+        if ((uid != MODBUS_UID_BROADCAST && block->uid != uid) || block->func_code != func_code ||
+            end <= block->addr || addr >= block->addr + block->count)
+            continue;
+
+        block->valid = 0;
+        block->next_tick = now;
+        invalidated = 1;
+    }
+    xSemaphoreGive(poller.mux);
+
+    if (invalidated)
+        xTaskNotifyGive(poller.task);
+}
+
+size_t modbus_poller_read_image(const uint8_t* pdu, size_t pdu_len, uint8_t* resp, size_t resp_maxlen) {
+    size_t resp_len = 0;
+
+    // uid, fc, addr, count
+    if (pdu_len != 6 || pdu[1] < 1 || pdu[1] > 4 || poller.count == 0)
+        return 0;
+
+    uint8_t uid = pdu[0];
+    uint8_t func_code = pdu[1];
+    uint16_t addr = (pdu[2] << 8) | pdu[3];
+    uint16_t count = (pdu[4] << 8) | pdu[5];
+    uint8_t data_len = poll_data_len(func_code, count);
+
+    if (count == 0 || MODBUS_TCP_PAYLOAD_OFFSET + 3 + data_len > resp_maxlen)
+        return 0;
+
+    xSemaphoreTake(poller.mux, portMAX_DELAY);
+    TickType_t now = xTaskGetTickCount();
+    for (size_t i = 0; i < poller.count; i++) {
+        modbus_poll_block_t* block = &poller.blocks[i];
+        if (block->uid != uid || block->func_code != func_code || !block->valid ||
+            addr < block->addr || addr + count > block->addr + block->count) {
+            continue;
+        }
+
+        if (now - block->update_tick > poll_stale_ticks(block))
+            continue;
+
+        uint8_t* resp_pdu = resp + MODBUS_TCP_PAYLOAD_OFFSET;
+        uint16_t offset = addr - block->addr;
+        resp_pdu[0] = uid;
+        resp_pdu[1] = func_code;
+        resp_pdu[2] = data_len;
+        if (func_code <= 2) {
+            // Coils and discrete inputs are packed LSB first
+            memset(resp_pdu + 3, 0, data_len);
+            for (uint16_t bit = 0; bit < count; bit++) {
+                uint16_t src = offset + bit;
+                if (block->data[src / 8] & (1 << (src % 8)))
+                    resp_pdu[3 + bit / 8] |= 1 << (bit % 8);
+            }
+        } else {
+            memcpy(resp_pdu + 3, block->data + offset * 2, data_len);
+        }
+        resp_len = MODBUS_TCP_PAYLOAD_OFFSET + 3 + data_len;
+        break;
+    }
+    xSemaphoreGive(poller.mux);
+
+    return resp_len;
+}
+
+void modbus_poller_set_update_task(TaskHandle_t task) {
+    poller.update_task = task;
+}
+
+esp_err_t modbus_poller_get_block(size_t index, modbus_poll_block_info_t* info, uint8_t* data) {
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(poller.mux, portMAX_DELAY);
+    if (index >= poller.count) {
+        err = ESP_ERR_NOT_FOUND;
+    } else {
+        modbus_poll_block_t* block = &poller.blocks[index];
+        info->generation = poller.generation;
+        info->uid = block->uid;
+        info->func_code = block->func_code;
+        info->addr = block->addr;
+        info->count = block->count;
+        info->data_len = block->data_len;
+        info->valid = block->valid;
+        info->stale = xTaskGetTickCount() - block->update_tick > poll_stale_ticks(block);
+        memcpy(data, block->data, block->data_len);
+    }
+    xSemaphoreGive(poller.mux);
+
+    return err;
+}
+
+void modbus_poller_get_stats(modbus_poller_stats_t* stats) {
+    xSemaphoreTake(poller.mux, portMAX_DELAY);
+    stats->block_count = poller.count;
+    stats->bus_load_permille = poll_bus_load_permille();
+    stats->deadline_miss = poller.deadline_miss;
+    xSemaphoreGive(poller.mux);
+}
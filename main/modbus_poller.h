@@ -0,0 +1,84 @@
+/*
+ * modbus_poller.h
+ *
+ * Data concentrator mode: the gateway polls a configured list of register blocks
+ * and keeps their latest values in RAM, TCP masters reading a polled range are
+ * answered from the register image without touching the RS485 bus.
+ */
+
+#ifndef MAIN_MODBUS_POLLER_H_
+#define MAIN_MODBUS_POLLER_H_
+
+#include <stdint.h>
+#include <strings.h>
+#include "esp_err.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "modbus.h"
+
+#define MODBUS_POLL_BLOCK_MAX       16
+// Including the null terminator
+#define MODBUS_POLL_LIST_MAXLEN     256
+#define MODBUS_POLL_PERIOD_MS_MIN   50
+#define MODBUS_POLL_PERIOD_MS_MAX   86400000
+// The register image is considered stale if it has not been updated for this many periods
+#define MODBUS_POLL_STALE_PERIODS_DEFAULT   3
+#define MODBUS_POLL_STALE_PERIODS_MAX       100
+// The largest data of a block, 125 registers or 2000 coils
+#define MODBUS_POLL_DATA_MAXLEN     250
+
+typedef struct modbus_poller_stats {
+    size_t block_count;
+    uint32_t bus_load_permille;     // Estimated bus time spent on polling, >1000 means overloaded
+    uint32_t deadline_miss;         // Number of polls sent after their deadline
+} modbus_poller_stats_t;
+
+// A snapshot of a poll block
+typedef struct modbus_poll_block_info {
+    uint16_t generation;            // Changes whenever the poll list changes
+    uint8_t uid;
+    uint8_t func_code;
+    uint16_t addr;
+    uint16_t count;
+    uint8_t data_len;
+    uint8_t valid;                  // The data holds a response
+    uint8_t stale;                  // Not updated for the configured number of periods
+} modbus_poll_block_info_t;
+
+// The poll list is a string like "uid,fc,addr,count,period_ms;uid,fc,addr,count,period_ms;..."
+// Only FC01~FC04 can be polled. An empty list disables the poller.
+void modbus_poller_init(const char* list);
+// Check the syntax and limits of a poll list without applying it.
+esp_err_t modbus_poller_check_list(const char* list);
+// Replace the poll list, returns ESP_ERR_INVALID_ARG without changing anything if the list is malformed.
+esp_err_t modbus_poller_set_list(const char* list);
+
+// How long (in poll periods) a block in the register image stays valid without a fresh response.
+void modbus_poller_set_stale_periods(uint8_t periods);
+
+// Blocks are polled one at a time, earliest deadline (release time + period) first.
+void modbus_poller_get_stats(modbus_poller_stats_t* stats);
+
+// The task is notified with bit n set (eSetBits) every time a response to block n arrives.
+void modbus_poller_set_update_task(TaskHandle_t task);
+// Copy block index and its data (info->data_len bytes, at most MODBUS_POLL_DATA_MAXLEN),
+// returns ESP_ERR_NOT_FOUND if there is no such block.
+esp_err_t modbus_poller_get_block(size_t index, modbus_poll_block_info_t* info, uint8_t* data);
+
+// Called by the RTU engine when a response to a poll request arrives or the request is given up.
+void modbus_poller_on_response(const rtu_session_t* session_header, const uint8_t* payload, size_t len);
+void modbus_poller_on_failure(const rtu_session_t* session_header);
+// Called by the RTU engine after a write request (uid, fc, ...) has succeeded or has been broadcast.
+// The polled blocks it overlaps are invalidated, reads of them go to the bus until they are polled again,
+// which happens right away.
+void modbus_poller_on_write(const uint8_t* req, size_t req_len);
+
+// Try to answer a read request (uid, fc, addr, count) from the register image.
+// On success, the response (uid, fc, byte count, data) is placed at resp+MODBUS_TCP_PAYLOAD_OFFSET,
+// and the total length (including MODBUS_TCP_PAYLOAD_OFFSET) is returned. Returns 0 if the request
+// is not covered by a fresh register image.
+size_t modbus_poller_read_image(const uint8_t* pdu, size_t pdu_len, uint8_t* resp, size_t resp_maxlen);
+
+#endif /* MAIN_MODBUS_POLLER_H_ */
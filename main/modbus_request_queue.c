@@ -6,6 +6,11 @@
 
 #include "modbus_tcp_server.h"
 #include "modbus.h"
+#include "modbus_devid.h"
+#include "modbus_http.h"
+#include "modbus_metrics.h"
+#include "modbus_poller.h"
+#include "modbus_vslave.h"
 
 // To maintain compatibility, the response will be send to the
 // TCP client via a single send(). Some MODBUS TCP client assumes
@@ -17,10 +22,51 @@ void tcp_server_send_response(const rtu_session_t* session_header, void* payload
     mbap_header_t* resp_header = (mbap_header_t*) payload;
     resp_header->transaction_id = session_header->transaction_id;
     resp_header->protocol_id = session_header->protocol_id;
-    resp_header->length = len + MODBUS_TCP_PAYLOAD_OFFSET;
+    resp_header->length = len - MODBUS_TCP_PAYLOAD_OFFSET;
     resp_header->uid = session_header->uid;
     mbap_header_hton(resp_header);
-    send(session_header->socket, payload, len, 0);
+    if (session_header->origin == RTU_ORIGIN_WS) {
+        http_ws_tunnel_send(session_header->socket, payload, len);
+    } else {
+        send(session_header->socket, payload, len, 0);
+    }
+}
+
+void modbus_session_response(const rtu_session_t* session_header, void* payload, size_t len) {
+    switch (session_header->origin) {
+    case RTU_ORIGIN_TCP:
+    case RTU_ORIGIN_WS:
+        modbus_devid_store(((uint8_t*)payload) + MODBUS_TCP_PAYLOAD_OFFSET, len - MODBUS_TCP_PAYLOAD_OFFSET);
+        tcp_server_send_response(session_header, payload, len);
+        metrics_tcp_response(session_header);
+        break;
+    case RTU_ORIGIN_POLLER:
+        modbus_poller_on_response(session_header, payload, len);
+        break;
+    case RTU_ORIGIN_HTTP:
+        modbus_http_on_response(session_header, payload, len);
+        break;
+    default:
+        break;
+    }
+}
+
+void modbus_session_failed(const rtu_session_t* session_header) {
+    switch (session_header->origin) {
+    case RTU_ORIGIN_TCP:
+    case RTU_ORIGIN_WS:
+        // The TCP master will time out
+        metrics_tcp_failed(session_header);
+        break;
+    case RTU_ORIGIN_POLLER:
+        modbus_poller_on_failure(session_header);
+        break;
+    case RTU_ORIGIN_HTTP:
+        modbus_http_on_failure(session_header);
+        break;
+    default:
+        break;
+    }
 }
 
 //////////////////////
@@ -28,14 +74,23 @@ void tcp_server_send_response(const rtu_session_t* session_header, void* payload
 //////////////////////
 size_t tcp_server_frame_length_from_header(const void* buf, size_t len) {
     mbap_header_t header;
-    memcpy(&header, buf, len);
+    memcpy(&header, buf, TCP_SERVER_FRAME_HEADER_MIN_LEN());
     mbap_header_ntoh(&header);
     return header.length > 0 && header.length < 255 ? header.length + TCP_SERVER_FRAME_HEADER_MIN_LEN() : 0;
 }
 
 void tcp_server_client_frame_ready(int client_socket, const void* buf, size_t len) {
+    modbus_client_frame_ready(client_socket, RTU_ORIGIN_TCP, buf, len);
+}
+
+void modbus_client_frame_ready(int client_socket, uint8_t origin, const void* buf, size_t len) {
+    // uid and function code, up to the largest PDU an RTU frame can carry
+    if (len < MODBUS_TCP_PAYLOAD_OFFSET + 2 || len - MODBUS_TCP_PAYLOAD_OFFSET > MODBUS_RTU_FRAME_MAXLEN - 2)
+        return;
+
+    // MBAP header up to and including the uid
     mbap_header_t header;
-    memcpy(&header, buf, len);
+    memcpy(&header, buf, MODBUS_TCP_PAYLOAD_OFFSET + 1);
     mbap_header_ntoh(&header);
 
     rtu_session_t session_header;
@@ -43,10 +98,57 @@ void tcp_server_client_frame_ready(int client_socket, const void* buf, size_t le
     session_header.transaction_id = header.transaction_id;
     session_header.protocol_id = header.protocol_id;
     session_header.uid = header.uid;
+    session_header.retry = 0;
+    session_header.origin = origin;
+    session_header.start_us = metrics_now_us();
+    metrics_tcp_request(client_socket);
 
     size_t payload_len = sizeof(rtu_session_t) + len - MODBUS_TCP_PAYLOAD_OFFSET;
-    uint8_t payload[sizeof(rtu_session_t) + MODBUS_RTU_PDU_MAXLEN];
+    uint8_t payload[sizeof(rtu_session_t) + MODBUS_RTU_FRAME_MAXLEN - 2];
+
+    // The gateway's own virtual slave never goes to the bus
+    size_t resp_len = modbus_vslave_handle(((uint8_t*)buf) + MODBUS_TCP_PAYLOAD_OFFSET, len - MODBUS_TCP_PAYLOAD_OFFSET,
+                                           payload, sizeof(payload));
+    if (resp_len > 0) {
+        tcp_server_send_response(&session_header, payload, resp_len);
+        metrics_tcp_vslave_hit(client_socket);
+        return;
+    }
+
+    // Reads of polled ranges are answered from the register image
+    resp_len = modbus_poller_read_image(((uint8_t*)buf) + MODBUS_TCP_PAYLOAD_OFFSET, len - MODBUS_TCP_PAYLOAD_OFFSET,
+                                        payload, sizeof(payload));
+    if (resp_len > 0) {
+        tcp_server_send_response(&session_header, payload, resp_len);
+        metrics_tcp_image_hit(client_socket);
+        return;
+    }
+
+    // Device identification the slave has already given
+    resp_len = modbus_devid_lookup(((uint8_t*)buf) + MODBUS_TCP_PAYLOAD_OFFSET, len - MODBUS_TCP_PAYLOAD_OFFSET,
+                                   payload, sizeof(payload));
+    if (resp_len > 0) {
+        tcp_server_send_response(&session_header, payload, resp_len);
+        metrics_tcp_devid_hit(client_socket);
+        return;
+    }
+
     memcpy(payload, &session_header, sizeof(rtu_session_t));
     memcpy(payload+sizeof(rtu_session_t), ((uint8_t*)buf) + MODBUS_TCP_PAYLOAD_OFFSET, len - MODBUS_TCP_PAYLOAD_OFFSET);
-    modbus_uart_queue_send(payload, payload_len);
+    if (origin != RTU_ORIGIN_WS) {
+        modbus_uart_queue_send(payload, payload_len);
+        return;
+    }
+
+    // The tunnel runs on the httpd task, it must not wait for room in tx_fifo
+    if (modbus_uart_queue_send_timeout(payload, payload_len, 0) == ESP_OK)
+        return;
+    metrics_tcp_failed(&session_header);
+    if (session_header.uid == MODBUS_UID_BROADCAST)
+        return;
+    uint8_t* resp_pdu = payload + MODBUS_TCP_PAYLOAD_OFFSET;
+    resp_pdu[0] = session_header.uid;
+    resp_pdu[1] = ((const uint8_t*)buf)[MODBUS_TCP_PAYLOAD_OFFSET + 1] | 0x80;
+    resp_pdu[2] = MODBUS_EXC_SLAVE_BUSY;
+    tcp_server_send_response(&session_header, payload, MODBUS_TCP_PAYLOAD_OFFSET + 3);
 }
@@ -1,6 +1,10 @@
 #include <string.h>
 
 #include "modbus.h"
+#include "modbus_metrics.h"
+#include "modbus_poller.h"
+#include "modbus_sniff.h"
+#include "modbus_trace.h"
 #include "main.h"
 
 #include "freertos/FreeRTOS.h"
@@ -13,6 +17,7 @@
 
 #include "driver/uart.h"
 #include "driver/gpio.h"
+#include "driver/hw_timer.h"
 #include "esp8266/gpio_struct.h"
 
 #define MODBUS_GPIO_DE_BIT (1<<MODBUS_GPIO_DE_ID)
@@ -35,33 +40,91 @@
 #define RX_OVFL_BUF  1
 #define RX_OVFL_FIFO 2
 
+// How long the RTU task waits for a request before checking the sniffer mode again
+#define RTU_IDLE_MS 1000
+
+// hw_timer_alarm_us() refuses one-shot alarms shorter than this
+#define RTU_TIMER_MIN_US 11
+
+// The DE turnaround state machine, driven by the UART and hw_timer ISRs
+typedef enum rtu_state {
+    RTU_STATE_IDLE = 0,     // Bus released, nothing to send
+    RTU_STATE_TX_SETUP,     // DE asserted, waiting tx_delay_us before pushing the first byte
+    RTU_STATE_TX,           // Pushing data into the UART Tx FIFO
+    RTU_STATE_TX_DRAIN,     // Tx FIFO is empty, the last character is still in the shift register
+} rtu_state_t;
+
 typedef struct uart_modbus_obj {
     uart_port_t uart_num;               /*!< UART port number*/
     uart_dev_t* uart_dev;               /*!< UART peripheral (Address)*/
     uint32_t char_duration_us;
     uint32_t tx_delay_us;
+    uint32_t bcast_delay_ms;            // Turnaround delay after a broadcast, no reply is expected
+    uint8_t bcast_ack;                  // Non-zero to send a synthetic response to the master after a broadcast write
+    uint8_t retry_max;                  // Max. number of retries of a request
+    uint32_t retry_fcs;                 // Bit n set: requests with FCn can be retried
+    uint32_t rx_timeout_ms;
+    uint8_t sniff_mode;                 // enum modbus_sniff_mode
+    volatile rtu_state_t state;
 
     SemaphoreHandle_t tx_done_sem;
     uint8_t tx_frame_buffer[sizeof(rtu_session_t) + MODBUS_BUF_SIZE];
     uint8_t* tx_buffer;    // The tx buffer, points to tx_frame_buffer+sizeof(rtu_session_t)
     uint32_t tx_len;       // The size of data in bytes in the buffer to be sent
-    // The pointer to the first data to be sent
-    // Non-null indicates a Tx is going on
-    uint8_t* tx_ptr;
+    uint8_t* tx_ptr;       // The pointer to the next byte to be pushed into the UART Tx FIFO
+    volatile uint32_t tx_start_us;  // Set by the hw_timer ISR, see modbus_trace_rec_t
+    volatile uint32_t tx_end_us;
 
     SemaphoreHandle_t rx_done_sem;
     uint8_t rx_buffer[MODBUS_BUF_SIZE];
     uint32_t rx_len;
     uint8_t rx_overflow;
+    volatile uint32_t rx_start_us;  // Set by the UART ISR, 0 until the first byte of a frame arrives
+    volatile uint32_t rx_end_us;
 
     RingbufHandle_t tx_fifo;
     SemaphoreHandle_t tx_fifo_mux;
 
     SemaphoreHandle_t cfg_mux;
+    // Notified by the UART ISR after a frame and by modbus_uart_queue_send() after a request,
+    // so that it can wait for both while capturing the bus
+    TaskHandle_t task;
 } uart_modbus_obj_t;
 
 static uart_modbus_obj_t p_uart_obj = {0};
 
+static inline void rtu_timer_start(uint32_t us) {
+    hw_timer_alarm_us(us < RTU_TIMER_MIN_US ? RTU_TIMER_MIN_US : us, false);
+}
+
+// Called from the hw_timer ISR, finishes the delays of the DE turnaround without busy-waiting.
+static void rtu_timer_intr_handler(void *param) {
+    BaseType_t task_woken = 0;
+
+    switch (p_uart_obj.state) {
+    case RTU_STATE_TX_SETUP:
+        // The transceiver is now driving the bus, start pushing data
+        p_uart_obj.state = RTU_STATE_TX;
+        p_uart_obj.tx_start_us = metrics_now_us();
+        uart_enable_tx_intr(p_uart_obj.uart_num, 1, UART_EMPTY_THRESH_DEFAULT);
+        break;
+
+    case RTU_STATE_TX_DRAIN:
+        // The last character has left the shift register, release the bus
+        MODBUS_GPIO_DE_CLR();
+        p_uart_obj.state = RTU_STATE_IDLE;
+        p_uart_obj.tx_end_us = metrics_now_us();
+
+        xSemaphoreGiveFromISR(p_uart_obj.tx_done_sem, &task_woken);
+        if (task_woken == pdTRUE)
+            portYIELD_FROM_ISR();
+        break;
+
+    default:
+        break;
+    }
+}
+
 static void uart_modbus_intr_handler(void *param) {
     BaseType_t task_woken = 0;
 
@@ -73,30 +136,18 @@ static void uart_modbus_intr_handler(void *param) {
 
             int tx_fifo_rem = UART_FIFO_LEN - p_uart_obj.uart_dev->status.txfifo_cnt;
 
-            if (p_uart_obj.tx_ptr == NULL) {
-                if (p_uart_obj.tx_len == 0) {
-                    // No data to send, abort
-                    break;
-                } else {
-                    // The first interrupt, set DE high to enable tx
-                    MODBUS_GPIO_DE_SET();
-                    ets_delay_us(p_uart_obj.tx_delay_us);
-                    p_uart_obj.tx_ptr = p_uart_obj.tx_buffer;
-                }
-            } else {    // p_uart_obj.tx_ptr != NULL
-                if (p_uart_obj.tx_len == 0) {
-                    // We have sent all data and the buffer is now completely empty
-                    p_uart_obj.tx_ptr = NULL;
-
-                    // Although we have pushed the last byte into the buffer, but the UART will take sometime to send it
-                    ets_delay_us(p_uart_obj.char_duration_us);
-                    MODBUS_GPIO_DE_CLR();
-
-                    xSemaphoreGiveFromISR(p_uart_obj.tx_done_sem, &task_woken);
-                    if (task_woken == pdTRUE)
-                        portYIELD_FROM_ISR();
-                    break;
-                }
+            if (p_uart_obj.state != RTU_STATE_TX) {
+                // No Tx is going on, abort
+                break;
+            }
+
+            if (p_uart_obj.tx_len == 0) {
+                // We have sent all data and the buffer is now completely empty.
+                // Although we have pushed the last byte into the buffer, but the UART will take sometime to send it,
+                // the hw_timer releases DE once the last character is out.
+                p_uart_obj.state = RTU_STATE_TX_DRAIN;
+                rtu_timer_start(p_uart_obj.char_duration_us);
+                break;
             }
 
             int send_len = p_uart_obj.tx_len > tx_fifo_rem ? tx_fifo_rem : p_uart_obj.tx_len;
@@ -126,6 +177,14 @@ static void uart_modbus_intr_handler(void *param) {
                ) {
             int rx_fifo_len = p_uart_obj.uart_dev->status.rxfifo_cnt;
             int rx_buf_vacant = MODBUS_BUF_SIZE - p_uart_obj.rx_len;
+            if (p_uart_obj.rx_start_us == 0) {
+                // The first interrupt of a frame comes after the FIFO threshold or the silent interval,
+                // back-date it by the characters already received (and the timeout threshold). Never 0.
+                uint32_t chars = rx_fifo_len;
+                if (uart_intr_status & UART_RXFIFO_TOUT_INT_ST_M)
+                    chars += UART_TOUT_THRESH_DEFAULT;
+                p_uart_obj.rx_start_us = (metrics_now_us() - chars * p_uart_obj.char_duration_us) | 1;
+            }
             if (rx_fifo_len > rx_buf_vacant) {
                 // Too much data in the Rx FIFO, rx_buffer overflow
                 // We will not copy the remaining data since the request must be malformed.
@@ -148,9 +207,12 @@ static void uart_modbus_intr_handler(void *param) {
 
             if (uart_intr_status & UART_RXFIFO_TOUT_INT_ST_M) {
                 // Silent interval detected!
+                p_uart_obj.rx_end_us = metrics_now_us();
                 uart_disable_intr_mask(p_uart_obj.uart_num, UART_RXFIFO_TOUT_INT_CLR_M | UART_RXFIFO_FULL_INT_CLR_M);
 
                 xSemaphoreGiveFromISR(p_uart_obj.rx_done_sem, &task_woken);
+                if (p_uart_obj.task != NULL)
+                    vTaskNotifyGiveFromISR(p_uart_obj.task, &task_woken);
                 if (task_woken == pdTRUE)
                     portYIELD_FROM_ISR();
             }
@@ -173,63 +235,228 @@ static void uart_modbus_intr_handler(void *param) {
     } // while (uart_intr_status != 0x0);
 }
 
+// Discard whatever has been received and listen for the next frame
+static void rtu_rx_reset() {
+    p_uart_obj.rx_len = MODBUS_TCP_PAYLOAD_OFFSET;
+    p_uart_obj.rx_overflow = RX_OVFL_NONE;
+    p_uart_obj.rx_start_us = 0;
+    uart_enable_intr_mask(p_uart_obj.uart_num, UART_RXFIFO_TOUT_INT_CLR_M | UART_RXFIFO_FULL_INT_CLR_M);
+}
+
+static void rtu_sniff_rx(uint8_t direction) {
+    modbus_sniff_frame(direction, p_uart_obj.rx_start_us, p_uart_obj.rx_end_us,
+                       p_uart_obj.rx_buffer + MODBUS_TCP_PAYLOAD_OFFSET, p_uart_obj.rx_len - MODBUS_TCP_PAYLOAD_OFFSET,
+                       p_uart_obj.rx_overflow != RX_OVFL_NONE);
+}
+
+// Drop a late response to an earlier request (or line noise) before sending the next one,
+// otherwise it would be latched in rx_done_sem and taken for the reply.
+static void rtu_rx_flush() {
+    uart_disable_intr_mask(p_uart_obj.uart_num, UART_RXFIFO_TOUT_INT_CLR_M | UART_RXFIFO_FULL_INT_CLR_M);
+    if (xSemaphoreTake(p_uart_obj.rx_done_sem, 0) == pdTRUE)
+        rtu_sniff_rx(MODBUS_SNIFF_DIR_BUS);
+    p_uart_obj.uart_dev->conf0.rxfifo_rst = 0x1;
+    p_uart_obj.uart_dev->conf0.rxfifo_rst = 0x0;
+    rtu_rx_reset();
+}
+
+// Slaves never reply to a broadcast, wait for the turnaround delay so that they can process it.
+// Write requests can be acknowledged to the TCP master with a synthetic response,
+// for FC05, FC06, FC15 and FC16 the normal response is the first 6 bytes of the request.
+// The turnaround delay counts as waiting for the (absent) response in the trace.
+static void rtu_broadcast_done(const rtu_session_t* session_header, modbus_trace_rec_t* trace) {
+    uint8_t func_code = p_uart_obj.tx_buffer[1];
+    uint8_t resp[MODBUS_TCP_PAYLOAD_OFFSET + 6];
+
+    // Rounded up to whole ticks, plus one as the first tick may end right away,
+    // so that the delay is never shorter than configured
+    TickType_t ticks = (p_uart_obj.bcast_delay_ms + portTICK_RATE_MS - 1) / portTICK_RATE_MS;
+    if (ticks > 0)
+        vTaskDelay(ticks + 1);
+    trace->rx_end_us = metrics_now_us();
+
+    // Drop anything (e.g. line noise) heard during the turnaround delay
+    if (xSemaphoreTake(p_uart_obj.rx_done_sem, 0) == pdTRUE) {
+        rtu_sniff_rx(MODBUS_SNIFF_DIR_BUS);
+        rtu_rx_reset();
+    }
+
+    if (p_uart_obj.bcast_ack && (func_code == 5 || func_code == 6 || func_code == 15 || func_code == 16)) {
+        memcpy(resp + MODBUS_TCP_PAYLOAD_OFFSET, p_uart_obj.tx_buffer, 6);
+        modbus_session_response(session_header, resp, sizeof(resp));
+    }
+}
+
+// Put a failed request back to the end of tx_fifo, so that other queued requests are not held up by the retry.
+// Only the function codes enabled in retry_fcs are retried, at most retry_max times.
+// The origin of the request is notified if the request is given up.
+static void rtu_retry(rtu_session_t* session_header, size_t req_len) {
+    uint8_t func_code = p_uart_obj.tx_buffer[1];
+
+    if (session_header->retry >= p_uart_obj.retry_max ||
+            func_code >= 32 || !(p_uart_obj.retry_fcs & (1 << func_code))) {
+        modbus_session_failed(session_header);
+        return;
+    }
+
+    session_header->retry++;
+    session_header->enqueue_us = metrics_now_us();
+    // Never block here, this task is the only consumer of tx_fifo
+    if (xRingbufferSend(p_uart_obj.tx_fifo, p_uart_obj.tx_frame_buffer, sizeof(rtu_session_t) + req_len, 0) != pdTRUE) {
+        ESP_LOGW("Modbus_Rx", "tx_fifo full, retry dropped");
+        session_header->retry--;
+        modbus_session_failed(session_header);
+    }
+}
+
+// Take the next request from tx_fifo into tx_frame_buffer, returns 0 if there is none for now.
+// Unless the sniffer is off, the frames heard between the transactions (e.g. from another master) are captured meanwhile.
+static int rtu_receive_request() {
+    uint8_t* buf1 = NULL;
+    uint8_t* buf2 = NULL;
+    size_t buf1_len, buf2_len;
+    TickType_t wait = RTU_IDLE_MS / portTICK_RATE_MS;
+
+    if (p_uart_obj.sniff_mode != MODBUS_SNIFF_OFF) {
+        if (xSemaphoreTake(p_uart_obj.rx_done_sem, 0) == pdTRUE) {
+            rtu_sniff_rx(MODBUS_SNIFF_DIR_BUS);
+            rtu_rx_reset();
+        }
+        wait = 0;
+    }
+
+    if (!xRingbufferReceiveSplit(p_uart_obj.tx_fifo, (void**)(&buf1), (void**)(&buf2), &buf1_len, &buf2_len, wait)) {
+        // Both sources have been checked, a frame or a request arriving from now on leaves a notification
+        if (p_uart_obj.sniff_mode != MODBUS_SNIFF_OFF)
+            ulTaskNotifyTake(pdTRUE, RTU_IDLE_MS / portTICK_RATE_MS);
+        return 0;
+    }
+
+    memcpy(p_uart_obj.tx_frame_buffer, buf1, buf1_len);
+    p_uart_obj.tx_len = buf1_len;
+    vRingbufferReturnItem(p_uart_obj.tx_fifo, buf1);
+
+    if (buf2 != NULL) {
+        memcpy(p_uart_obj.tx_frame_buffer + buf1_len, buf2, buf2_len);
+        p_uart_obj.tx_len += buf2_len;
+        vRingbufferReturnItem(p_uart_obj.tx_fifo, buf2);
+    }
+    return 1;
+}
+
 static void modbus_rtu_task(void* param) {
+    modbus_trace_rec_t trace;
+
     while (1) {
         rtu_session_t* session_header;
-        uint8_t* buf1 = NULL;
-        uint8_t* buf2 = NULL;
         size_t buf1_len, buf2_len;
-        if (xRingbufferReceiveSplit(p_uart_obj.tx_fifo, (void**)(&buf1), (void**)(&buf2), &buf1_len, &buf2_len, portMAX_DELAY)) {
-            memcpy(p_uart_obj.tx_frame_buffer, buf1, buf1_len);
-            p_uart_obj.tx_len = buf1_len;
-            vRingbufferReturnItem(p_uart_obj.tx_fifo, buf1);
-
-            if (buf2 != NULL) {
-                memcpy(p_uart_obj.tx_frame_buffer + buf1_len, buf2, buf2_len);
-                p_uart_obj.tx_len += buf2_len;
-                vRingbufferReturnItem(p_uart_obj.tx_fifo, buf2);
-            }
-        }
+        if (!rtu_receive_request())
+            continue;
+
         session_header = (rtu_session_t*)p_uart_obj.tx_frame_buffer;
         p_uart_obj.tx_len -= sizeof(rtu_session_t);
+        if (p_uart_obj.sniff_mode == MODBUS_SNIFF_PASSIVE) {
+            // Listen only, never drive the bus
+            modbus_session_failed(session_header);
+            continue;
+        }
+        size_t req_len = p_uart_obj.tx_len;  // Excluding the CRC
 
         xSemaphoreTake(p_uart_obj.cfg_mux, portMAX_DELAY);
+        metrics_rtu_request(session_header->uid, session_header->retry);
+
+        trace.enqueue_us = session_header->enqueue_us;
+        trace.dequeue_us = metrics_now_us();
+        trace.transaction_id = session_header->transaction_id;
+        trace.uid = session_header->uid;
+        trace.func_code = p_uart_obj.tx_buffer[1];
+        trace.origin = session_header->origin;
+        trace.retry = session_header->retry;
 
         uint16_t crc16 = modbus_rtu_crc16(p_uart_obj.tx_buffer, p_uart_obj.tx_len);
         p_uart_obj.tx_buffer[p_uart_obj.tx_len++] = crc16 & 0xFF; // Lower Byte
         p_uart_obj.tx_buffer[p_uart_obj.tx_len++] = (crc16>>8) & 0xFF; // Higher Byte
         //ets_delay_us(p_uart_obj.char_duration_us);
-        p_uart_obj.tx_ptr = NULL;
-        // Enter UART_TXFIFO_EMPTY_INT immediately
-        // Tx FIFO is populated by the ISR
+        p_uart_obj.tx_ptr = p_uart_obj.tx_buffer;
         // ESP_LOGI("MODBUS", "Tx[%04X@%d]:", session_header->transaction_id, xTaskGetTickCount());
         // hexdump(p_uart_obj.tx_buffer, p_uart_obj.tx_len);
-        uart_enable_tx_intr(p_uart_obj.uart_num, 1, UART_EMPTY_THRESH_DEFAULT);
+
+        rtu_rx_flush();
+
+        // Set DE to enable tx, the hw_timer enables UART_TXFIFO_EMPTY_INT after tx_delay_us
+        // Tx FIFO is populated by the ISR
+        p_uart_obj.state = RTU_STATE_TX_SETUP;
+        MODBUS_GPIO_DE_SET();
+        rtu_timer_start(p_uart_obj.tx_delay_us);
 
         xSemaphoreTake(p_uart_obj.tx_done_sem, portMAX_DELAY);
+        uint32_t tx_done_us = metrics_now_us();
+
+        trace.tx_start_us = p_uart_obj.tx_start_us;
+        trace.tx_end_us = p_uart_obj.tx_end_us;
+        trace.rx_start_us = 0;
+        modbus_sniff_frame(MODBUS_SNIFF_DIR_REQUEST, trace.tx_start_us, trace.tx_end_us, p_uart_obj.tx_buffer, req_len + 2, 0);
+
+        if (session_header->uid == MODBUS_UID_BROADCAST) {
+            metrics_rtu_broadcast();
+            trace.result = MODBUS_TRACE_BROADCAST;
+            modbus_poller_on_write(p_uart_obj.tx_buffer, req_len);
+            rtu_broadcast_done(session_header, &trace);
+        } else if (xSemaphoreTake(p_uart_obj.rx_done_sem, p_uart_obj.rx_timeout_ms/portTICK_RATE_MS) == pdTRUE) {
+            trace.rx_start_us = p_uart_obj.rx_start_us;
+            trace.rx_end_us = p_uart_obj.rx_end_us;
+            rtu_sniff_rx(MODBUS_SNIFF_DIR_RESPONSE);
 
-        if (xSemaphoreTake(p_uart_obj.rx_done_sem, 300/portTICK_RATE_MS) == pdTRUE) {
             // ESP_LOGI("MODBUS", "Rx[%04X@%d] %d bytes, overflow state %d", session_header->transaction_id, xTaskGetTickCount(), p_uart_obj.rx_len, p_uart_obj.rx_overflow);
             // hexdump(p_uart_obj.rx_buffer, p_uart_obj.rx_len);
 
             buf1_len = p_uart_obj.rx_len-2;
-            buf2_len = modbus_rtu_crc16(p_uart_obj.rx_buffer+MODBUS_TCP_PAYLOAD_OFFSET, buf1_len-MODBUS_TCP_PAYLOAD_OFFSET);
-            if (    (p_uart_obj.rx_buffer[buf1_len] == (buf2_len & 0xFF)) &&
-                    (p_uart_obj.rx_buffer[buf1_len+1] == ((buf2_len>>8) & 0xFF)) &&
-                    p_uart_obj.rx_buffer[MODBUS_TCP_PAYLOAD_OFFSET] == session_header->uid) {
-                tcp_server_send_response(session_header, p_uart_obj.rx_buffer, buf1_len);
+            int crc_ok = 0, frame_ok = 0;
+            // A valid response has at least UID + FC + CRC16
+            if (p_uart_obj.rx_overflow == RX_OVFL_NONE && p_uart_obj.rx_len >= MODBUS_TCP_PAYLOAD_OFFSET + 4) {
+                buf2_len = modbus_rtu_crc16(p_uart_obj.rx_buffer+MODBUS_TCP_PAYLOAD_OFFSET, buf1_len-MODBUS_TCP_PAYLOAD_OFFSET);
+                crc_ok = (p_uart_obj.rx_buffer[buf1_len] == (buf2_len & 0xFF)) &&
+                         (p_uart_obj.rx_buffer[buf1_len+1] == ((buf2_len>>8) & 0xFF));
+                // The response must echo the UID and the FC (with the exception bit) of the request
+                frame_ok = crc_ok &&
+                           p_uart_obj.rx_buffer[MODBUS_TCP_PAYLOAD_OFFSET] == session_header->uid &&
+                           (p_uart_obj.rx_buffer[MODBUS_TCP_PAYLOAD_OFFSET + 1] & 0x7F) == p_uart_obj.tx_buffer[1];
+            }
+            if (frame_ok) {
+                metrics_rtu_response(session_header->uid, tx_done_us);
+                if (p_uart_obj.rx_buffer[MODBUS_TCP_PAYLOAD_OFFSET + 1] & 0x80)
+                    metrics_rtu_exception(session_header->uid);
+                else
+                    modbus_poller_on_write(p_uart_obj.tx_buffer, req_len);
+                trace.result = MODBUS_TRACE_OK;
+                modbus_session_response(session_header, p_uart_obj.rx_buffer, buf1_len);
             } else {
-                ESP_LOGW("Modbus_Rx", "Bad CRC");
+                trace.result = MODBUS_TRACE_BAD_FRAME;
+                if (p_uart_obj.rx_overflow != RX_OVFL_NONE) {
+                    ESP_LOGW("Modbus_Rx", "Rx overflow");
+                    metrics_rtu_rx_overflow(p_uart_obj.rx_overflow & RX_OVFL_BUF, p_uart_obj.rx_overflow & RX_OVFL_FIFO);
+                } else if (crc_ok) {
+                    ESP_LOGW("Modbus_Rx", "Response does not match the request");
+                    metrics_rtu_crc_error(session_header->uid);
+                } else {
+                    ESP_LOGW("Modbus_Rx", "Bad CRC");
+                    metrics_rtu_crc_error(session_header->uid);
+                }
+                rtu_retry(session_header, req_len);
             }
 
-            p_uart_obj.rx_len = MODBUS_TCP_PAYLOAD_OFFSET;
-            p_uart_obj.rx_overflow = RX_OVFL_NONE;
-            uart_enable_intr_mask(p_uart_obj.uart_num, UART_RXFIFO_TOUT_INT_CLR_M | UART_RXFIFO_FULL_INT_CLR_M);
+            rtu_rx_reset();
         } else {
             ESP_LOGW("Modbus_Rx", "Rx timeout");
+            metrics_rtu_timeout(session_header->uid);
+            trace.result = MODBUS_TRACE_TIMEOUT;
+            trace.rx_end_us = metrics_now_us();
+            rtu_retry(session_header, req_len);
         }
 
         xSemaphoreGive(p_uart_obj.cfg_mux);
+        trace.done_us = metrics_now_us();
+        modbus_trace_add(&trace);
 
         // Inter-frame gap
         vTaskDelay(p_uart_obj.char_duration_us * 4 * configTICK_RATE_HZ / 1000000 );
@@ -255,6 +482,13 @@ void modbus_uart_init(uint32_t baudrate, uint8_t parity, uint32_t tx_delay) {
     p_uart_obj.uart_dev = &uart0;
     p_uart_obj.char_duration_us = calc_char_us(baudrate, parity);
     p_uart_obj.tx_delay_us = tx_delay;
+    p_uart_obj.bcast_delay_ms = MODBUS_RTU_BCAST_DELAY_MS_DEFAULT;
+    p_uart_obj.bcast_ack = 0;
+    p_uart_obj.retry_max = MODBUS_RTU_RETRY_MAX_DEFAULT;
+    p_uart_obj.retry_fcs = MODBUS_RTU_RETRY_FCS_DEFAULT;
+    p_uart_obj.rx_timeout_ms = MODBUS_RTU_RX_TIMEOUT_MS_DEFAULT;
+    p_uart_obj.sniff_mode = MODBUS_SNIFF_OFF;
+    p_uart_obj.state = RTU_STATE_IDLE;
 
     p_uart_obj.tx_done_sem = xSemaphoreCreateBinary();
     p_uart_obj.tx_buffer = p_uart_obj.tx_frame_buffer + sizeof(rtu_session_t);
@@ -310,10 +544,14 @@ void modbus_uart_init(uint32_t baudrate, uint8_t parity, uint32_t tx_delay) {
     gpio_config(&io_conf);
     gpio_set_level(MODBUS_GPIO_DE_ID, MODBUS_GPIO_DE_INV);
 
-    xTaskCreate(modbus_rtu_task, "uart_task", 2048, NULL, 7, NULL);
+    // Times the DE turnaround, see rtu_timer_intr_handler()
+    ESP_ERROR_CHECK(hw_timer_init(rtu_timer_intr_handler, NULL));
+
+    xTaskCreate(modbus_rtu_task, "uart_task", 2048, NULL, 7, &p_uart_obj.task);
 }
 
 void modbus_uart_deinit() {
+    hw_timer_deinit();
     vSemaphoreDelete(p_uart_obj.tx_done_sem);
     vSemaphoreDelete(p_uart_obj.rx_done_sem);
     vRingbufferDelete(p_uart_obj.tx_fifo);
@@ -321,31 +559,68 @@ void modbus_uart_deinit() {
     vSemaphoreDelete(p_uart_obj.cfg_mux);
 }
 
-void modbus_uart_queue_send(const void* buf, size_t len) {
+void modbus_uart_queue_send(void* buf, size_t len) {
+	((rtu_session_t*)buf)->enqueue_us = metrics_now_us();
 	xRingbufferSend(p_uart_obj.tx_fifo, buf, len, portMAX_DELAY);
+	if (p_uart_obj.task != NULL)
+		xTaskNotifyGive(p_uart_obj.task);
 	portYIELD();
 }
 
-void modbus_uart_set_baudrate(uint32_t baudrate) {
-    uart_parity_t parity;
+esp_err_t modbus_uart_queue_send_timeout(void* buf, size_t len, uint32_t timeout_ms) {
+    ((rtu_session_t*)buf)->enqueue_us = metrics_now_us();
+    if (xRingbufferSend(p_uart_obj.tx_fifo, buf, len, timeout_ms / portTICK_RATE_MS) != pdTRUE)
+        return ESP_ERR_TIMEOUT;
+    if (p_uart_obj.task != NULL)
+        xTaskNotifyGive(p_uart_obj.task);
+    portYIELD();
+    return ESP_OK;
+}
+
+void modbus_uart_set_format(uint32_t baudrate, uint8_t parity, uint32_t tx_delay) {
     xSemaphoreTake(p_uart_obj.cfg_mux, portMAX_DELAY);
     uart_set_baudrate(p_uart_obj.uart_num, baudrate);
-    uart_get_parity(p_uart_obj.uart_num, &parity);
+    uart_set_parity(p_uart_obj.uart_num, parity_from_u8(parity));
     p_uart_obj.char_duration_us = calc_char_us(baudrate, parity);
+    p_uart_obj.tx_delay_us = tx_delay;
     xSemaphoreGive(p_uart_obj.cfg_mux);
 }
 
-void modbus_uart_set_parity(uint8_t parity) {
-    uint32_t baudrate;
+void modbus_uart_set_bcast(uint32_t delay_ms, uint8_t ack) {
     xSemaphoreTake(p_uart_obj.cfg_mux, portMAX_DELAY);
-    uart_set_parity(p_uart_obj.uart_num, parity_from_u8(parity));
-    uart_get_baudrate(p_uart_obj.uart_num, &baudrate);
-    p_uart_obj.char_duration_us = calc_char_us(baudrate, parity);
+    p_uart_obj.bcast_delay_ms = delay_ms;
+    p_uart_obj.bcast_ack = ack;
     xSemaphoreGive(p_uart_obj.cfg_mux);
 }
 
-void modbus_uart_set_tx_delay(uint32_t tx_delay) {
+void modbus_uart_set_retry(uint8_t retry_max, uint32_t retry_fcs) {
     xSemaphoreTake(p_uart_obj.cfg_mux, portMAX_DELAY);
-    p_uart_obj.tx_delay_us = tx_delay;
+    p_uart_obj.retry_max = retry_max;
+    p_uart_obj.retry_fcs = retry_fcs;
+    xSemaphoreGive(p_uart_obj.cfg_mux);
+}
+
+void modbus_uart_set_rx_timeout(uint32_t timeout_ms) {
+    xSemaphoreTake(p_uart_obj.cfg_mux, portMAX_DELAY);
+    p_uart_obj.rx_timeout_ms = timeout_ms;
+    xSemaphoreGive(p_uart_obj.cfg_mux);
+}
+
+void modbus_uart_set_sniff(uint8_t mode) {
+    xSemaphoreTake(p_uart_obj.cfg_mux, portMAX_DELAY);
+    p_uart_obj.sniff_mode = mode;
     xSemaphoreGive(p_uart_obj.cfg_mux);
 }
+
+uint32_t modbus_uart_transaction_us(size_t req_len, size_t resp_len) {
+    // Each frame is followed by at least 3.5 characters of silence
+    return p_uart_obj.tx_delay_us + (req_len + resp_len + 7) * p_uart_obj.char_duration_us + MODBUS_RTU_SLAVE_THINK_US;
+}
+
+uint32_t modbus_uart_result_timeout_ms() {
+    // The smallest request in tx_fifo is a read (uid, fc, addr, count) after its session header
+    uint32_t queue_depth = MODBUS_RTU_TX_FIFO_LEN / (sizeof(rtu_session_t) + 6) + 1;
+    uint32_t attempt_ms = p_uart_obj.rx_timeout_ms + p_uart_obj.bcast_delay_ms +
+                          modbus_uart_transaction_us(MODBUS_RTU_FRAME_MAXLEN, MODBUS_RTU_FRAME_MAXLEN) / 1000 + 1;
+    return queue_depth * (p_uart_obj.retry_max + 1) * attempt_ms;
+}
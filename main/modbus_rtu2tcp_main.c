@@ -21,6 +21,13 @@
 #include "main.h"
 #include "modbus.h"
 #include "modbus_tcp_server.h"
+#include "modbus_devid.h"
+#include "modbus_http.h"
+#include "modbus_mqtt.h"
+#include "modbus_tags.h"
+#include "modbus_poller.h"
+#include "modbus_sniff.h"
+#include "modbus_vslave.h"
 
 static const char *TAG = "TCP/IP";
 static const char* STA_TAG = "Wifi STA";
@@ -331,14 +338,26 @@ static void rtu_init() {
     uint32_t baudrate = 9600;
     uint8_t parity = 0;
     uint32_t tx_delay = 1;
+    char poll_list[MODBUS_POLL_LIST_MAXLEN];
+    size_t poll_list_len = sizeof(poll_list);
     ESP_ERROR_CHECK(cp_get_u32_by_id(CFG_UART_BAUD, &baudrate));
     ESP_ERROR_CHECK(cp_get_u8_by_id(CFG_UART_PARITY, &parity));
-    ESP_ERROR_CHECK(cp_get_u8_by_id(CFG_UART_TX_DELAY, &tx_delay));
+    ESP_ERROR_CHECK(cp_get_u32_by_id(CFG_UART_TX_DELAY, &tx_delay));
     modbus_uart_init(baudrate, parity, tx_delay);
+    cpcb_apply(CFG_APPLY_RTU_BCAST | CFG_APPLY_RTU_RETRY | CFG_APPLY_RTU_TIMEOUT | CFG_APPLY_RTU_SNIFF);
+
+    ESP_ERROR_CHECK(cp_get_by_id(CFG_POLL_LIST, poll_list, &poll_list_len));
+    modbus_poller_init(poll_list);
+    modbus_devid_init();
+    modbus_http_init();
+    modbus_tags_init();
+    modbus_mqtt_init();
+    cpcb_apply(CFG_APPLY_POLL_STALE | CFG_APPLY_VSLAVE | CFG_APPLY_TAGS | CFG_APPLY_MQTT);
 }
 
 void app_main() {
     ESP_ERROR_CHECK(nvs_flash_init());
+    ESP_ERROR_CHECK(cp_init());
     ESP_ERROR_CHECK(esp_netif_init()); // mDNS Implies tcpip_adapter_init();
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
@@ -355,6 +374,7 @@ void app_main() {
     // Webserver
     ESP_ERROR_CHECK(start_webserver());
     modbus_tcp_server_create();
+    modbus_sniff_server_create();
 
     if (wifi_sta_preferred()) {
         // STA mode
@@ -487,30 +507,142 @@ esp_err_t wifi_ap_query(char* ssid, size_t ssid_len) {
     return ESP_OK;
 }
 
-esp_err_t cpcb_check_set_baudrate(uint32_t baudrate) {
-    if (baudrate >= 1200 && baudrate <= 921600) {
-        modbus_uart_set_baudrate(baudrate);
-        return ESP_OK;
-    } else {
-        return ESP_ERR_INVALID_ARG;
-    }
+esp_err_t cpcb_check_baudrate(uint32_t baudrate) {
+    return (baudrate >= 1200 && baudrate <= 921600) ? ESP_OK : ESP_ERR_INVALID_ARG;
 }
 
-esp_err_t cpcb_check_set_parity(uint8_t parity) {
-    if (parity < 3) {
-        modbus_uart_set_parity(parity);
-        return ESP_OK;
-    } else {
-        return ESP_ERR_INVALID_ARG;
-    }
+esp_err_t cpcb_check_parity(uint8_t parity) {
+    return (parity < 3) ? ESP_OK : ESP_ERR_INVALID_ARG;
 }
 
-esp_err_t cpcb_check_set_tx_delay(uint32_t tx_delay) {
-    if (tx_delay <= MODBUS_RTU_TX_DELAY_US_MAX) {
-        modbus_uart_set_tx_delay(tx_delay);
-        return ESP_OK;
-    } else {
-        return ESP_ERR_INVALID_ARG;
+esp_err_t cpcb_check_tx_delay(uint32_t tx_delay) {
+    return (tx_delay <= MODBUS_RTU_TX_DELAY_US_MAX) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t cpcb_check_bcast_delay(uint32_t delay_ms) {
+    return (delay_ms <= MODBUS_RTU_BCAST_DELAY_MS_MAX) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t cpcb_check_bcast_ack(uint8_t ack) {
+    return (ack < 2) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t cpcb_check_retry_max(uint8_t retry_max) {
+    return (retry_max <= MODBUS_RTU_RETRY_MAX_LIMIT) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t cpcb_check_poll_list(const char* list) {
+    return modbus_poller_check_list(list);
+}
+
+esp_err_t cpcb_check_rx_timeout(uint32_t timeout_ms) {
+    return (timeout_ms >= MODBUS_RTU_RX_TIMEOUT_MS_MIN && timeout_ms <= MODBUS_RTU_RX_TIMEOUT_MS_MAX) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t cpcb_check_stale_periods(uint8_t periods) {
+    return (periods >= 1 && periods <= MODBUS_POLL_STALE_PERIODS_MAX) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t cpcb_check_sniff_mode(uint8_t mode) {
+    return (mode < MODBUS_SNIFF_MODE_MAX) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t cpcb_check_vslave_uid(uint8_t uid) {
+    // 0 disables it, the broadcast address cannot be claimed anyway
+    return (uid <= MODBUS_VSLAVE_UID_MAX) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t cpcb_check_mqtt_uri(const char* uri) {
+    return modbus_mqtt_check_uri(uri);
+}
+
+esp_err_t cpcb_check_mqtt_topic(const char* topic) {
+    return modbus_mqtt_check_topic(topic);
+}
+
+esp_err_t cpcb_check_mqtt_integrity(uint32_t integrity_s) {
+    return (integrity_s <= MODBUS_MQTT_INTEGRITY_S_MAX) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t cpcb_check_tag_list(const char* list) {
+    return modbus_tags_check_list(list);
+}
+
+void cpcb_apply(uint32_t groups) {
+    if (groups & CFG_APPLY_UART_FORMAT) {
+        uint32_t baudrate;
+        uint8_t parity;
+        uint32_t tx_delay;
+        ESP_ERROR_CHECK(cp_get_u32_by_id(CFG_UART_BAUD, &baudrate));
+        ESP_ERROR_CHECK(cp_get_u8_by_id(CFG_UART_PARITY, &parity));
+        ESP_ERROR_CHECK(cp_get_u32_by_id(CFG_UART_TX_DELAY, &tx_delay));
+        modbus_uart_set_format(baudrate, parity, tx_delay);
+    }
+
+    if (groups & CFG_APPLY_RTU_BCAST) {
+        uint32_t bcast_delay;
+        uint8_t bcast_ack;
+        ESP_ERROR_CHECK(cp_get_u32_by_id(CFG_RTU_BCAST_DELAY, &bcast_delay));
+        ESP_ERROR_CHECK(cp_get_u8_by_id(CFG_RTU_BCAST_ACK, &bcast_ack));
+        modbus_uart_set_bcast(bcast_delay, bcast_ack);
+    }
+
+    if (groups & CFG_APPLY_RTU_RETRY) {
+        uint8_t retry_max;
+        uint32_t retry_fcs;
+        ESP_ERROR_CHECK(cp_get_u8_by_id(CFG_RTU_RETRY_MAX, &retry_max));
+        ESP_ERROR_CHECK(cp_get_u32_by_id(CFG_RTU_RETRY_FCS, &retry_fcs));
+        modbus_uart_set_retry(retry_max, retry_fcs);
+    }
+
+    if (groups & CFG_APPLY_POLL_LIST) {
+        char poll_list[MODBUS_POLL_LIST_MAXLEN];
+        size_t poll_list_len = sizeof(poll_list);
+        ESP_ERROR_CHECK(cp_get_by_id(CFG_POLL_LIST, poll_list, &poll_list_len));
+        modbus_poller_set_list(poll_list);
+    }
+
+    if (groups & CFG_APPLY_RTU_TIMEOUT) {
+        uint32_t rx_timeout;
+        ESP_ERROR_CHECK(cp_get_u32_by_id(CFG_RTU_RX_TIMEOUT, &rx_timeout));
+        modbus_uart_set_rx_timeout(rx_timeout);
+    }
+
+    if (groups & CFG_APPLY_POLL_STALE) {
+        uint8_t stale_periods;
+        ESP_ERROR_CHECK(cp_get_u8_by_id(CFG_POLL_STALE_PERIODS, &stale_periods));
+        modbus_poller_set_stale_periods(stale_periods);
+    }
+
+    if (groups & CFG_APPLY_RTU_SNIFF) {
+        uint8_t sniff_mode;
+        ESP_ERROR_CHECK(cp_get_u8_by_id(CFG_RTU_SNIFF, &sniff_mode));
+        modbus_uart_set_sniff(sniff_mode);
+    }
+
+    if (groups & CFG_APPLY_VSLAVE) {
+        uint8_t vslave_uid;
+        ESP_ERROR_CHECK(cp_get_u8_by_id(CFG_VSLAVE_UID, &vslave_uid));
+        modbus_vslave_set_uid(vslave_uid);
+    }
+
+    if (groups & CFG_APPLY_MQTT) {
+        char uri[MODBUS_MQTT_URI_MAXLEN];
+        size_t uri_len = sizeof(uri);
+        char topic[MODBUS_MQTT_TOPIC_MAXLEN];
+        size_t topic_len = sizeof(topic);
+        uint32_t integrity_s;
+        ESP_ERROR_CHECK(cp_get_by_id(CFG_MQTT_URI, uri, &uri_len));
+        ESP_ERROR_CHECK(cp_get_by_id(CFG_MQTT_TOPIC, topic, &topic_len));
+        ESP_ERROR_CHECK(cp_get_u32_by_id(CFG_MQTT_INTEGRITY, &integrity_s));
+        modbus_mqtt_set_config(uri, topic, integrity_s);
+    }
+
+    if (groups & CFG_APPLY_TAGS) {
+        char tag_list[MODBUS_TAG_LIST_MAXLEN];
+        size_t tag_list_len = sizeof(tag_list);
+        ESP_ERROR_CHECK(cp_get_by_id(CFG_TAG_LIST, tag_list, &tag_list_len));
+        modbus_tags_set_list(tag_list);
     }
 }
 
@@ -0,0 +1,189 @@
+#include <stddef.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/ringbuf.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "lwip/sockets.h"
+
+#include "modbus.h"
+#include "modbus_sniff.h"
+
+#define SNIFF_IDLE_MS   1000
+
+static const char *TAG = "Modbus_Sniff";
+
+// pcap file format, native byte order
+typedef struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+} pcap_file_hdr_t;
+
+typedef struct pcap_rec_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_rec_hdr_t;
+
+// An item of the ring, followed by the frame
+typedef struct sniff_item {
+    int64_t ts_us;              // esp_timer_get_time() of the first character
+    modbus_sniff_hdr_t hdr;
+} sniff_item_t;
+
+static struct modbus_sniff {
+    RingbufHandle_t ring;       // Created when the first client connects
+    volatile int active;        // A client is connected, the RTU task may fill the ring
+    uint8_t dropped;            // RTU task only, the previous frame did not fit into the ring
+} sniff = {0};
+
+void modbus_sniff_frame(uint8_t direction, uint32_t start_us, uint32_t end_us, const uint8_t* frame, size_t len, int overflow) {
+    // Kept off the stack of the RTU task, its only caller
+    static uint8_t item[sizeof(sniff_item_t) + MODBUS_RTU_FRAME_MAXLEN];
+    sniff_item_t* header = (sniff_item_t*) item;
+
+    if (!sniff.active || len == 0)
+        return;
+    if (len > MODBUS_RTU_FRAME_MAXLEN)
+        len = MODBUS_RTU_FRAME_MAXLEN;
+
+    // Extend the 32-bit time stamp, it is always in the past
+    int64_t now = esp_timer_get_time();
+    header->ts_us = now - (uint32_t)((uint32_t)now - start_us);
+    header->hdr.version = MODBUS_SNIFF_VERSION;
+    header->hdr.direction = direction;
+    header->hdr.flags = 0;
+    if (overflow)
+        header->hdr.flags |= MODBUS_SNIFF_FLAG_OVERFLOW;
+    if (len < 4 || modbus_rtu_crc16(frame, len) != 0)
+        header->hdr.flags |= MODBUS_SNIFF_FLAG_CRC_ERR;
+    if (sniff.dropped)
+        header->hdr.flags |= MODBUS_SNIFF_FLAG_DROPPED;
+    header->hdr.reserved = 0;
+    header->hdr.duration_us = htonl(end_us - start_us);
+    memcpy(item + sizeof(sniff_item_t), frame, len);
+
+    sniff.dropped = xRingbufferSend(sniff.ring, item, sizeof(sniff_item_t) + len, 0) != pdTRUE;
+}
+
+static int sniff_send_all(int sock, const void* buf, size_t len) {
+    const uint8_t* ptr = buf;
+    while (len > 0) {
+        int sent = send(sock, ptr, len, 0);
+        if (sent <= 0)
+            return -1;
+        ptr += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Stream the captured frames until the client goes away
+static void sniff_stream(int sock) {
+    struct timeval tv;
+    pcap_file_hdr_t file_hdr = {
+        .magic = 0xa1b2c3d4,
+        .version_major = 2,
+        .version_minor = 4,
+        .thiszone = 0,
+        .sigfigs = 0,
+        .snaplen = sizeof(modbus_sniff_hdr_t) + MODBUS_RTU_FRAME_MAXLEN,
+        .network = MODBUS_SNIFF_DLT,
+    };
+    pcap_rec_hdr_t rec_hdr;
+    size_t item_len;
+    uint8_t dummy;
+
+    if (sniff_send_all(sock, &file_hdr, sizeof(file_hdr)) != 0)
+        return;
+
+    // Wall clock if SNTP has set it, the time since boot otherwise
+    gettimeofday(&tv, NULL);
+    int64_t wall_offset_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - esp_timer_get_time();
+
+    sniff.active = 1;
+    while (1) {
+        sniff_item_t* item = xRingbufferReceive(sniff.ring, &item_len, SNIFF_IDLE_MS / portTICK_RATE_MS);
+        if (item == NULL) {
+            // Nothing on the bus, see if the client has hung up
+            if (recv(sock, &dummy, sizeof(dummy), MSG_DONTWAIT) == 0)
+                break;
+            continue;
+        }
+
+        int64_t ts_us = item->ts_us + wall_offset_us;
+        rec_hdr.ts_sec = ts_us / 1000000;
+        rec_hdr.ts_usec = ts_us % 1000000;
+        rec_hdr.incl_len = item_len - offsetof(sniff_item_t, hdr);
+        rec_hdr.orig_len = rec_hdr.incl_len;
+        int ret = sniff_send_all(sock, &rec_hdr, sizeof(rec_hdr));
+        if (ret == 0)
+            ret = sniff_send_all(sock, &item->hdr, rec_hdr.incl_len);
+        vRingbufferReturnItem(sniff.ring, item);
+        if (ret != 0)
+            break;
+    }
+    sniff.active = 0;
+}
+
+static void sniff_server_task(void* param) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(MODBUS_SNIFF_TCP_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    int enable = 1;
+
+    int listener = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listener < 0) {
+        ESP_LOGE(TAG, "Unable to create the socket");
+        goto func_ret;
+    }
+
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0) {
+        ESP_LOGE(TAG, "Unable to listen on port %d", MODBUS_SNIFF_TCP_PORT);
+        goto func_ret;
+    }
+
+    while (1) {
+        int sock = accept(listener, NULL, 0);
+        if (sock < 0)
+            continue;
+
+        if (sniff.ring == NULL)
+            sniff.ring = xRingbufferCreate(MODBUS_SNIFF_RING_LEN, RINGBUF_TYPE_NOSPLIT);
+
+        if (sniff.ring != NULL) {
+            // Discard what was left over from the previous client
+            size_t item_len;
+            void* item;
+            while ((item = xRingbufferReceive(sniff.ring, &item_len, 0)) != NULL)
+                vRingbufferReturnItem(sniff.ring, item);
+
+            ESP_LOGI(TAG, "Capture started");
+            sniff_stream(sock);
+            ESP_LOGI(TAG, "Capture stopped");
+        }
+        close(sock);
+    }
+
+func_ret:
+    if (listener >= 0)
+        close(listener);
+    vTaskDelete(NULL);
+}
+
+void modbus_sniff_server_create() {
+    xTaskCreate(sniff_server_task, "sniff_server", 2048, NULL, 5, NULL);
+}
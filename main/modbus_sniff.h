@@ -0,0 +1,55 @@
+/*
+ * modbus_sniff.h
+ *
+ * RS485 bus capture, streamed to one TCP client at a time in the pcap format:
+ *   nc <gateway> 8502 | wireshark -k -i -
+ * Each packet is a MODBUS_SNIFF_DLT pseudo-header (modbus_sniff_hdr_t) followed by the RTU frame
+ * including its CRC. Frames are only captured while a client is connected.
+ */
+
+#ifndef MAIN_MODBUS_SNIFF_H_
+#define MAIN_MODBUS_SNIFF_H_
+
+#include <stdint.h>
+#include <strings.h>
+
+#define MODBUS_SNIFF_TCP_PORT   8502
+// Frames waiting to be sent to the client, new frames are dropped if the client is too slow
+#define MODBUS_SNIFF_RING_LEN   4096
+// LINKTYPE_USER0
+#define MODBUS_SNIFF_DLT        147
+#define MODBUS_SNIFF_VERSION    1
+
+// What the RTU task does with the bus, config field rtu_sniff
+enum modbus_sniff_mode {
+    MODBUS_SNIFF_OFF = 0,       // Capture the transactions of the gateway only
+    MODBUS_SNIFF_LISTEN,        // Also capture the frames heard between the transactions (e.g. from another master)
+    MODBUS_SNIFF_PASSIVE,       // Never transmit, queued requests are failed, capture everything
+    MODBUS_SNIFF_MODE_MAX
+};
+
+enum modbus_sniff_direction {
+    MODBUS_SNIFF_DIR_REQUEST = 0,   // Sent by the gateway
+    MODBUS_SNIFF_DIR_RESPONSE,      // Received while waiting for the response to the gateway's request
+    MODBUS_SNIFF_DIR_BUS,           // Heard between the transactions of the gateway
+};
+
+#define MODBUS_SNIFF_FLAG_CRC_ERR   (1 << 0)
+#define MODBUS_SNIFF_FLAG_OVERFLOW  (1 << 1)    // Truncated, the Rx buffer or FIFO overflowed
+#define MODBUS_SNIFF_FLAG_DROPPED   (1 << 2)    // Frames before this one were dropped, the client is too slow
+
+// The pseudo-header before each frame, multi-byte fields are big-endian.
+// In Wireshark, add DLT User 147 with header size 8 and payload protocol "mbrtu".
+typedef struct __attribute__((packed)) modbus_sniff_hdr {
+    uint8_t version;            // MODBUS_SNIFF_VERSION
+    uint8_t direction;          // enum modbus_sniff_direction
+    uint8_t flags;              // MODBUS_SNIFF_FLAG_*
+    uint8_t reserved;
+    uint32_t duration_us;       // First character to the end of the frame (end of Tx, or the silent interval detected)
+} modbus_sniff_hdr_t;
+
+void modbus_sniff_server_create();
+// RTU task, start_us and end_us are from metrics_now_us(). No-op unless a client is connected.
+void modbus_sniff_frame(uint8_t direction, uint32_t start_us, uint32_t end_us, const uint8_t* frame, size_t len, int overflow);
+
+#endif /* MAIN_MODBUS_SNIFF_H_ */
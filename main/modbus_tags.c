@@ -0,0 +1,367 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "modbus_tags.h"
+
+static struct modbus_tags {
+    SemaphoreHandle_t mux;
+    size_t count;
+    modbus_tag_t* tags;         // Sorted by uid, fc, addr
+} tags = {0};
+
+static const char *TAG = "Modbus_Tags";
+
+static const char* const tag_type_names[MODBUS_TAG_TYPE_MAX] = {"bit", "u16", "i16", "u32", "i32", "f32"};
+static const char* const tag_order_names[] = {"abcd", "cdab", "badc", "dcba"};
+
+// Source byte of each output byte, most significant first
+static const uint8_t tag_order_perm[][4] = {
+    [MODBUS_TAG_ABCD] = {0, 1, 2, 3},
+    [MODBUS_TAG_CDAB] = {2, 3, 0, 1},
+    [MODBUS_TAG_BADC] = {1, 0, 3, 2},
+    [MODBUS_TAG_DCBA] = {3, 2, 1, 0},
+};
+
+static inline uint8_t tag_reg_count(uint8_t type) {
+    return type >= MODBUS_TAG_U32 ? 2 : 1;
+}
+
+// Copy the next field up to sep (or the end of the list if sep is ';') into buf
+static int tag_parse_field(const char** str, char sep, char* buf, size_t maxlen) {
+    size_t len = strcspn(*str, ",;");
+    if (len == 0 || len >= maxlen)
+        return 0;
+    if ((*str)[len] != sep && !(sep == ';' && (*str)[len] == '\0'))
+        return 0;
+
+    memcpy(buf, *str, len);
+    buf[len] = '\0';
+    *str += len;
+    if (**str != '\0')
+        (*str)++;
+    return 1;
+}
+
+static int tag_parse_type(const char* str, modbus_tag_t* tag) {
+    size_t len = strcspn(str, "_");
+
+    for (tag->type = 0; tag->type < MODBUS_TAG_TYPE_MAX; tag->type++) {
+        if (len == 3 && strncmp(str, tag_type_names[tag->type], 3) == 0)
+            break;
+    }
+    if (tag->type >= MODBUS_TAG_TYPE_MAX)
+        return 0;
+
+    tag->order = MODBUS_TAG_ABCD;
+    if (str[len] == '\0')
+        return 1;
+    if (tag->type == MODBUS_TAG_BIT)
+        return 0;
+    if (tag_reg_count(tag->type) == 1) {
+        // ab and ba are the first halves of abcd and badc
+        if (strcmp(str + len, "_ba") != 0)
+            return 0;
+        tag->order = MODBUS_TAG_BADC;
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(tag_order_names) / sizeof(tag_order_names[0]); i++) {
+        if (strcmp(str + len + 1, tag_order_names[i]) == 0) {
+            tag->order = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int tag_compare(const void* a, const void* b) {
+    const modbus_tag_t* ta = a;
+    const modbus_tag_t* tb = b;
+    if (ta->uid != tb->uid)
+        return ta->uid - tb->uid;
+    if (ta->func_code != tb->func_code)
+        return ta->func_code - tb->func_code;
+    return ta->addr - tb->addr;
+}
+
+static esp_err_t tag_parse_list(const char* list, modbus_tag_t* out, size_t* count) {
+    char field[MODBUS_TAG_NAME_MAXLEN];
+    char* end;
+
+    *count = 0;
+    if (list == NULL)
+        return ESP_OK;
+
+    if (strlen(list) >= MODBUS_TAG_LIST_MAXLEN)
+        return ESP_ERR_INVALID_ARG;
+
+    while (*list != '\0') {
+        if (*count >= MODBUS_TAG_MAX)
+            return ESP_ERR_INVALID_ARG;
+
+        modbus_tag_t* tag = &out[*count];
+        memset(tag, 0, sizeof(modbus_tag_t));
+        tag->scale = 1;
+
+        if (!tag_parse_field(&list, ',', tag->name, sizeof(tag->name)))
+            return ESP_ERR_INVALID_ARG;
+        for (const char* c = tag->name; *c != '\0'; c++) {
+            // Safe to print into JSON and MQTT without escaping
+            if (!isalnum((unsigned char)*c) && *c != '_' && *c != '-' && *c != '.')
+                return ESP_ERR_INVALID_ARG;
+        }
+        for (size_t i = 0; i < *count; i++) {
+            if (strcmp(out[i].name, tag->name) == 0)
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        if (!tag_parse_field(&list, ',', field, sizeof(field)))
+            return ESP_ERR_INVALID_ARG;
+        uint32_t uid = strtoul(field, &end, 10);
+        if (*end != '\0' || uid == 0 || uid > 247)
+            return ESP_ERR_INVALID_ARG;
+        tag->uid = uid;
+
+        if (!tag_parse_field(&list, ',', field, sizeof(field)))
+            return ESP_ERR_INVALID_ARG;
+        uint32_t func_code = strtoul(field, &end, 10);
+        if (*end != '\0' || func_code < 1 || func_code > 4)
+            return ESP_ERR_INVALID_ARG;
+        tag->func_code = func_code;
+
+        if (!tag_parse_field(&list, ',', field, sizeof(field)))
+            return ESP_ERR_INVALID_ARG;
+        uint32_t addr = strtoul(field, &end, 10);
+        if (*end != '\0' || addr > 0xFFFF)
+            return ESP_ERR_INVALID_ARG;
+        tag->addr = addr;
+
+        // The type ends the entry unless a scale follows
+        if (!tag_parse_field(&list, ',', field, sizeof(field)) &&
+            !tag_parse_field(&list, ';', field, sizeof(field)))
+            return ESP_ERR_INVALID_ARG;
+        if (!tag_parse_type(field, tag) || (tag->type == MODBUS_TAG_BIT) != (tag->func_code <= 2) ||
+            addr + tag_reg_count(tag->type) > 0x10000)
+            return ESP_ERR_INVALID_ARG;
+
+        if (list[-1] == ',') {
+            if (!tag_parse_field(&list, ',', field, sizeof(field)) &&
+                !tag_parse_field(&list, ';', field, sizeof(field)))
+                return ESP_ERR_INVALID_ARG;
+            tag->scale = strtof(field, &end);
+            if (*end != '\0')
+                return ESP_ERR_INVALID_ARG;
+
+            if (list[-1] == ',') {
+                if (!tag_parse_field(&list, ',', field, sizeof(field)) &&
+                    !tag_parse_field(&list, ';', field, sizeof(field)))
+                    return ESP_ERR_INVALID_ARG;
+                tag->offset = strtof(field, &end);
+                if (*end != '\0')
+                    return ESP_ERR_INVALID_ARG;
+
+                if (list[-1] == ',') {
+                    if (!tag_parse_field(&list, ';', field, sizeof(field)))
+                        return ESP_ERR_INVALID_ARG;
+                    tag->deadband = strtof(field, &end);
+                    if (*end != '\0' || !(tag->deadband >= 0))
+                        return ESP_ERR_INVALID_ARG;
+                }
+            }
+        }
+
+        (*count)++;
+    }
+
+    qsort(out, *count, sizeof(modbus_tag_t), tag_compare);
+    return ESP_OK;
+}
+
+esp_err_t modbus_tags_check_list(const char* list) {
+    modbus_tag_t* parsed = malloc(sizeof(modbus_tag_t) * MODBUS_TAG_MAX);
+    size_t count;
+    esp_err_t err;
+
+    if (parsed == NULL)
+        return ESP_ERR_NO_MEM;
+
+    err = tag_parse_list(list, parsed, &count);
+    free(parsed);
+    return err;
+}
+
+esp_err_t modbus_tags_set_list(const char* list) {
+    modbus_tag_t* parsed = malloc(sizeof(modbus_tag_t) * MODBUS_TAG_MAX);
+    size_t count;
+    esp_err_t err;
+
+    if (parsed == NULL)
+        return ESP_ERR_NO_MEM;
+
+    err = tag_parse_list(list, parsed, &count);
+    if (err != ESP_OK) {
+        free(parsed);
+        return err;
+    }
+
+    // Keep only what is needed
+    modbus_tag_t* shrunk = count > 0 ? realloc(parsed, sizeof(modbus_tag_t) * count) : NULL;
+    if (shrunk == NULL) {
+        free(parsed);
+        parsed = NULL;
+        count = 0;
+    } else {
+        parsed = shrunk;
+    }
+
+    xSemaphoreTake(tags.mux, portMAX_DELAY);
+    free(tags.tags);
+    tags.tags = parsed;
+    tags.count = count;
+    xSemaphoreGive(tags.mux);
+
+    ESP_LOGI(TAG, "%d tag(s)", count);
+    return ESP_OK;
+}
+
+void modbus_tags_init() {
+    tags.mux = xSemaphoreCreateMutex();
+}
+
+static double tag_decode(const modbus_tag_t* tag, const uint8_t* regs) {
+    const uint8_t* perm = tag_order_perm[tag->order];
+    uint32_t raw = 0;
+    double value;
+
+    if (tag_reg_count(tag->type) == 1) {
+        raw = (regs[perm[0]] << 8) | regs[perm[1]];
+    } else {
+        for (size_t i = 0; i < 4; i++)
+            raw = (raw << 8) | regs[perm[i]];
+    }
+
+    switch (tag->type) {
+    case MODBUS_TAG_I16:
+        value = (int16_t)raw;
+        break;
+    case MODBUS_TAG_I32:
+        value = (int32_t)raw;
+        break;
+    case MODBUS_TAG_F32: {
+        float f;
+        memcpy(&f, &raw, sizeof(f));
+        value = f;
+        break;
+    }
+    default:
+        value = raw;
+        break;
+    }
+
+    return value * tag->scale + tag->offset;
+}
+
+// The value of a tag at offset (in registers or bits) of the block data
+static double tag_value(const modbus_tag_t* tag, const uint8_t* data, uint16_t offset) {
+    if (tag->type == MODBUS_TAG_BIT)
+        return ((data[offset / 8] >> (offset % 8)) & 1) * tag->scale + tag->offset;
+    return tag_decode(tag, data + offset * 2);
+}
+
+// Binary search for the first tag at or after the start of the block, the rest follow in order.
+// Must be protected by tags.mux
+static size_t tag_find_block(const modbus_poll_block_info_t* block) {
+    modbus_tag_t key = {.uid = block->uid, .func_code = block->func_code, .addr = block->addr};
+    size_t lo = 0, hi = tags.count;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (tag_compare(&tags.tags[mid], &key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Whether tag i lies entirely within the block, -1 once past its end. offset is set to its offset in the block
+static int tag_in_block(size_t i, const modbus_poll_block_info_t* block, uint16_t* offset) {
+    const modbus_tag_t* tag = &tags.tags[i];
+    if (tag->uid != block->uid || tag->func_code != block->func_code ||
+        tag->addr >= block->addr + block->count)
+        return -1;
+
+    *offset = tag->addr - block->addr;
+    return *offset + tag_reg_count(tag->type) <= block->count;
+}
+
+size_t modbus_tags_decode_block(const modbus_poll_block_info_t* block, const uint8_t* data,
+                                modbus_tag_value_t* values, size_t max_count) {
+    size_t count = 0;
+    uint16_t offset;
+    int in_block;
+
+    xSemaphoreTake(tags.mux, portMAX_DELAY);
+    for (size_t i = tag_find_block(block); i < tags.count && count < max_count; i++) {
+        if ((in_block = tag_in_block(i, block, &offset)) < 0)
+            break;
+        if (!in_block)
+            continue;
+
+        const modbus_tag_t* tag = &tags.tags[i];
+        modbus_tag_value_t* out = &values[count++];
+        memcpy(out->name, tag->name, sizeof(out->name));
+        out->value = tag_value(tag, data, offset);
+        out->digits = tag->type == MODBUS_TAG_F32 || tag->scale != 1 || tag->offset != 0 ? 7 : 15;
+    }
+    xSemaphoreGive(tags.mux);
+
+    return count;
+}
+
+int modbus_tags_block_changed(const modbus_poll_block_info_t* block, const uint8_t* old, const uint8_t* data) {
+    // Bit n is set if register n of the block is part of a tag
+    uint8_t covered[(MODBUS_POLL_DATA_MAXLEN / 2 + 7) / 8] = {0};
+    int changed = 0;
+    uint16_t offset;
+    int in_block;
+
+    if (block->func_code <= 2)
+        return memcmp(old, data, block->data_len) != 0;
+
+    xSemaphoreTake(tags.mux, portMAX_DELAY);
+    for (size_t i = tag_find_block(block); i < tags.count && !changed; i++) {
+        if ((in_block = tag_in_block(i, block, &offset)) < 0)
+            break;
+        if (!in_block)
+            continue;
+
+        const modbus_tag_t* tag = &tags.tags[i];
+        for (uint16_t reg = offset; reg < offset + tag_reg_count(tag->type); reg++)
+            covered[reg / 8] |= 1 << (reg % 8);
+
+        // Compared in engineering units, a NaN (e.g. a sensor fault) appearing or going away is a change
+        double before = tag_value(tag, old, offset);
+        double after = tag_value(tag, data, offset);
+        if (before != before || after != after) {
+            changed = (before != before) != (after != after);
+        } else {
+            double diff = after > before ? after - before : before - after;
+            changed = diff > tag->deadband;
+        }
+    }
+    xSemaphoreGive(tags.mux);
+
+    for (uint16_t reg = 0; reg < block->count && !changed; reg++) {
+        if (!(covered[reg / 8] & (1 << (reg % 8))))
+            changed = old[reg * 2] != data[reg * 2] || old[reg * 2 + 1] != data[reg * 2 + 1];
+    }
+    return changed;
+}
@@ -0,0 +1,82 @@
+/*
+ * modbus_tags.h
+ *
+ * Typed tags over the register image: the tag list maps registers of the poll blocks to
+ * named values with a data type, a byte/word order, a scale and an offset. A whole block is
+ * decoded in one pass, for the /tags page and the MQTT publisher.
+ *
+ * The tag list is a string like "name,uid,fc,addr,type[,scale[,offset[,deadband]]];...", e.g.
+ * "temp,1,4,0,i16,0.1,0,0.5;energy,1,3,10,u32_cdab;running,2,1,5,bit". The value is raw * scale + offset.
+ * The deadband, in the same units as the value, is the change that the MQTT publisher reports, 0 by default.
+ * Types are bit (FC01, FC02), u16, i16, u32, i32 and f32 (FC03, FC04). The 32-bit types take two
+ * registers, high word first (_abcd, the default), or with the suffix _cdab (words swapped),
+ * _badc (bytes swapped) or _dcba (both). The 16-bit types accept _ba for swapped bytes.
+ */
+
+#ifndef MAIN_MODBUS_TAGS_H_
+#define MAIN_MODBUS_TAGS_H_
+
+#include <stdint.h>
+#include <strings.h>
+#include "esp_err.h"
+
+#include "modbus_poller.h"
+
+#define MODBUS_TAG_MAX              32
+// Including the null terminator
+#define MODBUS_TAG_NAME_MAXLEN      16
+#define MODBUS_TAG_LIST_MAXLEN      256         // Same as MODBUS_POLL_LIST_MAXLEN
+
+enum modbus_tag_type {
+    MODBUS_TAG_BIT = 0,
+    MODBUS_TAG_U16,
+    MODBUS_TAG_I16,
+    MODBUS_TAG_U32,
+    MODBUS_TAG_I32,
+    MODBUS_TAG_F32,
+    MODBUS_TAG_TYPE_MAX
+};
+
+// Byte order of a value on the wire, A is the most significant byte
+enum modbus_tag_order {
+    MODBUS_TAG_ABCD = 0,
+    MODBUS_TAG_CDAB,
+    MODBUS_TAG_BADC,
+    MODBUS_TAG_DCBA,
+};
+
+typedef struct modbus_tag {
+    char name[MODBUS_TAG_NAME_MAXLEN];
+    uint8_t uid;
+    uint8_t func_code;
+    uint16_t addr;
+    uint8_t type;               // enum modbus_tag_type
+    uint8_t order;              // enum modbus_tag_order
+    float scale;
+    float offset;
+    float deadband;
+} modbus_tag_t;
+
+// An output of modbus_tags_decode_block()
+typedef struct modbus_tag_value {
+    char name[MODBUS_TAG_NAME_MAXLEN];
+    double value;
+    uint8_t digits;             // Significant digits worth printing, 7 for f32
+} modbus_tag_value_t;
+
+void modbus_tags_init();
+// Check the syntax and limits of a tag list without applying it.
+esp_err_t modbus_tags_check_list(const char* list);
+// Replace the tag list, returns ESP_ERR_INVALID_ARG without changing anything if the list is malformed.
+esp_err_t modbus_tags_set_list(const char* list);
+
+// Decode the tags that lie entirely within a poll block (see modbus_poller_get_block()) into values,
+// in address order. Returns the number of values, at most max_count.
+size_t modbus_tags_decode_block(const modbus_poll_block_info_t* block, const uint8_t* data,
+                                modbus_tag_value_t* values, size_t max_count);
+
+// Whether the data of a block has changed from old by more than the deadbands: a tag whose value has
+// moved by more than its deadband, or any change of a register that is not part of a tag, coil or input.
+int modbus_tags_block_changed(const modbus_poll_block_info_t* block, const uint8_t* old, const uint8_t* data);
+
+#endif /* MAIN_MODBUS_TAGS_H_ */
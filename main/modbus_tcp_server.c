@@ -15,6 +15,7 @@
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
 
+#include "modbus_metrics.h"
 #include "modbus_tcp_server.h"
 #include "main.h"
 
@@ -206,6 +207,7 @@ static void tcp_server_ip4_new_conn(const tcp_server_config_t* cfg, int clientSo
     char addr_str[16];
     inet_ntoa_r(clientAddr.sin_addr, addr_str, sizeof(addr_str) - 1);
     TCPSVR_LOGI("New connection from %s on socket %d", addr_str, clientSocket);
+    metrics_tcp_client_open(clientSocket, addr_str);
 }
 
 static void tcp_server_ip6_new_conn(const tcp_server_config_t* cfg, int clientSocket) {
@@ -215,10 +217,12 @@ static void tcp_server_ip6_new_conn(const tcp_server_config_t* cfg, int clientSo
     char addr_str[40];
     inet6_ntoa_r(clientAddr.sin6_addr, addr_str, sizeof(addr_str) - 1);
     TCPSVR_LOGI("New connection from %s on socket %d", addr_str, clientSocket);
+    metrics_tcp_client_open(clientSocket, addr_str);
 }
 
 static void tcp_server_conn_down(const tcp_server_config_t* cfg, int clientSocket) {
     TCPSVR_LOGI("Socket %d hung up", clientSocket);
+    metrics_tcp_client_close(clientSocket);
 }
 
 static void tcp_server_ip4_init(tcp_server_config_t* cfg) {
@@ -0,0 +1,99 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "modbus.h"
+#include "modbus_metrics.h"
+#include "modbus_trace.h"
+
+static struct modbus_trace {
+    modbus_trace_rec_t recs[MODBUS_TRACE_LEN];
+    uint32_t seq;               // Number of records ever added, the next one goes to recs[seq % MODBUS_TRACE_LEN]
+} trace = {0};
+
+static const char* const trace_origin_names[] = {"tcp", "poller", "http", "ws"};
+static const char* const trace_result_names[] = {"ok", "timeout", "bad_frame", "broadcast"};
+_Static_assert(sizeof(trace_origin_names) / sizeof(trace_origin_names[0]) == RTU_ORIGIN_COUNT,
+               "trace_origin_names must match enum rtu_origin");
+_Static_assert(sizeof(trace_result_names) / sizeof(trace_result_names[0]) == MODBUS_TRACE_RESULT_COUNT,
+               "trace_result_names must match enum modbus_trace_result");
+
+void modbus_trace_add(const modbus_trace_rec_t* rec) {
+    // The reader copies a record with the scheduler suspended as well, so it never sees a torn one
+    vTaskSuspendAll();
+    memcpy(&trace.recs[trace.seq % MODBUS_TRACE_LEN], rec, sizeof(modbus_trace_rec_t));
+    trace.seq++;
+    xTaskResumeAll();
+}
+
+// Copy the record seq, fails if it has been overwritten meanwhile
+static int trace_get(uint32_t seq, modbus_trace_rec_t* rec) {
+    int ret = 0;
+
+    vTaskSuspendAll();
+    if (trace.seq - seq <= MODBUS_TRACE_LEN) {
+        memcpy(rec, &trace.recs[seq % MODBUS_TRACE_LEN], sizeof(modbus_trace_rec_t));
+        ret = 1;
+    }
+    xTaskResumeAll();
+
+    return ret;
+}
+
+static const char* trace_name(const char* const* names, size_t count, uint8_t idx) {
+    return idx < count ? names[idx] : "unknown";
+}
+
+// Durations of the stages, from the time stamps
+static void trace_write_rec(json_writer_t* jw, uint32_t seq, const modbus_trace_rec_t* rec) {
+    jw_object_begin(jw, NULL);
+    jw_uint(jw, "seq", seq);
+    jw_uint(jw, "t_us", rec->enqueue_us);
+    jw_uint(jw, "tid", rec->transaction_id);
+    jw_uint(jw, "uid", rec->uid);
+    jw_uint(jw, "fc", rec->func_code);
+    jw_string(jw, "origin", trace_name(trace_origin_names,
+            sizeof(trace_origin_names)/sizeof(trace_origin_names[0]), rec->origin));
+    jw_uint(jw, "retry", rec->retry);
+    jw_string(jw, "result", trace_name(trace_result_names,
+            sizeof(trace_result_names)/sizeof(trace_result_names[0]), rec->result));
+
+    jw_uint(jw, "queue_us", rec->dequeue_us - rec->enqueue_us);
+    jw_uint(jw, "setup_us", rec->tx_start_us - rec->dequeue_us);
+    jw_uint(jw, "tx_us", rec->tx_end_us - rec->tx_start_us);
+    if (rec->rx_start_us != 0) {
+        // rx_start_us is back-dated from the first Rx interrupt, never let it go before the end of Tx
+        int32_t think = rec->rx_start_us - rec->tx_end_us;
+        if (think < 0)
+            think = 0;
+        jw_uint(jw, "think_us", think);
+        jw_uint(jw, "rx_us", rec->rx_end_us - rec->tx_end_us - think);
+    } else {
+        // Timeout or broadcast, nothing received
+        jw_uint(jw, "wait_us", rec->rx_end_us - rec->tx_end_us);
+    }
+    jw_uint(jw, "deliver_us", rec->done_us - rec->rx_end_us);
+    jw_uint(jw, "total_us", rec->done_us - rec->enqueue_us);
+    jw_object_end(jw);
+}
+
+esp_err_t modbus_trace_write_json(json_writer_t* jw) {
+    modbus_trace_rec_t rec;
+    uint32_t seq_end = trace.seq;
+    uint32_t seq = seq_end > MODBUS_TRACE_LEN ? seq_end - MODBUS_TRACE_LEN : 0;
+
+    jw_object_begin(jw, NULL);
+    jw_uint(jw, "now_us", metrics_now_us());
+    jw_uint(jw, "seq", seq_end);
+    jw_array_begin(jw, "records");
+    for (; seq < seq_end; seq++) {
+        // Skip the ones overwritten while the response is being sent
+        if (trace_get(seq, &rec))
+            trace_write_rec(jw, seq, &rec);
+    }
+    jw_array_end(jw);
+    jw_object_end(jw);
+
+    return jw->err;
+}
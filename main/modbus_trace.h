@@ -0,0 +1,51 @@
+/*
+ * modbus_trace.h
+ *
+ * Per-transaction latency trace of the RTU bus. Every request taken from tx_fifo
+ * leaves one record with the time stamps of its stages in a fixed-size ring,
+ * the most recent records can be dumped over HTTP (GET /trace).
+ *
+ * The RTU task is the only writer, the time stamps are from metrics_now_us().
+ */
+
+#ifndef MAIN_MODBUS_TRACE_H_
+#define MAIN_MODBUS_TRACE_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#include "json_writer.h"
+
+// Number of records kept, older ones are overwritten
+#define MODBUS_TRACE_LEN    32
+
+enum modbus_trace_result {
+    MODBUS_TRACE_OK = 0,
+    MODBUS_TRACE_TIMEOUT,
+    MODBUS_TRACE_BAD_FRAME,     // Bad CRC, too short, from another UID or overflow
+    MODBUS_TRACE_BROADCAST,     // No response expected
+    MODBUS_TRACE_RESULT_COUNT
+};
+
+typedef struct modbus_trace_rec {
+    uint32_t enqueue_us;        // Queued into tx_fifo by modbus_uart_queue_send(), or by a retry
+    uint32_t dequeue_us;        // Taken from tx_fifo by the RTU task
+    uint32_t tx_start_us;       // DE set up, the first byte pushed into the UART
+    uint32_t tx_end_us;         // The last character left the shift register, DE released
+    uint32_t rx_start_us;       // The first byte of the response, 0 if nothing was received
+    uint32_t rx_end_us;         // Silent interval detected, or the Rx timeout expired
+    uint32_t done_us;           // Response delivered (send() returned for TCP), or given up
+    uint16_t transaction_id;
+    uint8_t uid;
+    uint8_t func_code;
+    uint8_t origin;             // enum rtu_origin
+    uint8_t retry;
+    uint8_t result;             // enum modbus_trace_result
+} modbus_trace_rec_t;
+
+// RTU task, copy a completed record into the ring
+void modbus_trace_add(const modbus_trace_rec_t* rec);
+// Write the records still in the ring as a JSON object, oldest first
+esp_err_t modbus_trace_write_json(json_writer_t* jw);
+
+#endif /* MAIN_MODBUS_TRACE_H_ */
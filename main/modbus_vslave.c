@@ -0,0 +1,212 @@
+#include <string.h>
+
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "driver/gpio.h"
+
+#include "modbus.h"
+#include "modbus_metrics.h"
+#include "modbus_poller.h"
+#include "modbus_vslave.h"
+
+#define VSLAVE_GPIO_COUNT   17
+
+static volatile uint8_t vslave_uid = MODBUS_VSLAVE_UID_DEFAULT;
+
+// FC08 counters are reported relative to the totals at the last clear, so clearing
+// them leaves the Prometheus counters monotonic
+static struct vslave_diag {
+    metrics_totals_t base;
+    uint32_t slave_messages;    // Requests answered by the virtual slave, approximate if clients race
+} diag = {0};
+
+void modbus_vslave_set_uid(uint8_t uid) {
+    vslave_uid = uid;
+}
+
+static void vslave_put_u32(uint16_t* regs, enum modbus_vslave_reg reg, uint32_t value) {
+    regs[reg] = value >> 16;
+    regs[reg + 1] = value & 0xFFFF;
+}
+
+// Snapshot of the gateway status, built on each request since the TCP server tasks may call in concurrently
+static void vslave_fill_regs(uint16_t* regs) {
+    metrics_totals_t totals;
+    modbus_poller_stats_t poll_stats;
+    wifi_ap_record_t ap_info;
+
+    memset(regs, 0, VSLAVE_REG_COUNT * sizeof(uint16_t));
+    regs[VSLAVE_REG_MAP_VERSION] = MODBUS_VSLAVE_MAP_VERSION;
+    vslave_put_u32(regs, VSLAVE_REG_UPTIME_S, esp_timer_get_time() / 1000000);
+    vslave_put_u32(regs, VSLAVE_REG_HEAP_FREE, esp_get_free_heap_size());
+    vslave_put_u32(regs, VSLAVE_REG_HEAP_MIN_FREE, esp_get_minimum_free_heap_size());
+
+    for (int gpio = 0; gpio < VSLAVE_GPIO_COUNT; gpio++) {
+        if (gpio_get_level(gpio))
+            regs[VSLAVE_REG_GPIO_IN + gpio / 16] |= 1 << (gpio % 16);
+    }
+
+    metrics_get_totals(&totals);
+    regs[VSLAVE_REG_TCP_CLIENTS] = totals.tcp_clients;
+    vslave_put_u32(regs, VSLAVE_REG_RTU_REQUESTS, totals.rtu_requests);
+    vslave_put_u32(regs, VSLAVE_REG_RTU_RESPONSES, totals.rtu_responses);
+    vslave_put_u32(regs, VSLAVE_REG_RTU_TIMEOUTS, totals.rtu_timeouts);
+    vslave_put_u32(regs, VSLAVE_REG_RTU_CRC_ERRORS, totals.rtu_crc_errors);
+    vslave_put_u32(regs, VSLAVE_REG_RTU_RETRIES, totals.rtu_retries);
+    vslave_put_u32(regs, VSLAVE_REG_RTU_BROADCASTS, totals.rtu_broadcasts);
+    vslave_put_u32(regs, VSLAVE_REG_RTU_RX_OVERFLOWS, totals.rtu_rx_overflows);
+
+    modbus_poller_get_stats(&poll_stats);
+    regs[VSLAVE_REG_POLL_BLOCKS] = poll_stats.block_count;
+    regs[VSLAVE_REG_POLL_BUS_LOAD] = poll_stats.bus_load_permille > 0xFFFF ? 0xFFFF : poll_stats.bus_load_permille;
+    vslave_put_u32(regs, VSLAVE_REG_POLL_DEADLINE_MISS, poll_stats.deadline_miss);
+
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK)
+        regs[VSLAVE_REG_WIFI_RSSI] = (uint16_t)(int16_t)ap_info.rssi;
+}
+
+static size_t vslave_exception(const uint8_t* pdu, uint8_t code, uint8_t* resp) {
+    uint8_t* resp_pdu = resp + MODBUS_TCP_PAYLOAD_OFFSET;
+    resp_pdu[0] = pdu[0];
+    resp_pdu[1] = pdu[1] | 0x80;
+    resp_pdu[2] = code;
+    return MODBUS_TCP_PAYLOAD_OFFSET + 3;
+}
+
+// FC03 and FC04, uid, fc, addr, count
+static size_t vslave_read_regs(const uint8_t* pdu, size_t pdu_len, uint8_t* resp, size_t resp_maxlen) {
+    uint16_t regs[VSLAVE_REG_COUNT];
+
+    if (pdu_len != 6)
+        return vslave_exception(pdu, MODBUS_EXC_ILLEGAL_VALUE, resp);
+
+    uint16_t addr = (pdu[2] << 8) | pdu[3];
+    uint16_t count = (pdu[4] << 8) | pdu[5];
+    if (count == 0 || count > 125 || MODBUS_TCP_PAYLOAD_OFFSET + 3 + count * 2 > resp_maxlen)
+        return vslave_exception(pdu, MODBUS_EXC_ILLEGAL_VALUE, resp);
+    if (addr + count > VSLAVE_REG_COUNT)
+        return vslave_exception(pdu, MODBUS_EXC_ILLEGAL_ADDRESS, resp);
+
+    vslave_fill_regs(regs);
+
+    uint8_t* resp_pdu = resp + MODBUS_TCP_PAYLOAD_OFFSET;
+    resp_pdu[0] = pdu[0];
+    resp_pdu[1] = pdu[1];
+    resp_pdu[2] = count * 2;
+    for (uint16_t i = 0; i < count; i++) {
+        resp_pdu[3 + i * 2] = regs[addr + i] >> 8;
+        resp_pdu[4 + i * 2] = regs[addr + i] & 0xFF;
+    }
+    return MODBUS_TCP_PAYLOAD_OFFSET + 3 + count * 2;
+}
+
+// FC08, uid, fc, sub-function, data
+static size_t vslave_diagnostics(const uint8_t* pdu, size_t pdu_len, uint8_t* resp, size_t resp_maxlen) {
+    metrics_totals_t totals;
+    uint16_t value;
+
+    if (pdu_len < 6)
+        return vslave_exception(pdu, MODBUS_EXC_ILLEGAL_VALUE, resp);
+
+    uint16_t sub_func = (pdu[2] << 8) | pdu[3];
+    uint8_t* resp_pdu = resp + MODBUS_TCP_PAYLOAD_OFFSET;
+
+    if (sub_func == MODBUS_DIAG_RETURN_QUERY_DATA) {
+        if (MODBUS_TCP_PAYLOAD_OFFSET + pdu_len > resp_maxlen)
+            return vslave_exception(pdu, MODBUS_EXC_ILLEGAL_VALUE, resp);
+        memcpy(resp_pdu, pdu, pdu_len);
+        return MODBUS_TCP_PAYLOAD_OFFSET + pdu_len;
+    }
+
+    // The counter sub-functions take a single data word of 0
+    if (pdu_len != 6 || pdu[4] != 0 || pdu[5] != 0)
+        return vslave_exception(pdu, MODBUS_EXC_ILLEGAL_VALUE, resp);
+
+    metrics_get_totals(&totals);
+    switch (sub_func) {
+    case MODBUS_DIAG_CLEAR_COUNTERS:
+        diag.base = totals;
+        diag.slave_messages = 0;
+        value = 0;
+        break;
+    case MODBUS_DIAG_CLEAR_OVERRUN:
+        diag.base.rtu_rx_overflows = totals.rtu_rx_overflows;
+        value = 0;
+        break;
+    case MODBUS_DIAG_BUS_MESSAGE_COUNT:
+        // Both directions of each transaction seen on the bus
+        value = (totals.rtu_requests - diag.base.rtu_requests) + (totals.rtu_responses - diag.base.rtu_responses);
+        break;
+    case MODBUS_DIAG_BUS_COMM_ERROR_COUNT:
+        value = totals.rtu_crc_errors - diag.base.rtu_crc_errors;
+        break;
+    case MODBUS_DIAG_BUS_EXCEPTION_COUNT:
+        value = totals.rtu_exceptions - diag.base.rtu_exceptions;
+        break;
+    case MODBUS_DIAG_SLAVE_MESSAGE_COUNT:
+        value = diag.slave_messages;
+        break;
+    case MODBUS_DIAG_SLAVE_NO_RESPONSE_COUNT:
+        value = totals.rtu_timeouts - diag.base.rtu_timeouts;
+        break;
+    case MODBUS_DIAG_SLAVE_NAK_COUNT:
+    case MODBUS_DIAG_SLAVE_BUSY_COUNT:
+        // The virtual slave never answers with these
+        value = 0;
+        break;
+    case MODBUS_DIAG_BUS_CHAR_OVERRUN_COUNT:
+        value = totals.rtu_rx_overflows - diag.base.rtu_rx_overflows;
+        break;
+    default:
+        return vslave_exception(pdu, MODBUS_EXC_ILLEGAL_FUNCTION, resp);
+    }
+
+    resp_pdu[0] = pdu[0];
+    resp_pdu[1] = pdu[1];
+    resp_pdu[2] = pdu[2];
+    resp_pdu[3] = pdu[3];
+    resp_pdu[4] = value >> 8;
+    resp_pdu[5] = value & 0xFF;
+    return MODBUS_TCP_PAYLOAD_OFFSET + 6;
+}
+
+// FC11, uid, fc. The event count is the number of completed bus transactions
+static size_t vslave_comm_event_counter(const uint8_t* pdu, size_t pdu_len, uint8_t* resp) {
+    metrics_totals_t totals;
+
+    if (pdu_len != 2)
+        return vslave_exception(pdu, MODBUS_EXC_ILLEGAL_VALUE, resp);
+
+    metrics_get_totals(&totals);
+    uint16_t events = totals.rtu_responses + totals.rtu_broadcasts;
+
+    uint8_t* resp_pdu = resp + MODBUS_TCP_PAYLOAD_OFFSET;
+    resp_pdu[0] = pdu[0];
+    resp_pdu[1] = pdu[1];
+    resp_pdu[2] = 0;            // Status, never busy
+    resp_pdu[3] = 0;
+    resp_pdu[4] = events >> 8;
+    resp_pdu[5] = events & 0xFF;
+    return MODBUS_TCP_PAYLOAD_OFFSET + 6;
+}
+
+size_t modbus_vslave_handle(const uint8_t* pdu, size_t pdu_len, uint8_t* resp, size_t resp_maxlen) {
+    uint8_t uid = vslave_uid;
+
+    if (uid == 0 || pdu_len < 2 || pdu[0] != uid || resp_maxlen < MODBUS_TCP_PAYLOAD_OFFSET + 3)
+        return 0;
+
+    diag.slave_messages++;
+    switch (pdu[1]) {
+    case 3:
+    case 4:
+        return vslave_read_regs(pdu, pdu_len, resp, resp_maxlen);
+    case 8:
+        return vslave_diagnostics(pdu, pdu_len, resp, resp_maxlen);
+    case 11:
+        return vslave_comm_event_counter(pdu, pdu_len, resp);
+    default:
+        return vslave_exception(pdu, MODBUS_EXC_ILLEGAL_FUNCTION, resp);
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ * modbus_vslave.h
+ *
+ * The gateway's own virtual slave: requests to its UID are answered by the TCP server task
+ * from the gateway status, they never enter tx_fifo or touch the RS485 bus.
+ *
+ * Its input registers (FC04, also readable as holding registers with FC03) are listed in
+ * enum modbus_vslave_reg. They are read-only, 32-bit values take two registers, the high word first.
+ *
+ * FC08 (diagnostics) reports the bus counters of the RTU engine, the sub-functions are listed in
+ * enum modbus_diag_sub_func. FC11 (get comm event counter) counts the completed bus transactions.
+ */
+
+#ifndef MAIN_MODBUS_VSLAVE_H_
+#define MAIN_MODBUS_VSLAVE_H_
+
+#include <stdint.h>
+#include <strings.h>
+
+// 0 disables the virtual slave
+#define MODBUS_VSLAVE_UID_DEFAULT   0
+#define MODBUS_VSLAVE_UID_MAX       247
+#define MODBUS_VSLAVE_MAP_VERSION   1
+
+enum modbus_vslave_reg {
+    VSLAVE_REG_MAP_VERSION = 0,     // MODBUS_VSLAVE_MAP_VERSION
+    VSLAVE_REG_UPTIME_S = 1,        // 32-bit
+    VSLAVE_REG_HEAP_FREE = 3,       // 32-bit, bytes
+    VSLAVE_REG_HEAP_MIN_FREE = 5,   // 32-bit, bytes, the lowest since boot
+    VSLAVE_REG_GPIO_IN = 7,         // Bit n is the level of GPIOn, GPIO0~GPIO15
+    VSLAVE_REG_GPIO16_IN = 8,       // Bit 0 is the level of GPIO16
+    VSLAVE_REG_TCP_CLIENTS = 9,
+    VSLAVE_REG_RTU_REQUESTS = 10,   // 32-bit, including retries
+    VSLAVE_REG_RTU_RESPONSES = 12,  // 32-bit
+    VSLAVE_REG_RTU_TIMEOUTS = 14,   // 32-bit
+    VSLAVE_REG_RTU_CRC_ERRORS = 16, // 32-bit
+    VSLAVE_REG_RTU_RETRIES = 18,    // 32-bit
+    VSLAVE_REG_RTU_BROADCASTS = 20, // 32-bit
+    VSLAVE_REG_RTU_RX_OVERFLOWS = 22,   // 32-bit
+    VSLAVE_REG_POLL_BLOCKS = 24,
+    VSLAVE_REG_POLL_BUS_LOAD = 25,  // Permille of the bus time
+    VSLAVE_REG_POLL_DEADLINE_MISS = 26, // 32-bit
+    VSLAVE_REG_WIFI_RSSI = 28,      // Signed dBm, 0 if the station is not connected
+    VSLAVE_REG_COUNT
+};
+
+// FC08 sub-functions, counters are 16-bit and wrap around
+enum modbus_diag_sub_func {
+    MODBUS_DIAG_RETURN_QUERY_DATA = 0x00,
+    MODBUS_DIAG_CLEAR_COUNTERS = 0x0A,
+    MODBUS_DIAG_BUS_MESSAGE_COUNT = 0x0B,       // Requests and responses on the bus
+    MODBUS_DIAG_BUS_COMM_ERROR_COUNT = 0x0C,    // CRC errors
+    MODBUS_DIAG_BUS_EXCEPTION_COUNT = 0x0D,     // Exception responses from the slaves
+    MODBUS_DIAG_SLAVE_MESSAGE_COUNT = 0x0E,     // Requests to the virtual slave
+    MODBUS_DIAG_SLAVE_NO_RESPONSE_COUNT = 0x0F, // Bus timeouts
+    MODBUS_DIAG_SLAVE_NAK_COUNT = 0x10,         // Always 0
+    MODBUS_DIAG_SLAVE_BUSY_COUNT = 0x11,        // Always 0
+    MODBUS_DIAG_BUS_CHAR_OVERRUN_COUNT = 0x12,  // Rx buffer overflows
+    MODBUS_DIAG_CLEAR_OVERRUN = 0x14,
+};
+
+void modbus_vslave_set_uid(uint8_t uid);
+
+// Answer a request (uid, fc, ...) if it is addressed to the virtual slave, same convention as
+// modbus_poller_read_image(): the response is placed at resp+MODBUS_TCP_PAYLOAD_OFFSET and the total
+// length is returned. Returns 0 if the request is for another UID.
+size_t modbus_vslave_handle(const uint8_t* pdu, size_t pdu_len, uint8_t* resp, size_t resp_maxlen);
+
+#endif /* MAIN_MODBUS_VSLAVE_H_ */
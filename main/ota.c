@@ -13,28 +13,144 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_netif.h"
 #include "esp_event.h"
 #include "esp_err.h"
+#include "esp_spi_flash.h"
 #include "tcpip_adapter.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "esp_ota_ops.h"
 
 #include "ota.h"
+#include "ota_decomp.h"
+#include "ota_patch.h"
+
+// The image is received into one sector-sized buffer while the writer task flashes the other
+#define OTA_BUF_LEN                 SPI_FLASH_SEC_SIZE
+#define OTA_BUF_COUNT               2
+#define OTA_PROGRESS_INTERVAL_MS    2000
+// Compressed input is received into a buffer of its own, the sector buffers take the output
+#define OTA_PACK_IN_LEN             1024
+
+// Known from the first bytes of the upload
+enum ota_format {
+    OTA_FORMAT_UNKNOWN = 0,
+    OTA_FORMAT_RAW,             // A plain image, written as is
+    OTA_FORMAT_PACKED,          // See ota_decomp.h
+    OTA_FORMAT_DELTA,           // A packed patch against the running image, see ota_patch.h
+};
+
+typedef struct ota_buf {
+    uint8_t* data;              // NULL stops the writer task
+    size_t len;
+} ota_buf_t;
 
 // OTA states, protected by ota_mutex
 static SemaphoreHandle_t ota_mutex;
 static size_t blob_len = 0;
-static size_t written = 0;
+static size_t received = 0;
 static const esp_partition_t *update_partition = NULL;
 /* update handle : set by esp_ota_begin(), must be freed via esp_ota_end() */
 static esp_ota_handle_t update_handle = 0 ;
 
+// Buffers in flight between the receiver and the writer task
+static struct ota_writer {
+    uint8_t* mem;               // OTA_BUF_COUNT buffers
+    QueueHandle_t free_bufs;    // To be filled by the receiver
+    QueueHandle_t full_bufs;    // To be flashed by the writer task
+    SemaphoreHandle_t done;     // Given when the writer task exits
+    ota_buf_t fill;             // Being filled, data is NULL if none is taken yet
+    volatile esp_err_t err;     // The first esp_ota_write() failure
+    size_t written;             // Writer task only
+    TickType_t progress_tick;
+} writer = {0};
+
+static struct ota_upload {
+    uint8_t format;             // enum ota_format, esp_ota_begin() has been called unless it is unknown
+    uint8_t hdr[OTA_PACK_HDR_MAXLEN];
+    size_t hdr_len;
+    size_t hdr_want;            // Bytes of the header to receive before the format is known
+    uint8_t* pack_in;           // OTA_PACK_IN_LEN, packed uploads only
+    ota_decomp_t decomp;
+    ota_patch_t* patch;         // Delta uploads only
+    size_t image_len;
+} upload = {0};
+
 static const char *TAG = "OTA";
 
+static void ota_writer_task(void* param) {
+    ota_buf_t buf;
+
+    while (xQueueReceive(writer.full_bufs, &buf, portMAX_DELAY) == pdTRUE && buf.data != NULL) {
+        // After a failure the buffers are only drained, the receiver sees writer.err
+        if (writer.err == ESP_OK) {
+            esp_err_t err = esp_ota_write(update_handle, buf.data, buf.len);
+            if (err == ESP_OK) {
+                writer.written += buf.len;
+            } else {
+                // Fatal error
+                ESP_LOGE(TAG, "Error: esp_ota_write failed! err=0x%x", err);
+                writer.err = err;
+            }
+        }
+        xQueueSend(writer.free_bufs, &buf, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(writer.done);
+    vTaskDelete(NULL);
+}
+
+static void ota_writer_free() {
+    if (writer.free_bufs != NULL)
+        vQueueDelete(writer.free_bufs);
+    if (writer.full_bufs != NULL)
+        vQueueDelete(writer.full_bufs);
+    if (writer.done != NULL)
+        vSemaphoreDelete(writer.done);
+    free(writer.mem);
+    memset(&writer, 0, sizeof(writer));
+}
+
+static esp_err_t ota_writer_start() {
+    memset(&writer, 0, sizeof(writer));
+    writer.mem = malloc(OTA_BUF_LEN * OTA_BUF_COUNT);
+    writer.free_bufs = xQueueCreate(OTA_BUF_COUNT, sizeof(ota_buf_t));
+    // One more for the stop request
+    writer.full_bufs = xQueueCreate(OTA_BUF_COUNT + 1, sizeof(ota_buf_t));
+    writer.done = xSemaphoreCreateBinary();
+    if (writer.mem == NULL || writer.free_bufs == NULL || writer.full_bufs == NULL || writer.done == NULL)
+        goto fail;
+
+    for (size_t i = 0; i < OTA_BUF_COUNT; i++) {
+        ota_buf_t buf = {.data = writer.mem + i * OTA_BUF_LEN, .len = 0};
+        xQueueSend(writer.free_bufs, &buf, 0);
+    }
+
+    // Same priority as the caller, so the two take turns whenever one blocks
+    if (xTaskCreate(ota_writer_task, "ota_writer", 2048, NULL, uxTaskPriorityGet(NULL), NULL) != pdPASS)
+        goto fail;
+
+    writer.progress_tick = xTaskGetTickCount();
+    return ESP_OK;
+
+fail:
+    ota_writer_free();
+    return ESP_ERR_NO_MEM;
+}
+
+// Wait for the writer task to flash what it has been given and exit
+static void ota_writer_stop() {
+    ota_buf_t stop = {.data = NULL, .len = 0};
+
+    xQueueSend(writer.full_bufs, &stop, portMAX_DELAY);
+    xSemaphoreTake(writer.done, portMAX_DELAY);
+}
+
 esp_err_t ota_esp_begin(size_t blob_len_param) {
     if (ota_mutex == NULL) {
         ota_mutex = xSemaphoreCreateMutex();
@@ -43,7 +159,9 @@ esp_err_t ota_esp_begin(size_t blob_len_param) {
 
     xSemaphoreTake(ota_mutex, portMAX_DELAY);
     blob_len = blob_len_param;
-    written = 0;
+    received = 0;
+    memset(&upload, 0, sizeof(upload));
+    upload.hdr_want = OTA_PACK_HDR_LEN;
 
     ESP_LOGI(TAG, "Starting OTA, flash size: %s", CONFIG_ESPTOOLPY_FLASHSIZE);
 
@@ -63,34 +181,244 @@ esp_err_t ota_esp_begin(size_t blob_len_param) {
              update_partition->subtype, update_partition->address);
     assert(update_partition != NULL);
 
-    esp_err_t err = esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &update_handle);
+    // esp_ota_begin() waits for the header, the size of the image tells how much to erase
+    esp_err_t err = ota_writer_start();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to start the writer task");
+        xSemaphoreGive(ota_mutex);
+    }
+
+    return err;
+}
+
+static esp_err_t ota_image_get(char** buf, size_t* len) {
+    if (writer.err != ESP_OK)
+        return writer.err;
+
+    if (writer.fill.data == NULL) {
+        // Blocks while the writer task holds both buffers
+        xQueueReceive(writer.free_bufs, &writer.fill, portMAX_DELAY);
+        writer.fill.len = 0;
+        if (writer.err != ESP_OK)
+            return writer.err;
+    }
+
+    *buf = (char*)writer.fill.data + writer.fill.len;
+    *len = OTA_BUF_LEN - writer.fill.len;
+    return ESP_OK;
+}
+
+static esp_err_t ota_image_commit(size_t len) {
+    writer.fill.len += len;
+
+    if (writer.fill.len >= OTA_BUF_LEN) {
+        xQueueSend(writer.full_bufs, &writer.fill, portMAX_DELAY);
+        writer.fill.data = NULL;
+    }
+
+    return writer.err;
+}
+
+static esp_err_t ota_image_write(void* ctx, const uint8_t* buf, size_t len) {
+    esp_err_t err = ESP_OK;
+    char* dest;
+    size_t dest_len;
+
+    while (len > 0) {
+        err = ota_image_get(&dest, &dest_len);
+        if (err != ESP_OK)
+            break;
+
+        if (dest_len > len)
+            dest_len = len;
+        memcpy(dest, buf, dest_len);
+        buf += dest_len;
+        len -= dest_len;
+        err = ota_image_commit(dest_len);
+        if (err != ESP_OK)
+            break;
+    }
+
+    return err;
+}
+
+static esp_err_t ota_source_read(void* ctx, size_t offset, void* buf, size_t len) {
+    return esp_partition_read((const esp_partition_t*)ctx, offset, buf, len);
+}
+
+// A delta applies to the running image only, check that it is the one the patch was made against
+static esp_err_t ota_delta_init(const ota_pack_hdr_t* hdr) {
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    esp_err_t err;
+
+    upload.patch = malloc(sizeof(ota_patch_t));
+    if (upload.patch == NULL)
+        return ESP_ERR_NO_MEM;
+    ota_patch_init(upload.patch, hdr, ota_source_read, (void*)running, ota_image_write, NULL);
+
+    if (hdr->source_len > running->size)
+        return ESP_ERR_INVALID_SIZE;
+    err = ota_patch_check_source(upload.patch, hdr);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "The patch was made against another image, err=0x%x", err);
+    return err;
+}
+
+// Start writing the update partition once the format of the upload is known
+static esp_err_t ota_detect_format() {
+    ota_pack_hdr_t hdr;
+    esp_err_t err = ota_pack_parse_header(upload.hdr, upload.hdr_len, &hdr);
+
+    if (err == ESP_ERR_INVALID_SIZE) {
+        // A longer header, ota_esp_end() fails if the upload ends before it
+        upload.hdr_want = hdr.hdr_len;
+        return ESP_OK;
+    } else if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Packed %s, %d bytes, window %d bytes", hdr.type == OTA_PACK_TYPE_DELTA ? "delta" : "image",
+                 hdr.image_len, 1 << hdr.window_bits);
+        upload.image_len = hdr.image_len;
+        upload.pack_in = malloc(OTA_PACK_IN_LEN);
+        if (upload.pack_in == NULL)
+            return ESP_ERR_NO_MEM;
+        err = ota_decomp_init(&upload.decomp, &hdr);
+        if (err == ESP_OK && hdr.type == OTA_PACK_TYPE_DELTA)
+            err = ota_delta_init(&hdr);
+        if (err != ESP_OK)
+            return err;
+    } else if (err == ESP_ERR_NOT_FOUND) {
+        upload.image_len = blob_len;
+    } else {
+        ESP_LOGE(TAG, "Unsupported packed image");
+        return err;
+    }
+
+    // With the size known only the sectors of the image are erased, instead of the whole partition
+    err = esp_ota_begin(update_partition, upload.image_len > 0 ? upload.image_len : OTA_SIZE_UNKNOWN, &update_handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp_ota_begin failed, error=%d", err);
-        goto func_ret;
+        return err;
     }
     ESP_LOGI(TAG, "esp_ota_begin succeeded");
 
-func_ret:
+    if (upload.patch != NULL) {
+        upload.format = OTA_FORMAT_DELTA;
+    } else if (upload.pack_in != NULL) {
+        upload.format = OTA_FORMAT_PACKED;
+    } else {
+        upload.format = OTA_FORMAT_RAW;
+        err = ota_image_write(NULL, upload.hdr, upload.hdr_len);
+    }
     return err;
 }
 
-esp_err_t ota_esp_buf_write(char* buf, size_t len) {
-    esp_err_t err = esp_ota_write( update_handle, (const void *)buf, len);
+esp_err_t ota_esp_buf_get(char** buf, size_t* len) {
+    switch (upload.format) {
+    case OTA_FORMAT_UNKNOWN:
+        *buf = (char*)upload.hdr + upload.hdr_len;
+        *len = upload.hdr_want - upload.hdr_len;
+        return ESP_OK;
+    case OTA_FORMAT_PACKED:
+    case OTA_FORMAT_DELTA:
+        *buf = (char*)upload.pack_in;
+        *len = OTA_PACK_IN_LEN;
+        return writer.err;
+    default:
+        return ota_image_get(buf, len);
+    }
+}
 
-    if (err == ESP_OK) {
-        written += len;
-        ESP_LOGI(TAG, "Progress + %d => %d", len, written);
-    } else {
-        // Fatal error
-        ESP_LOGE(TAG, "Error: esp_ota_write failed! err=0x%x", err);
+esp_err_t ota_esp_buf_commit(size_t len) {
+    esp_err_t err;
+
+    received += len;
+    switch (upload.format) {
+    case OTA_FORMAT_UNKNOWN:
+        upload.hdr_len += len;
+        err = ESP_OK;
+        if (upload.hdr_len == upload.hdr_want || received == blob_len)
+            err = ota_detect_format();
+        break;
+    case OTA_FORMAT_PACKED:
+        err = ota_decomp_feed(&upload.decomp, upload.pack_in, len, ota_image_write, NULL);
+        break;
+    case OTA_FORMAT_DELTA:
+        err = ota_decomp_feed(&upload.decomp, upload.pack_in, len, ota_patch_feed, upload.patch);
+        break;
+    default:
+        err = ota_image_commit(len);
+        break;
+    }
+
+    TickType_t now = xTaskGetTickCount();
+    if (now - writer.progress_tick >= OTA_PROGRESS_INTERVAL_MS / portTICK_RATE_MS) {
+        writer.progress_tick = now;
+        ESP_LOGI(TAG, "Progress %d of %d bytes", received, blob_len);
     }
 
     return err;
 }
 
+esp_err_t ota_esp_buf_write(const char* buf, size_t len) {
+    esp_err_t err = ESP_OK;
+    char* dest;
+    size_t dest_len;
+
+    while (len > 0) {
+        err = ota_esp_buf_get(&dest, &dest_len);
+        if (err != ESP_OK)
+            break;
+
+        if (dest_len > len)
+            dest_len = len;
+        memcpy(dest, buf, dest_len);
+        buf += dest_len;
+        len -= dest_len;
+        err = ota_esp_buf_commit(dest_len);
+        if (err != ESP_OK)
+            break;
+    }
+
+    return err;
+}
+
+static void ota_upload_free() {
+    ota_decomp_free(&upload.decomp);
+    free(upload.pack_in);
+    free(upload.patch);
+    memset(&upload, 0, sizeof(upload));
+}
+
 esp_err_t ota_esp_end() {
     esp_err_t err = ESP_OK;
-    ESP_LOGI(TAG, "Total Write binary data length : %d", blob_len);
+
+    if (upload.format == OTA_FORMAT_UNKNOWN) {
+        // Nothing was uploaded
+        ota_writer_stop();
+        err = ESP_ERR_INVALID_SIZE;
+        goto ret;
+    }
+
+    // Flash the last partial sector
+    if (writer.fill.data != NULL && writer.fill.len > 0) {
+        xQueueSend(writer.full_bufs, &writer.fill, portMAX_DELAY);
+        writer.fill.data = NULL;
+    }
+    ota_writer_stop();
+    ESP_LOGI(TAG, "Total Write binary data length : %d", writer.written);
+
+    err = writer.err;
+    if (err == ESP_OK && upload.format == OTA_FORMAT_PACKED && upload.decomp.out_len != upload.image_len) {
+        ESP_LOGE(TAG, "Packed image truncated, %d of %d bytes", upload.decomp.out_len, upload.image_len);
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err == ESP_OK && upload.format == OTA_FORMAT_DELTA && !ota_patch_done(upload.patch)) {
+        ESP_LOGE(TAG, "Delta truncated, %d of %d bytes", upload.patch->out_len, upload.image_len);
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err != ESP_OK) {
+        esp_ota_end(update_handle);
+        goto ret;
+    }
 
     err = esp_ota_end(update_handle);
     if (err != ESP_OK) {
@@ -107,7 +435,20 @@ esp_err_t ota_esp_end() {
     ESP_LOGI(TAG, "Prepare to restart system!");
 
 ret:
+    ota_upload_free();
+    ota_writer_free();
     xSemaphoreGive(ota_mutex);
     return err;
 }
 
+void ota_esp_abort() {
+    ota_writer_stop();
+    ESP_LOGW(TAG, "Aborted after %d bytes", received);
+
+    // Releases the handle, the incomplete image fails the validation
+    if (upload.format != OTA_FORMAT_UNKNOWN)
+        esp_ota_end(update_handle);
+    ota_upload_free();
+    ota_writer_free();
+    xSemaphoreGive(ota_mutex);
+}
@@ -20,9 +20,18 @@
 
 
 #if OTA_ESP_ENABLED
+// blob_len is the size of the upload, 0 if unknown. Holds the OTA lock until ota_esp_end() or ota_esp_abort().
+// The upload is either a plain image, or an image or a delta packed by tools/ota_pack.py, told apart by its
+// first bytes.
 esp_err_t ota_esp_begin(size_t blob_len);
-esp_err_t ota_esp_buf_write(char* buf, size_t len);
+// Zero-copy write, receive into the buffer and then commit what was received. Plain images go straight into
+// the current sector buffer. ota_esp_buf_get() blocks while the writer task is flashing both buffers, a flash
+// or decompression error is returned by either.
+esp_err_t ota_esp_buf_get(char** buf, size_t* len);
+esp_err_t ota_esp_buf_commit(size_t len);
+esp_err_t ota_esp_buf_write(const char* buf, size_t len);
 esp_err_t ota_esp_end();
+void ota_esp_abort();
 #endif
 
 #endif /* MAIN_OTA_H_ */
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ota_decomp.h"
+
+// Output is staged on the stack and handed to the sink in pieces of this size
+#define DECOMP_OUT_CHUNK    128
+
+enum decomp_state {
+    DECOMP_TAG = 0,             // 1 bit, 1 for a literal, 0 for a back-reference
+    DECOMP_LITERAL,             // 8 bits
+    DECOMP_INDEX,               // window_bits, the distance back minus 1
+    DECOMP_COUNT,               // lookahead_bits, the length minus 1
+};
+
+static inline uint32_t pack_get_u32(const uint8_t* buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+esp_err_t ota_pack_parse_header(const uint8_t* buf, size_t len, ota_pack_hdr_t* hdr) {
+    if (len < OTA_PACK_HDR_LEN || memcmp(buf, OTA_PACK_MAGIC, 4) != 0)
+        return ESP_ERR_NOT_FOUND;
+
+    hdr->type = buf[5];
+    hdr->window_bits = buf[6];
+    hdr->lookahead_bits = buf[7];
+    hdr->image_len = pack_get_u32(buf + 8);
+    hdr->source_len = 0;
+    hdr->source_crc = 0;
+    hdr->hdr_len = hdr->type == OTA_PACK_TYPE_DELTA ? OTA_PACK_DELTA_HDR_LEN : OTA_PACK_HDR_LEN;
+
+    if (buf[4] != OTA_PACK_VERSION || hdr->type > OTA_PACK_TYPE_DELTA)
+        return ESP_ERR_INVALID_ARG;
+    if (hdr->window_bits < OTA_PACK_WINDOW_BITS_MIN || hdr->window_bits > OTA_PACK_WINDOW_BITS_MAX)
+        return ESP_ERR_INVALID_ARG;
+    // Same limits as heatshrink
+    if (hdr->lookahead_bits < 3 || hdr->lookahead_bits >= hdr->window_bits)
+        return ESP_ERR_INVALID_ARG;
+
+    if (len < hdr->hdr_len)
+        return ESP_ERR_INVALID_SIZE;
+    if (hdr->type == OTA_PACK_TYPE_DELTA) {
+        hdr->source_len = pack_get_u32(buf + 12);
+        hdr->source_crc = pack_get_u32(buf + 16);
+    }
+    return ESP_OK;
+}
+
+esp_err_t ota_decomp_init(ota_decomp_t* decomp, const ota_pack_hdr_t* hdr) {
+    memset(decomp, 0, sizeof(ota_decomp_t));
+    // Zeroed, as heatshrink lets back-references reach before the start of the output
+    decomp->window = calloc(1, 1 << hdr->window_bits);
+    if (decomp->window == NULL)
+        return ESP_ERR_NO_MEM;
+
+    decomp->window_bits = hdr->window_bits;
+    decomp->lookahead_bits = hdr->lookahead_bits;
+    decomp->state = DECOMP_TAG;
+    // The length of a patch is not known, ota_patch_feed() checks the image_len of its output
+    decomp->out_max = hdr->type == OTA_PACK_TYPE_IMAGE ? hdr->image_len : SIZE_MAX;
+    return ESP_OK;
+}
+
+void ota_decomp_free(ota_decomp_t* decomp) {
+    free(decomp->window);
+    decomp->window = NULL;
+}
+
+static inline uint32_t decomp_take_bits(ota_decomp_t* decomp, uint8_t count) {
+    decomp->bit_count -= count;
+    return (decomp->bit_buf >> decomp->bit_count) & ((1u << count) - 1);
+}
+
+esp_err_t ota_decomp_feed(ota_decomp_t* decomp, const uint8_t* in, size_t len, ota_decomp_sink_t sink, void* ctx) {
+    uint8_t out[DECOMP_OUT_CHUNK];
+    size_t out_len = 0;
+    uint16_t mask = (1 << decomp->window_bits) - 1;
+    uint16_t count;
+    esp_err_t err = ESP_OK;
+
+    while (1) {
+        uint8_t need;
+        switch (decomp->state) {
+        case DECOMP_TAG:
+            need = 1;
+            break;
+        case DECOMP_LITERAL:
+            need = 8;
+            break;
+        case DECOMP_INDEX:
+            need = decomp->window_bits;
+            break;
+        default:
+            need = decomp->lookahead_bits;
+            break;
+        }
+
+        if (decomp->bit_count < need) {
+            // Trailing bits of the last byte are padding
+            if (len == 0)
+                break;
+            // At most need - 1 + 8 <= 19 bits are buffered
+            decomp->bit_buf = (decomp->bit_buf << 8) | *in++;
+            decomp->bit_count += 8;
+            len--;
+            continue;
+        }
+
+        uint32_t bits = decomp_take_bits(decomp, need);
+        switch (decomp->state) {
+        case DECOMP_TAG:
+            decomp->state = bits ? DECOMP_LITERAL : DECOMP_INDEX;
+            continue;
+        case DECOMP_INDEX:
+            decomp->index = bits + 1;
+            decomp->state = DECOMP_COUNT;
+            continue;
+        case DECOMP_LITERAL:
+            // A back-reference of distance 0 to the byte written first
+            decomp->window[decomp->head] = bits;
+            decomp->index = 0;
+            count = 1;
+            break;
+        default:
+            count = bits + 1;
+            break;
+        }
+        decomp->state = DECOMP_TAG;
+
+        if (decomp->out_len + count > decomp->out_max) {
+            err = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+        decomp->out_len += count;
+
+        while (count-- > 0) {
+            uint8_t c = decomp->window[(decomp->head - decomp->index) & mask];
+            decomp->window[decomp->head] = c;
+            decomp->head = (decomp->head + 1) & mask;
+
+            out[out_len++] = c;
+            if (out_len == sizeof(out)) {
+                err = sink(ctx, out, out_len);
+                if (err != ESP_OK)
+                    return err;
+                out_len = 0;
+            }
+        }
+    }
+
+    if (out_len > 0 && err == ESP_OK)
+        err = sink(ctx, out, out_len);
+    return err;
+}
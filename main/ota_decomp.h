@@ -0,0 +1,77 @@
+/*
+ * ota_decomp.h
+ *
+ * Streaming decompression of packed OTA images (tools/ota_pack.py), in a fixed RAM window.
+ *
+ * A packed image is a 12-byte header followed by the image compressed with LZSS in the
+ * heatshrink format (raw, no framing), so `heatshrink -e -w <window_bits> -l <lookahead_bits>`
+ * produces a valid body as well:
+ *   0  "MBHS"
+ *   4  version, OTA_PACK_VERSION
+ *   5  type, OTA_PACK_TYPE_IMAGE
+ *   6  window_bits, the window is 2^window_bits bytes of RAM
+ *   7  lookahead_bits, back-references copy up to 2^lookahead_bits bytes
+ *   8  image_len, little endian, the size of the decompressed image
+ * A delta image (OTA_PACK_TYPE_DELTA) compresses a patch against the running image instead,
+ * see ota_patch.h, its header goes on with:
+ *   12 source_len, little endian, the length of the running image the patch was made against
+ *   16 source_crc, little endian, the CRC-32 of these source_len bytes
+ */
+
+#ifndef MAIN_OTA_DECOMP_H_
+#define MAIN_OTA_DECOMP_H_
+
+#include <stdint.h>
+#include <strings.h>
+#include "esp_err.h"
+
+#define OTA_PACK_MAGIC              "MBHS"
+#define OTA_PACK_HDR_LEN            12
+#define OTA_PACK_DELTA_HDR_LEN      20
+#define OTA_PACK_HDR_MAXLEN         OTA_PACK_DELTA_HDR_LEN
+#define OTA_PACK_VERSION            1
+#define OTA_PACK_WINDOW_BITS_MIN    4
+#define OTA_PACK_WINDOW_BITS_MAX    12
+
+enum ota_pack_type {
+    OTA_PACK_TYPE_IMAGE = 0,
+    OTA_PACK_TYPE_DELTA,
+};
+
+typedef struct ota_pack_hdr {
+    uint8_t type;
+    uint8_t window_bits;
+    uint8_t lookahead_bits;
+    uint32_t image_len;
+    uint32_t source_len;        // OTA_PACK_TYPE_DELTA only
+    uint32_t source_crc;
+    uint8_t hdr_len;            // OTA_PACK_HDR_LEN or OTA_PACK_DELTA_HDR_LEN
+} ota_pack_hdr_t;
+
+// Receives the decompressed data in order
+typedef esp_err_t (*ota_decomp_sink_t)(void* ctx, const uint8_t* buf, size_t len);
+
+typedef struct ota_decomp {
+    uint8_t* window;            // The last 2^window_bits output bytes, circular
+    uint16_t head;              // Next write position in the window
+    uint8_t window_bits;
+    uint8_t lookahead_bits;
+    uint8_t state;
+    uint8_t bit_count;          // Valid bits in bit_buf
+    uint32_t bit_buf;           // Input bits not consumed yet, the oldest is the most significant
+    uint16_t index;             // Back-reference being read
+    size_t out_len;             // Bytes produced so far
+    size_t out_max;
+} ota_decomp_t;
+
+// Returns ESP_ERR_NOT_FOUND if buf does not start with OTA_PACK_MAGIC, ESP_ERR_INVALID_ARG if the
+// header is not supported, ESP_ERR_INVALID_SIZE if the header is longer than len (see hdr->hdr_len).
+esp_err_t ota_pack_parse_header(const uint8_t* buf, size_t len, ota_pack_hdr_t* hdr);
+
+esp_err_t ota_decomp_init(ota_decomp_t* decomp, const ota_pack_hdr_t* hdr);
+// Decompress the next part of the compressed stream. Returns the error of the sink, or
+// ESP_ERR_INVALID_SIZE if the output of an OTA_PACK_TYPE_IMAGE would exceed the image_len of the header.
+esp_err_t ota_decomp_feed(ota_decomp_t* decomp, const uint8_t* in, size_t len, ota_decomp_sink_t sink, void* ctx);
+void ota_decomp_free(ota_decomp_t* decomp);
+
+#endif /* MAIN_OTA_DECOMP_H_ */
@@ -0,0 +1,148 @@
+#include <string.h>
+
+#include "ota_patch.h"
+
+enum patch_state {
+    PATCH_DIFF_LEN = 0,
+    PATCH_DIFF,
+    PATCH_EXTRA_LEN,
+    PATCH_EXTRA,
+    PATCH_ADJUST,
+};
+
+uint32_t ota_patch_crc32(uint32_t crc, const uint8_t* buf, size_t len) {
+    // Reflected polynomial, 4 bits at a time
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    crc = ~crc;
+    while (len-- > 0) {
+        crc ^= *buf++;
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+void ota_patch_init(ota_patch_t* patch, const ota_pack_hdr_t* hdr, ota_patch_read_t read, void* read_ctx,
+                    ota_decomp_sink_t sink, void* sink_ctx) {
+    memset(patch, 0, sizeof(ota_patch_t));
+    patch->read = read;
+    patch->read_ctx = read_ctx;
+    patch->sink = sink;
+    patch->sink_ctx = sink_ctx;
+    patch->source_len = hdr->source_len;
+    patch->image_len = hdr->image_len;
+    patch->state = PATCH_DIFF_LEN;
+}
+
+esp_err_t ota_patch_check_source(ota_patch_t* patch, const ota_pack_hdr_t* hdr) {
+    uint32_t crc = 0;
+    esp_err_t err;
+
+    for (size_t offset = 0; offset < hdr->source_len; offset += OTA_PATCH_CHUNK) {
+        size_t len = hdr->source_len - offset < OTA_PATCH_CHUNK ? hdr->source_len - offset : OTA_PATCH_CHUNK;
+        err = patch->read(patch->read_ctx, offset, patch->chunk, len);
+        if (err != ESP_OK)
+            return err;
+        crc = ota_patch_crc32(crc, patch->chunk, len);
+    }
+
+    return crc == hdr->source_crc ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
+
+int ota_patch_done(const ota_patch_t* patch) {
+    return patch->out_len == patch->image_len && patch->state == PATCH_DIFF_LEN && patch->shift == 0;
+}
+
+// A length or adjust varint is complete
+static esp_err_t patch_varint_done(ota_patch_t* patch) {
+    switch (patch->state) {
+    case PATCH_DIFF_LEN:
+    case PATCH_EXTRA_LEN:
+        if (patch->value > patch->image_len - patch->out_len)
+            return ESP_ERR_INVALID_ARG;
+        if (patch->state == PATCH_DIFF_LEN && patch->value > patch->source_len - patch->source_pos)
+            return ESP_ERR_INVALID_ARG;
+        patch->left = patch->value;
+        patch->out_len += patch->value;
+        // An empty block is skipped
+        patch->state = patch->value > 0 ? patch->state + 1 : patch->state + 2;
+        break;
+    default: {
+        int32_t adjust = (patch->value >> 1) ^ -(int32_t)(patch->value & 1);
+        if ((adjust < 0 && (size_t)-adjust > patch->source_pos) ||
+            (adjust > 0 && (size_t)adjust > patch->source_len - patch->source_pos))
+            return ESP_ERR_INVALID_ARG;
+        patch->source_pos += adjust;
+        patch->state = PATCH_DIFF_LEN;
+        break;
+    }
+    }
+
+    patch->value = 0;
+    patch->shift = 0;
+    return ESP_OK;
+}
+
+esp_err_t ota_patch_feed(void* ctx, const uint8_t* buf, size_t len) {
+    ota_patch_t* patch = ctx;
+    esp_err_t err = ESP_OK;
+
+    while (len > 0) {
+        size_t count;
+
+        switch (patch->state) {
+        case PATCH_DIFF:
+            count = patch->left;
+            if (count > len)
+                count = len;
+            if (count > OTA_PATCH_CHUNK)
+                count = OTA_PATCH_CHUNK;
+
+            // The source position was checked against source_len with the length
+            err = patch->read(patch->read_ctx, patch->source_pos, patch->chunk, count);
+            if (err != ESP_OK)
+                return err;
+            for (size_t i = 0; i < count; i++)
+                patch->chunk[i] += buf[i];
+            err = patch->sink(patch->sink_ctx, patch->chunk, count);
+            if (err != ESP_OK)
+                return err;
+            patch->source_pos += count;
+            break;
+
+        case PATCH_EXTRA:
+            count = patch->left;
+            if (count > len)
+                count = len;
+            err = patch->sink(patch->sink_ctx, buf, count);
+            if (err != ESP_OK)
+                return err;
+            break;
+
+        default:
+            if (patch->shift > 28)
+                return ESP_ERR_INVALID_ARG;
+            patch->value |= (uint32_t)(*buf & 0x7F) << patch->shift;
+            patch->shift += 7;
+            if ((*buf++ & 0x80) == 0) {
+                err = patch_varint_done(patch);
+                if (err != ESP_OK)
+                    return err;
+            }
+            len--;
+            continue;
+        }
+
+        buf += count;
+        len -= count;
+        patch->left -= count;
+        if (patch->left == 0)
+            patch->state++;
+    }
+
+    return err;
+}
@@ -0,0 +1,62 @@
+/*
+ * ota_patch.h
+ *
+ * Delta updates: the new image is rebuilt from the running one and a patch made by
+ * tools/ota_pack.py --base, with a fixed amount of RAM. The patch arrives compressed in a
+ * packed image of type OTA_PACK_TYPE_DELTA (see ota_decomp.h), the decompressed patch is a
+ * sequence of records, bsdiff style:
+ *   diff_len   varint, followed by diff_len bytes that are added (mod 256) to the source bytes at
+ *              the source position, which moves on by diff_len
+ *   extra_len  varint, followed by extra_len bytes that are copied as they are
+ *   adjust     zigzag varint, added to the source position
+ * Varints are LEB128, 7 bits per byte with the least significant group first.
+ *
+ * Only needs the C library, tools/ota_patch_host.c builds it on the host.
+ */
+
+#ifndef MAIN_OTA_PATCH_H_
+#define MAIN_OTA_PATCH_H_
+
+#include <stdint.h>
+#include <strings.h>
+#include "esp_err.h"
+
+#include "ota_decomp.h"
+
+// Source bytes are read in pieces of this size
+#define OTA_PATCH_CHUNK     256
+
+// Read len bytes of the source image at offset
+typedef esp_err_t (*ota_patch_read_t)(void* ctx, size_t offset, void* buf, size_t len);
+
+typedef struct ota_patch {
+    ota_patch_read_t read;
+    void* read_ctx;
+    ota_decomp_sink_t sink;     // Receives the new image
+    void* sink_ctx;
+    size_t source_len;
+    size_t image_len;
+    size_t source_pos;
+    size_t out_len;             // Bytes of the new image produced so far
+    uint8_t state;
+    uint8_t shift;              // Of the next 7 bits of the varint being read
+    uint32_t value;             // Varint being read
+    uint32_t left;              // In the current diff or extra block
+    uint8_t chunk[OTA_PATCH_CHUNK];
+} ota_patch_t;
+
+void ota_patch_init(ota_patch_t* patch, const ota_pack_hdr_t* hdr, ota_patch_read_t read, void* read_ctx,
+                    ota_decomp_sink_t sink, void* sink_ctx);
+// Apply the next part of the decompressed patch, an ota_decomp_sink_t with patch as the ctx.
+// Returns ESP_ERR_INVALID_ARG if the patch is corrupt, or the error of read or sink.
+esp_err_t ota_patch_feed(void* patch, const uint8_t* buf, size_t len);
+// The whole patch has been applied
+int ota_patch_done(const ota_patch_t* patch);
+
+// Check that the source is the image the patch was made against, with the source_len and
+// source_crc of the header. Uses patch->chunk, call before ota_patch_feed().
+esp_err_t ota_patch_check_source(ota_patch_t* patch, const ota_pack_hdr_t* hdr);
+// Standard CRC-32 (IEEE 802.3), start with crc = 0
+uint32_t ota_patch_crc32(uint32_t crc, const uint8_t* buf, size_t len);
+
+#endif /* MAIN_OTA_PATCH_H_ */
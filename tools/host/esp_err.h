@@ -0,0 +1,24 @@
+/*
+ * esp_err.h
+ *
+ * The subset of the SDK's esp_err.h that the OTA decoders use, for host builds of
+ * main/ota_decomp.c and main/ota_patch.c (see tools/ota_patch_host.c).
+ */
+
+#ifndef TOOLS_HOST_ESP_ERR_H_
+#define TOOLS_HOST_ESP_ERR_H_
+
+#include <stdint.h>
+
+typedef int32_t esp_err_t;
+
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_STATE   0x103
+#define ESP_ERR_INVALID_SIZE    0x104
+#define ESP_ERR_NOT_FOUND       0x105
+#define ESP_ERR_INVALID_CRC     0x109
+
+#endif /* TOOLS_HOST_ESP_ERR_H_ */
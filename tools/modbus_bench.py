@@ -0,0 +1,274 @@
+#!/usr/bin/env python3
+"""Modbus TCP load generator and latency benchmark.
+
+Opens N connections to the gateway, keeps up to D requests outstanding on each
+(pipelined, matched by the MBAP transaction id) and sends a weighted mix of
+FC03 reads and FC16 writes. Reports the throughput, the latency percentiles
+and the errors. Only the Python standard library is used.
+
+Examples:
+    # 4 connections, 2 requests in flight each, for 30 seconds
+    tools/modbus_bench.py 192.168.4.1 -c 4 -d 2 -t 30
+    # 80% reads of 10 registers, 20% writes of 4 registers, UIDs 1 to 3
+    tools/modbus_bench.py 192.168.4.1 --mix fc3:80,fc16:20 --uid 1-3 --count 10 --write-count 4
+"""
+
+import argparse
+import asyncio
+import json
+import math
+import random
+import struct
+import sys
+import time
+
+MBAP = struct.Struct(">HHHB")   # transaction id, protocol id, length, uid
+
+EXCEPTION_NAMES = {
+    1: "illegal_function",
+    2: "illegal_data_address",
+    3: "illegal_data_value",
+    4: "slave_device_failure",
+    6: "slave_device_busy",
+    10: "gateway_path_unavailable",
+    11: "gateway_target_no_response",
+}
+
+
+class Stats:
+    def __init__(self):
+        self.sent = 0
+        self.ok = 0
+        self.latency = {}       # Function code -> list of seconds
+        self.errors = {}        # Error name -> count
+
+    def error(self, name):
+        self.errors[name] = self.errors.get(name, 0) + 1
+
+    def response(self, func_code, seconds):
+        self.ok += 1
+        self.latency.setdefault(func_code, []).append(seconds)
+
+
+def parse_uids(text):
+    uids = []
+    for part in text.split(","):
+        if "-" in part:
+            first, last = part.split("-")
+            uids.extend(range(int(first), int(last) + 1))
+        else:
+            uids.append(int(part))
+    return uids
+
+
+def parse_mix(text):
+    mix = []
+    for part in text.split(","):
+        name, weight = part.split(":")
+        func_code = int(name.lower().lstrip("fc"))
+        if func_code not in (3, 16):
+            raise argparse.ArgumentTypeError("only fc3 and fc16 are supported: " + part)
+        mix.append((func_code, int(weight)))
+    return mix
+
+
+def build_pdu(args, func_code, rng):
+    addr = args.addr
+    if func_code == 3:
+        return struct.pack(">BHH", 3, addr, args.count)
+    values = [rng.randrange(0x10000) for _ in range(args.write_count)]
+    return struct.pack(">BHHB%dH" % len(values), 16, addr, len(values), len(values) * 2, *values)
+
+
+def check_response(func_code, pdu):
+    """Returns None if the response is well-formed, the error name otherwise."""
+    if len(pdu) < 2:
+        return "malformed"
+    if pdu[0] == func_code | 0x80:
+        return "exception_" + EXCEPTION_NAMES.get(pdu[1], str(pdu[1]))
+    if pdu[0] != func_code:
+        return "wrong_function_code"
+    if func_code == 3 and pdu[1] != len(pdu) - 2:
+        return "malformed"
+    if func_code == 16 and len(pdu) != 5:
+        return "malformed"
+    return None
+
+
+async def connection(args, conn_id, deadline, stats, budget):
+    rng = random.Random(args.seed + conn_id)
+    codes = [fc for fc, _ in args.mix]
+    weights = [w for _, w in args.mix]
+    pending = {}                # Transaction id -> (future, func_code, start time)
+    slots = asyncio.Semaphore(args.depth)
+
+    try:
+        reader, writer = await asyncio.wait_for(asyncio.open_connection(args.host, args.port), args.timeout)
+    except (OSError, asyncio.TimeoutError):
+        stats.error("connect_failed")
+        return
+
+    async def receive():
+        try:
+            while True:
+                header = await reader.readexactly(MBAP.size)
+                tid, _, length, _ = MBAP.unpack(header)
+                pdu = await reader.readexactly(length - 1)
+                entry = pending.pop(tid, None)
+                if entry is None:
+                    stats.error("unexpected_transaction_id")
+                    continue
+                future, func_code, start = entry
+                if not future.done():
+                    future.set_result((func_code, pdu, time.perf_counter() - start))
+        finally:
+            # Fail the requests still in flight instead of letting them time out
+            for future, _, _ in pending.values():
+                if not future.done():
+                    future.set_exception(ConnectionError())
+            pending.clear()
+
+    async def transaction(tid, func_code, pdu, uid):
+        future = asyncio.get_running_loop().create_future()
+        pending[tid] = (future, func_code, time.perf_counter())
+        writer.write(MBAP.pack(tid, 0, len(pdu) + 1, uid) + pdu)
+        stats.sent += 1
+        try:
+            func_code, resp, seconds = await asyncio.wait_for(future, args.timeout)
+            error = check_response(func_code, resp)
+            if error is None:
+                stats.response(func_code, seconds)
+            else:
+                stats.error(error)
+        except asyncio.TimeoutError:
+            pending.pop(tid, None)
+            stats.error("timeout")
+        except ConnectionError:
+            stats.error("connection_lost")
+        finally:
+            slots.release()
+
+    receiver = asyncio.ensure_future(receive())
+    tasks = set()
+    tid = 0
+    try:
+        while time.monotonic() < deadline and not receiver.done():
+            await slots.acquire()
+            if budget[0] == 0:
+                slots.release()
+                break
+            budget[0] -= 1
+
+            func_code = rng.choices(codes, weights)[0]
+            tid = (tid + 1) & 0xFFFF
+            task = asyncio.ensure_future(
+                transaction(tid, func_code, build_pdu(args, func_code, rng), rng.choice(args.uid)))
+            tasks.add(task)
+            task.add_done_callback(tasks.discard)
+        if tasks:
+            await asyncio.wait(tasks)
+    finally:
+        if receiver.done() and not receiver.cancelled():
+            # The gateway closed the connection, or sent garbage
+            stats.error("connection_closed" if isinstance(receiver.exception(), asyncio.IncompleteReadError)
+                        else "receive_failed")
+        receiver.cancel()
+        writer.close()
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return None
+    # Nearest rank
+    idx = max(1, math.ceil(p / 100.0 * len(sorted_values)))
+    return sorted_values[idx - 1]
+
+
+def summarize(latencies):
+    values = sorted(latencies)
+    summary = {"count": len(values)}
+    for name, p in (("p50", 50), ("p90", 90), ("p99", 99), ("p999", 99.9)):
+        v = percentile(values, p)
+        summary[name + "_ms"] = None if v is None else round(v * 1000, 3)
+    summary["max_ms"] = round(values[-1] * 1000, 3) if values else None
+    return summary
+
+
+def report(args, stats, elapsed):
+    all_latency = [v for values in stats.latency.values() for v in values]
+    result = {
+        "connections": args.connections,
+        "depth": args.depth,
+        "elapsed_s": round(elapsed, 3),
+        "sent": stats.sent,
+        "ok": stats.ok,
+        "req_per_s": round(stats.ok / elapsed, 2) if elapsed > 0 else 0,
+        "latency": summarize(all_latency),
+        "per_function": {"fc%d" % fc: summarize(values) for fc, values in sorted(stats.latency.items())},
+        "errors": dict(sorted(stats.errors.items())),
+    }
+
+    if args.json:
+        print(json.dumps(result, indent=2))
+        return
+
+    def fmt(summary):
+        return "n=%-7d p50 %s  p90 %s  p99 %s  p999 %s  max %s" % (
+            summary["count"], *("%8.2f ms" % summary[k] if summary[k] is not None else "       - ms"
+                                for k in ("p50_ms", "p90_ms", "p99_ms", "p999_ms", "max_ms")))
+
+    print("%d connections x %d in flight, %.1f s" % (args.connections, args.depth, elapsed))
+    print("sent %d, ok %d, %.1f req/s" % (stats.sent, stats.ok, result["req_per_s"]))
+    print("all    " + fmt(result["latency"]))
+    for name, summary in result["per_function"].items():
+        print("%-6s %s" % (name, fmt(summary)))
+    if stats.errors:
+        print("errors: " + ", ".join("%s %d" % item for item in result["errors"].items()))
+    else:
+        print("errors: none")
+
+
+async def run(args):
+    stats = Stats()
+    # Shared by all connections, -1 for no limit
+    budget = [args.requests if args.requests > 0 else -1]
+    start = time.monotonic()
+    deadline = start + args.duration if args.duration > 0 else float("inf")
+    await asyncio.gather(*(connection(args, i, deadline, stats, budget) for i in range(args.connections)))
+    return stats, time.monotonic() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Modbus TCP load generator and latency benchmark")
+    parser.add_argument("host", help="gateway address")
+    parser.add_argument("-p", "--port", type=int, default=502)
+    parser.add_argument("-c", "--connections", type=int, default=1, help="number of TCP connections")
+    parser.add_argument("-d", "--depth", type=int, default=1, help="requests in flight per connection")
+    parser.add_argument("-t", "--duration", type=float, default=10, help="seconds to run, 0 for no limit")
+    parser.add_argument("-n", "--requests", type=int, default=0, help="total number of requests, 0 for no limit")
+    parser.add_argument("--mix", type=parse_mix, default=parse_mix("fc3:100"),
+                        help="weighted function codes, e.g. fc3:80,fc16:20")
+    parser.add_argument("--uid", type=parse_uids, default=[1], help="slave UIDs, e.g. 1-3,7")
+    parser.add_argument("--addr", type=int, default=0, help="first register address")
+    parser.add_argument("--count", type=int, default=10, help="registers per FC03 read")
+    parser.add_argument("--write-count", type=int, default=1, help="registers per FC16 write")
+    parser.add_argument("--timeout", type=float, default=2.0, help="response timeout in seconds")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--json", action="store_true", help="print the report as JSON")
+    args = parser.parse_args()
+
+    if args.duration <= 0 and args.requests <= 0:
+        parser.error("either --duration or --requests must be set")
+    if not 1 <= args.count <= 125 or not 1 <= args.write_count <= 123:
+        parser.error("--count must be 1~125 and --write-count 1~123")
+
+    try:
+        stats, elapsed = asyncio.run(run(args))
+    except KeyboardInterrupt:
+        sys.exit(1)
+    report(args, stats, elapsed)
+    sys.exit(0 if not stats.errors else 2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,353 @@
+#!/usr/bin/env python3
+"""Compress a firmware image for /ota_post.
+
+The output is a 12-byte header followed by the image compressed with LZSS in
+the heatshrink format, which the gateway decompresses on the fly into the OTA
+partition using a window of 2^window_bits bytes of RAM (see main/ota_decomp.h).
+
+With --base, the output is a delta instead: a binary patch from the base image
+(the firmware the gateway is running) to the new one, compressed the same way.
+The gateway checks the CRC-32 of its running image against the header before
+it applies the patch (see main/ota_patch.h). Only the Python standard library
+is used.
+
+Examples:
+    # Pack and upload
+    tools/ota_pack.py build/modbus_rtu2tcp.bin fw.mbhs
+    curl --data-binary @fw.mbhs http://192.168.4.1/ota_post
+    # Delta from the release that is on the gateway
+    tools/ota_pack.py --base v1.2.bin build/modbus_rtu2tcp.bin fw.mbhs
+    # Decompress a packed image, to check it (--base is needed for a delta)
+    tools/ota_pack.py -d fw.mbhs fw.bin
+"""
+
+import argparse
+import struct
+import sys
+import zlib
+
+MAGIC = b"MBHS"
+VERSION = 1
+TYPE_IMAGE = 0
+TYPE_DELTA = 1
+HEADER = struct.Struct("<4sBBBBI")     # magic, version, type, window bits, lookahead bits, image length
+DELTA_HEADER = struct.Struct("<II")     # base length, base CRC-32, after HEADER
+SEED_LEN = 8                            # Matches between the images are looked up by their first bytes
+SEED_CANDIDATES = 8
+MATCH_MIN = 16
+WINDOW_BITS_MIN = 4
+WINDOW_BITS_MAX = 12                    # OTA_PACK_WINDOW_BITS_MAX
+CHAIN_MAX = 64                          # Candidates tried per position
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.bits = 0
+
+    def write(self, value, count):
+        self.acc = (self.acc << count) | value
+        self.bits += count
+        while self.bits >= 8:
+            self.bits -= 8
+            self.out.append((self.acc >> self.bits) & 0xFF)
+        self.acc &= (1 << self.bits) - 1
+
+    def finish(self):
+        # Pad with zeros, too few bits for the decoder to read another back-reference
+        if self.bits > 0:
+            self.out.append((self.acc << (8 - self.bits)) & 0xFF)
+            self.bits = 0
+        return bytes(self.out)
+
+
+def compress(data, window_bits, lookahead_bits):
+    """heatshrink compatible: 1 + 8-bit literal, or 0 + (distance - 1) + (length - 1)."""
+    window = 1 << window_bits
+    max_len = 1 << lookahead_bits
+    # Shortest back-reference that is smaller than the literals it replaces
+    min_len = (1 + window_bits + lookahead_bits) // 9 + 1
+    key_len = max(min_len, 2)
+    chains = {}
+    out = BitWriter()
+    pos = 0
+
+    def insert(p):
+        key = data[p:p + key_len]
+        if len(key) == key_len:
+            chains.setdefault(key, []).append(p)
+
+    while pos < len(data):
+        best_len = 0
+        best_dist = 0
+        limit = min(max_len, len(data) - pos)
+        candidates = chains.get(data[pos:pos + key_len], ())
+        for cand in reversed(candidates[-CHAIN_MAX:]):
+            dist = pos - cand
+            if dist > window:
+                break
+            length = key_len
+            while length < limit and data[cand + length] == data[pos + length]:
+                length += 1
+            if length > best_len:
+                best_len, best_dist = length, dist
+                if length == limit:
+                    break
+
+        if best_len >= min_len:
+            out.write(0, 1)
+            out.write(best_dist - 1, window_bits)
+            out.write(best_len - 1, lookahead_bits)
+        else:
+            best_len = 1
+            out.write(1, 1)
+            out.write(data[pos], 8)
+
+        for p in range(pos, pos + best_len):
+            insert(p)
+        pos += best_len
+        # Keep the chains short, older positions are out of the window anyway
+        if pos % 65536 < best_len:
+            chains = {k: [p for p in v if pos - p <= window] for k, v in chains.items()}
+            chains = {k: v for k, v in chains.items() if v}
+
+    return out.finish()
+
+
+def decompress(body, window_bits, lookahead_bits, image_len):
+    """Reference decoder, same as ota_decomp_feed()."""
+    out = bytearray()
+    acc = 0
+    bits = 0
+    it = iter(body)
+
+    def take(count):
+        nonlocal acc, bits
+        while bits < count:
+            byte = next(it, None)
+            if byte is None:
+                return None
+            acc = (acc << 8) | byte
+            bits += 8
+        bits -= count
+        value = (acc >> bits) & ((1 << count) - 1)
+        acc &= (1 << bits) - 1
+        return value
+
+    while True:
+        tag = take(1)
+        if tag is None:
+            break
+        if tag:
+            value = take(8)
+            if value is None:
+                break
+            out.append(value)
+            continue
+        dist = take(window_bits)
+        length = take(lookahead_bits) if dist is not None else None
+        if length is None:
+            break
+        dist += 1
+        for _ in range(length + 1):
+            # Before the start of the output the window is zeroed
+            out.append(out[-dist] if dist <= len(out) else 0)
+
+    if image_len is not None and len(out) != image_len:
+        raise ValueError("decompressed %d bytes, the header says %d" % (len(out), image_len))
+    return bytes(out)
+
+
+def varint(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value == 0:
+            out.append(byte)
+            return bytes(out)
+        out.append(byte | 0x80)
+
+
+def zigzag(value):
+    return (value << 1) if value >= 0 else ((-value << 1) - 1)
+
+
+def diff(base, image):
+    """bsdiff style records of (diff bytes, extra bytes, source adjust), as applied by ota_patch_feed().
+
+    Exact matches are found through a hash of SEED_LEN bytes, then stretched forward over
+    the bytes that mostly match at the same offset (code that moved keeps its shape but
+    the addresses in it change), which become small numbers in the diff part.
+    """
+    seeds = {}
+    for pos in range(len(base) - SEED_LEN + 1):
+        positions = seeds.setdefault(base[pos:pos + SEED_LEN], [])
+        if len(positions) < SEED_CANDIDATES:
+            positions.append(pos)
+
+    def best_match(t, hint):
+        best = (0, 0)
+        for s in seeds.get(image[t:t + SEED_LEN], ()):
+            length = SEED_LEN
+            limit = min(len(base) - s, len(image) - t)
+            while length < limit and base[s + length] == image[t + length]:
+                length += 1
+            # Prefer the alignment of the previous match, it keeps the adjust small
+            if length > best[1] or (length == best[1] and abs(s - t - hint) < abs(best[0] - t - hint)):
+                best = (s, length)
+        return best
+
+    def stretch(s, t, length):
+        # Keep going while matches outnumber mismatches, end after the best score
+        score = best_score = 0
+        best_len = length
+        i = length
+        while s + i < len(base) and t + i < len(image) and score > best_score - 32:
+            score += 1 if base[s + i] == image[t + i] else -1
+            i += 1
+            if score > best_score:
+                best_score, best_len = score, i
+        return best_len
+
+    matches = []            # (image offset, base offset, length)
+    t = 0
+    offset = 0              # base - image of the last match
+    while t < len(image) - SEED_LEN + 1:
+        # Continuing the previous alignment is the cheapest match
+        s = t + offset
+        if matches and 0 <= s < len(base) and base[s:s + MATCH_MIN] == image[t:t + MATCH_MIN]:
+            length = MATCH_MIN
+        else:
+            s, length = best_match(t, offset)
+        if length < MATCH_MIN:
+            t += 1
+            continue
+        length = stretch(s, t, length)
+        matches.append((t, s, length))
+        offset = s - t
+        t += length
+
+    # The new bytes before the first match, and the jump to it
+    first_t, first_s = (matches[0][0], matches[0][1]) if matches else (len(image), 0)
+    records = [(b"", image[:first_t], first_s)]
+    for i, (t, s, length) in enumerate(matches):
+        end = t + length
+        diff_bytes = bytes((image[t + k] - base[s + k]) & 0xFF for k in range(length))
+        next_t, next_s = (matches[i + 1][0], matches[i + 1][1]) if i + 1 < len(matches) else (len(image), s + length)
+        records.append((diff_bytes, image[end:next_t], next_s - (s + length)))
+
+    patch = bytearray()
+    for diff_bytes, extra, adjust in records:
+        patch += varint(len(diff_bytes)) + diff_bytes + varint(len(extra)) + extra + varint(zigzag(adjust))
+    return bytes(patch)
+
+
+def apply_patch(base, patch, image_len):
+    """Reference patcher, same as ota_patch_feed()."""
+    out = bytearray()
+    pos = 0
+    source_pos = 0
+
+    def read_varint():
+        nonlocal pos
+        value = shift = 0
+        while True:
+            byte = patch[pos]
+            pos += 1
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value
+
+    while pos < len(patch):
+        length = read_varint()
+        out += bytes((patch[pos + k] + base[source_pos + k]) & 0xFF for k in range(length))
+        pos += length
+        source_pos += length
+        length = read_varint()
+        out += patch[pos:pos + length]
+        pos += length
+        adjust = read_varint()
+        source_pos += (adjust >> 1) ^ -(adjust & 1)
+
+    if len(out) != image_len:
+        raise ValueError("patched %d bytes, the header says %d" % (len(out), image_len))
+    return bytes(out)
+
+
+def pack(image, window_bits, lookahead_bits, base=None):
+    if base is None:
+        header = HEADER.pack(MAGIC, VERSION, TYPE_IMAGE, window_bits, lookahead_bits, len(image))
+        return header + compress(image, window_bits, lookahead_bits)
+
+    header = HEADER.pack(MAGIC, VERSION, TYPE_DELTA, window_bits, lookahead_bits, len(image)) + \
+        DELTA_HEADER.pack(len(base), zlib.crc32(base))
+    return header + compress(diff(base, image), window_bits, lookahead_bits)
+
+
+def unpack(packed, base=None):
+    magic, version, pack_type, window_bits, lookahead_bits, image_len = HEADER.unpack_from(packed)
+    if magic != MAGIC or version != VERSION or pack_type not in (TYPE_IMAGE, TYPE_DELTA):
+        raise ValueError("not a packed image")
+    if pack_type == TYPE_IMAGE:
+        return decompress(packed[HEADER.size:], window_bits, lookahead_bits, image_len)
+
+    base_len, base_crc = DELTA_HEADER.unpack_from(packed, HEADER.size)
+    if base is None:
+        raise ValueError("a delta, --base is needed")
+    if len(base) < base_len or zlib.crc32(base[:base_len]) != base_crc:
+        raise ValueError("the delta was made against another base image")
+    body = packed[HEADER.size + DELTA_HEADER.size:]
+    # The length of the patch itself is not recorded
+    patch = decompress(body, window_bits, lookahead_bits, None)
+    return apply_patch(base[:base_len], patch, image_len)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compress a firmware image for /ota_post")
+    parser.add_argument("input")
+    parser.add_argument("output")
+    parser.add_argument("-d", "--decompress", action="store_true", help="unpack a packed image instead")
+    parser.add_argument("-b", "--base", help="make a delta from this image, the one running on the gateway")
+    parser.add_argument("-w", "--window-bits", type=int, default=11,
+                        help="window of 2^w bytes, also the RAM the gateway needs (%d~%d)"
+                             % (WINDOW_BITS_MIN, WINDOW_BITS_MAX))
+    parser.add_argument("-l", "--lookahead-bits", type=int,
+                        help="back-references of up to 2^l bytes (3~w-1), 4 by default, w-1 for a delta")
+    args = parser.parse_args()
+
+    if args.lookahead_bits is None:
+        # The diff part of a delta is mostly long runs of zeros
+        args.lookahead_bits = args.window_bits - 1 if args.base else 4
+    if not WINDOW_BITS_MIN <= args.window_bits <= WINDOW_BITS_MAX:
+        parser.error("--window-bits must be %d~%d" % (WINDOW_BITS_MIN, WINDOW_BITS_MAX))
+    if not 3 <= args.lookahead_bits < args.window_bits:
+        parser.error("--lookahead-bits must be 3~%d" % (args.window_bits - 1))
+
+    with open(args.input, "rb") as f:
+        data = f.read()
+    base = None
+    if args.base:
+        with open(args.base, "rb") as f:
+            base = f.read()
+
+    if args.decompress:
+        try:
+            result = unpack(data, base)
+        except (ValueError, IndexError, struct.error) as e:
+            sys.exit("%s: %s" % (args.input, e))
+    else:
+        result = pack(data, args.window_bits, args.lookahead_bits, base)
+        # Catch encoder bugs before the image gets anywhere near a device
+        if unpack(result, base) != data:
+            sys.exit("internal error: the packed image does not decompress to the input")
+        print("%d -> %d bytes (%.1f%%)" % (len(data), len(result), 100.0 * len(result) / max(len(data), 1)))
+
+    with open(args.output, "wb") as f:
+        f.write(result)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,112 @@
+/*
+ * ota_patch_host.c
+ *
+ * Applies a packed image or delta (tools/ota_pack.py) on the host with the decoders of the
+ * firmware, main/ota_decomp.c and main/ota_patch.c, fed in the same small pieces as on the
+ * gateway. For checking the patch path against two images:
+ *
+ *   cc -O2 -Itools/host -Imain -o ota_patch_host tools/ota_patch_host.c main/ota_decomp.c main/ota_patch.c
+ *   tools/ota_pack.py --base old.bin new.bin delta.mbhs
+ *   ./ota_patch_host old.bin delta.mbhs out.bin && cmp out.bin new.bin
+ *
+ * The base image is only read for a delta, pass /dev/null otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ota_decomp.h"
+#include "ota_patch.h"
+
+// The receive buffer of the gateway, OTA_PACK_IN_LEN in ota.c
+#define HOST_FEED_LEN   1024
+
+typedef struct host_file {
+    FILE* f;
+    size_t len;
+} host_file_t;
+
+static esp_err_t host_read(void* ctx, size_t offset, void* buf, size_t len) {
+    host_file_t* base = ctx;
+    if (offset + len > base->len || fseek(base->f, offset, SEEK_SET) != 0 || fread(buf, 1, len, base->f) != len)
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+static esp_err_t host_write(void* ctx, const uint8_t* buf, size_t len) {
+    return fwrite(buf, 1, len, (FILE*)ctx) == len ? ESP_OK : ESP_FAIL;
+}
+
+int main(int argc, char** argv) {
+    static uint8_t in[HOST_FEED_LEN];
+    uint8_t hdr_buf[OTA_PACK_HDR_MAXLEN];
+    ota_pack_hdr_t hdr;
+    ota_decomp_t decomp;
+    ota_patch_t patch;
+    host_file_t base = {0};
+    esp_err_t err;
+    size_t len;
+
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <base image> <packed image or delta> <output image>\n", argv[0]);
+        return 2;
+    }
+
+    FILE* packed = fopen(argv[2], "rb");
+    FILE* out = fopen(argv[3], "wb");
+    if (packed == NULL || out == NULL) {
+        perror("open");
+        return 2;
+    }
+
+    len = fread(hdr_buf, 1, sizeof(hdr_buf), packed);
+    err = ota_pack_parse_header(hdr_buf, len, &hdr);
+    if (err != ESP_OK) {
+        fprintf(stderr, "%s: not a packed image (0x%x)\n", argv[2], err);
+        return 1;
+    }
+    fseek(packed, hdr.hdr_len, SEEK_SET);
+
+    if (ota_decomp_init(&decomp, &hdr) != ESP_OK)
+        return 1;
+
+    if (hdr.type == OTA_PACK_TYPE_DELTA) {
+        base.f = fopen(argv[1], "rb");
+        if (base.f == NULL) {
+            perror(argv[1]);
+            return 2;
+        }
+        fseek(base.f, 0, SEEK_END);
+        base.len = ftell(base.f);
+
+        ota_patch_init(&patch, &hdr, host_read, &base, host_write, out);
+        err = ota_patch_check_source(&patch, &hdr);
+        if (err != ESP_OK) {
+            fprintf(stderr, "%s: the delta was made against another base image (0x%x)\n", argv[1], err);
+            return 1;
+        }
+    }
+
+    while ((len = fread(in, 1, sizeof(in), packed)) > 0) {
+        if (hdr.type == OTA_PACK_TYPE_DELTA) {
+            err = ota_decomp_feed(&decomp, in, len, ota_patch_feed, &patch);
+        } else {
+            err = ota_decomp_feed(&decomp, in, len, host_write, out);
+        }
+        if (err != ESP_OK) {
+            fprintf(stderr, "%s: corrupt (0x%x)\n", argv[2], err);
+            return 1;
+        }
+    }
+
+    if (hdr.type == OTA_PACK_TYPE_DELTA ? !ota_patch_done(&patch) : decomp.out_len != hdr.image_len) {
+        fprintf(stderr, "%s: truncated\n", argv[2]);
+        return 1;
+    }
+
+    ota_decomp_free(&decomp);
+    fclose(out);
+    printf("%u bytes\n", hdr.image_len);
+    return 0;
+}
@@ -0,0 +1,368 @@
+#!/usr/bin/env python3
+"""Simulated Modbus RTU slave farm, for load and latency tests of the gateway.
+
+Serves many UIDs on one serial line: a pseudo-terminal by default (its path is
+printed on start-up), or a real serial port (--device, e.g. a USB-RS485 adapter
+wired to the gateway). Only the Python standard library is used, POSIX only.
+
+Each group of slaves has its own register map, think time distribution and
+fault injection (dropped replies, corrupted CRCs, exception 06 busy, replies
+split by a long gap). Line noise can be injected while the bus is idle.
+
+Framing follows the gateway: a request ends after 3.5 character times of silence,
+the response is written in one go. The gateway detects the end of a response
+with the UART Rx timeout (22 character times, UART_TOUT_THRESH_DEFAULT in
+modbus_rtu.c), a "split" reply with a longer gap inside is seen as two frames.
+On a pty the wire time of the response is emulated by a delay (see --no-pace).
+
+Config file (JSON), all fields optional:
+{
+    "baud": 9600, "parity": "N",
+    "noise": {"rate_hz": 0.2, "max_len": 8},
+    "slaves": [
+        {"uid": "1-10", "coils": 64, "discrete": 64, "holding": 100, "input": 100,
+         "think_ms": {"dist": "uniform", "min": 2, "max": 10},
+         "drop": 0.01, "bad_crc": 0.005, "busy": 0.0,
+         "split": {"prob": 0.0, "gap_chars": 30}}
+    ]
+}
+think_ms dist is one of "fixed" (value), "uniform" (min, max), "normal" (mean, sd)
+or "exp" (mean, plus an optional min). Input registers and discrete inputs
+change every second (value = address + seconds since start), holding registers
+and coils keep what was written.
+"""
+
+import argparse
+import json
+import os
+import random
+import select
+import signal
+import sys
+import termios
+import time
+import tty
+
+DEFAULT_SLAVE = {
+    "coils": 64, "discrete": 64, "holding": 100, "input": 100,
+    "think_ms": {"dist": "uniform", "min": 2, "max": 10},
+    "drop": 0.0, "bad_crc": 0.0, "busy": 0.0,
+    "split": {"prob": 0.0, "gap_chars": 30},
+}
+
+BAUD_CONSTANTS = {b: getattr(termios, "B%d" % b) for b in
+                  (1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600)
+                  if hasattr(termios, "B%d" % b)}
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+    return crc
+
+
+def with_crc(frame):
+    crc = crc16(frame)
+    return frame + bytes((crc & 0xFF, crc >> 8))
+
+
+def parse_uids(text):
+    uids = []
+    for part in str(text).split(","):
+        if "-" in part:
+            first, last = part.split("-")
+            uids.extend(range(int(first), int(last) + 1))
+        else:
+            uids.append(int(part))
+    return uids
+
+
+class ThinkTime:
+    def __init__(self, spec, rng):
+        self.spec = spec
+        self.rng = rng
+
+    def seconds(self):
+        s = self.spec
+        dist = s.get("dist", "fixed")
+        if dist == "fixed":
+            ms = s.get("value", 0)
+        elif dist == "uniform":
+            ms = self.rng.uniform(s["min"], s["max"])
+        elif dist == "normal":
+            ms = self.rng.gauss(s["mean"], s["sd"])
+        elif dist == "exp":
+            ms = s.get("min", 0) + self.rng.expovariate(1.0 / s["mean"])
+        else:
+            raise ValueError("unknown think_ms dist " + dist)
+        return max(0.0, ms) / 1000.0
+
+
+class Slave:
+    def __init__(self, uid, cfg, rng, start_time):
+        self.uid = uid
+        self.cfg = cfg
+        self.rng = rng
+        self.start_time = start_time
+        self.think = ThinkTime(cfg["think_ms"], rng)
+        self.coils = [0] * cfg["coils"]
+        self.holding = [0] * cfg["holding"]
+        self.stats = {"requests": 0, "replies": 0, "exceptions": 0, "dropped": 0, "bad_crc": 0, "split": 0}
+
+    def live_value(self, addr):
+        return (addr + int(time.monotonic() - self.start_time)) & 0xFFFF
+
+    @staticmethod
+    def pack_bits(bits):
+        out = bytearray((len(bits) + 7) // 8)
+        for i, bit in enumerate(bits):
+            if bit:
+                out[i // 8] |= 1 << (i % 8)
+        return bytes(out)
+
+    def handle(self, pdu):
+        """Returns the response PDU, or an exception code."""
+        fc = pdu[0]
+        if fc in (1, 2, 3, 4) and len(pdu) == 5:
+            addr = int.from_bytes(pdu[1:3], "big")
+            count = int.from_bytes(pdu[3:5], "big")
+            size = {1: self.cfg["coils"], 2: self.cfg["discrete"], 3: self.cfg["holding"], 4: self.cfg["input"]}[fc]
+            limit = 2000 if fc in (1, 2) else 125
+            if not 1 <= count <= limit:
+                return 3
+            if addr + count > size:
+                return 2
+            if fc == 1:
+                data = self.pack_bits(self.coils[addr:addr + count])
+            elif fc == 2:
+                data = self.pack_bits([self.live_value(a) & 1 for a in range(addr, addr + count)])
+            elif fc == 3:
+                data = b"".join(v.to_bytes(2, "big") for v in self.holding[addr:addr + count])
+            else:
+                data = b"".join(self.live_value(a).to_bytes(2, "big") for a in range(addr, addr + count))
+            return bytes((fc, len(data))) + data
+
+        if fc in (5, 6) and len(pdu) == 5:
+            addr = int.from_bytes(pdu[1:3], "big")
+            value = int.from_bytes(pdu[3:5], "big")
+            if fc == 5:
+                if value not in (0x0000, 0xFF00):
+                    return 3
+                if addr >= len(self.coils):
+                    return 2
+                self.coils[addr] = 1 if value else 0
+            else:
+                if addr >= len(self.holding):
+                    return 2
+                self.holding[addr] = value
+            return bytes(pdu)
+
+        if fc in (15, 16) and len(pdu) >= 6:
+            addr = int.from_bytes(pdu[1:3], "big")
+            count = int.from_bytes(pdu[3:5], "big")
+            data = pdu[6:]
+            expected = (count + 7) // 8 if fc == 15 else count * 2
+            if count == 0 or pdu[5] != expected or len(data) != expected:
+                return 3
+            if fc == 15:
+                if addr + count > len(self.coils):
+                    return 2
+                for i in range(count):
+                    self.coils[addr + i] = (data[i // 8] >> (i % 8)) & 1
+            else:
+                if addr + count > len(self.holding):
+                    return 2
+                for i in range(count):
+                    self.holding[addr + i] = int.from_bytes(data[2 * i:2 * i + 2], "big")
+            return bytes(pdu[:5])
+
+        return 1
+
+
+class Bus:
+    def __init__(self, args, cfg):
+        self.args = args
+        self.rng = random.Random(args.seed)
+        self.baud = cfg.get("baud", 9600)
+        self.parity = cfg.get("parity", "N").upper()
+        bits = 10 if self.parity == "N" else 11
+        self.char_s = bits / float(self.baud)
+        # 1.75 ms above 19200 baud, as the spec recommends
+        self.t35_s = max(3.5 * self.char_s, 0.00175)
+        self.noise = cfg.get("noise")
+        self.slaves = {}
+        start_time = time.monotonic()
+        for group in cfg.get("slaves", [{"uid": "1"}]):
+            merged = dict(DEFAULT_SLAVE)
+            merged.update(group)
+            for uid in parse_uids(group.get("uid", "1")):
+                self.slaves[uid] = Slave(uid, merged, self.rng, start_time)
+        self.stats = {"frames": 0, "bad_request_crc": 0, "other_uid": 0, "broadcasts": 0, "noise_bursts": 0}
+        self.fd = -1
+        self.pace = False
+
+    def open(self):
+        if self.args.device:
+            self.fd = os.open(self.args.device, os.O_RDWR | os.O_NOCTTY)
+            tty.setraw(self.fd)
+            attrs = termios.tcgetattr(self.fd)
+            speed = BAUD_CONSTANTS[self.baud]
+            attrs[4] = attrs[5] = speed
+            parity = self.parity
+            attrs[2] &= ~(termios.PARENB | termios.PARODD)
+            if parity != "N":
+                attrs[2] |= termios.PARENB | (termios.PARODD if parity == "O" else 0)
+            termios.tcsetattr(self.fd, termios.TCSANOW, attrs)
+            print("Serving %d slaves on %s at %d baud" % (len(self.slaves), self.args.device, self.baud), flush=True)
+        else:
+            master, slave = os.openpty()
+            tty.setraw(master)
+            tty.setraw(slave)
+            self.fd = master
+            self.slave_fd = slave   # Kept open so that the pty survives the gateway reopening it
+            self.pace = not self.args.no_pace
+            path = os.ttyname(slave)
+            print("Serving %d slaves on %s" % (len(self.slaves), path), flush=True)
+            if self.args.link:
+                if os.path.lexists(self.args.link):
+                    os.unlink(self.args.link)
+                os.symlink(path, self.args.link)
+
+    def write(self, data):
+        if self.pace:
+            # A pty delivers instantly, emulate the wire time of the frame
+            time.sleep(len(data) * self.char_s)
+        os.write(self.fd, data)
+
+    def reply(self, slave, frame):
+        cfg = slave.cfg
+        time.sleep(slave.think.seconds())
+
+        if self.rng.random() < cfg["drop"]:
+            slave.stats["dropped"] += 1
+            return
+
+        if self.rng.random() < cfg["busy"]:
+            resp = bytes((frame[1] | 0x80, 6))
+        else:
+            resp = slave.handle(frame[1:-2])
+            if isinstance(resp, int):
+                resp = bytes((frame[1] | 0x80, resp))
+        if resp[0] & 0x80:
+            slave.stats["exceptions"] += 1
+        resp = bytearray(with_crc(bytes((slave.uid,)) + resp))
+
+        if self.rng.random() < cfg["bad_crc"]:
+            resp[-1] ^= 0xFF
+            slave.stats["bad_crc"] += 1
+
+        split = cfg["split"]
+        if len(resp) > 2 and self.rng.random() < split.get("prob", 0):
+            cut = self.rng.randrange(1, len(resp))
+            self.write(bytes(resp[:cut]))
+            time.sleep(split.get("gap_chars", 30) * self.char_s)
+            self.write(bytes(resp[cut:]))
+            slave.stats["split"] += 1
+        else:
+            self.write(bytes(resp))
+        slave.stats["replies"] += 1
+
+    def handle_frame(self, frame):
+        self.stats["frames"] += 1
+        if self.args.verbose:
+            print("<- " + frame.hex(), flush=True)
+        if len(frame) < 4 or crc16(frame) != 0:
+            self.stats["bad_request_crc"] += 1
+            return
+        uid = frame[0]
+        if uid == 0:
+            # Broadcast, every slave executes it and none replies
+            self.stats["broadcasts"] += 1
+            for slave in self.slaves.values():
+                slave.handle(frame[1:-2])
+            return
+        slave = self.slaves.get(uid)
+        if slave is None:
+            self.stats["other_uid"] += 1
+            return
+        slave.stats["requests"] += 1
+        self.reply(slave, frame)
+
+    def next_noise(self):
+        if not self.noise or self.noise.get("rate_hz", 0) <= 0:
+            return float("inf")
+        return time.monotonic() + self.rng.expovariate(self.noise["rate_hz"])
+
+    def run(self):
+        frame = bytearray()
+        last_rx = 0.0
+        noise_at = self.next_noise()
+        while True:
+            if frame:
+                timeout = max(0.0, last_rx + self.t35_s - time.monotonic())
+            else:
+                timeout = max(0.0, min(noise_at - time.monotonic(), 1.0))
+            readable, _, _ = select.select([self.fd], [], [], timeout)
+            now = time.monotonic()
+            if readable:
+                try:
+                    data = os.read(self.fd, 512)
+                except OSError:
+                    # The other end of the pty is not open (yet)
+                    time.sleep(0.1)
+                    continue
+                frame += data
+                last_rx = now
+            elif frame:
+                # Silent interval, the request is complete
+                self.handle_frame(bytes(frame))
+                frame.clear()
+            elif now >= noise_at:
+                burst = bytes(self.rng.randrange(256) for _ in range(self.rng.randint(1, self.noise.get("max_len", 8))))
+                self.write(burst)
+                self.stats["noise_bursts"] += 1
+                noise_at = self.next_noise()
+
+    def report(self):
+        out = {"bus": self.stats, "slaves": {uid: s.stats for uid, s in sorted(self.slaves.items())}}
+        print(json.dumps(out, indent=2), file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulated Modbus RTU slave farm on a pty or a serial port")
+    parser.add_argument("config", nargs="?", help="JSON config file, one slave (UID 1) with the defaults if omitted")
+    parser.add_argument("--device", help="serve on this serial port instead of a new pty")
+    parser.add_argument("--link", help="symlink the pty to this path, e.g. /tmp/ttyRTU")
+    parser.add_argument("--baud", type=int, help="override the baud rate of the config")
+    parser.add_argument("--no-pace", action="store_true", help="on a pty, reply without emulating the wire time")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("-v", "--verbose", action="store_true", help="print every received frame")
+    args = parser.parse_args()
+
+    cfg = {}
+    if args.config:
+        with open(args.config) as f:
+            cfg = json.load(f)
+    if args.baud:
+        cfg["baud"] = args.baud
+    if args.device and cfg.get("baud", 9600) not in BAUD_CONSTANTS:
+        parser.error("unsupported baud rate %d" % cfg["baud"])
+
+    bus = Bus(args, cfg)
+    bus.open()
+    signal.signal(signal.SIGTERM, lambda *_: sys.exit(0))
+    try:
+        bus.run()
+    except (KeyboardInterrupt, SystemExit):
+        pass
+    finally:
+        bus.report()
+        if args.link and os.path.islink(args.link):
+            os.unlink(args.link)
+
+
+if __name__ == "__main__":
+    main()